@@ -9,64 +9,190 @@
 
 #include "CMailApp.h"
 #include "protocols/CImap.h"
+#include "protocols/CJmap.h"
+#include "protocols/CMaildir.h"
+#include "protocols/CMbox.h"
+#include "protocols/CNntp.h"
 #include "protocols/CPop3.h"
 #include "setup/CConfig.h"
+#include "system/CStartupTimeline.h"
+#include "system/CStateSnapshot.h"
+#include "system/CSyncStore.h"
+#include <QElapsedTimer>
+#include <QFileInfo>
 #include <QSessionManager>
+#include <QNetworkInformation>
+
+/*
+ * Protocol object of a mailbox definition
+ */
+IMailProtocol *CMailApp::createServer(const MAILBOX_CONFIG_T &mb)
+{
+  IMailProtocol *mp = nullptr;
+  CImap *imap = nullptr;
+  CPop3 *pop3 = nullptr;
+  const PROTOCOLS protocol = mb.m_Protocol;
+  const QString &user = mb.m_User;
+  const QString &password = mb.m_Password;
+  const QString &server = mb.m_Server;
+  const uint16_t port = mb.m_Port;
+  const QString &imap_mailbox = mb.m_ImapMailBox;
+  switch (protocol)
+  {
+  case PROTO_POP3:
+    pop3 = new CPop3(server, user, password, port, false, false);
+    break;
+  case PROTO_POP3S:
+    pop3 = new CPop3(server, user, password, port, true, true);
+    break;
+  case PROTO_IMAP4:
+    imap = new CImap(server, user, password, port, imap_mailbox, m_DebugProtocol, false,
+                     false);
+    break;
+  case PROTO_IMAP3:
+    imap = new CImap(server, user, password, port, imap_mailbox, m_DebugProtocol, false,
+                     false);
+    break;
+  case PROTO_IMAPS:
+    imap = new CImap(server, user, password, port, imap_mailbox, m_DebugProtocol, true,
+                     true);
+    break;
+  case PROTO_MAILDIR:
+    mp = new CMaildir(server);
+    break;
+  case PROTO_MBOX:
+    mp = new CMbox(server);
+    break;
+  case PROTO_JMAP:
+    mp = new CJmap(server, user, password, port, imap_mailbox, m_DebugProtocol);
+    break;
+  case PROTO_NNTP:
+    mp = new CNntp(server, user, password, port, imap_mailbox, m_DebugProtocol, false);
+    break;
+  case PROTO_NNTPS:
+    mp = new CNntp(server, user, password, port, imap_mailbox, m_DebugProtocol, true);
+    break;
+  default:
+    qCritical() << "Invalid protocol " << protocol;
+    exit(-1);
+  }
+  CMailSocket *socket = (imap != nullptr) ? static_cast<CMailSocket *>(imap) : pop3;
+  if ((socket != nullptr) && (mb.m_Auth == AUTH_OAUTH2))
+  {
+    socket->setOAuth2(mb.m_TokenUrl, mb.m_ClientId, mb.m_ClientSecret, password);
+    const QString mailbox = mb.m_MailboxName;
+    connect(socket, &CMailSocket::refreshTokenChanged, this,
+            [mailbox](const QString &token)
+            { CConfig::instance().setPassword(mailbox, token); });
+  }
+  if (imap != nullptr)
+  {
+    imap->setTransport(mb.m_Transport, mb.m_Tunnel);
+    mp = imap;
+  }
+  else if (pop3 != nullptr)
+  {
+    mp = pop3;
+  }
+  return mp;
+}
+
+/*
+ * Global settings of the monitor
+ */
+void CMailApp::applySettings(void)
+{
+  CConfig &cfg = CConfig::instance();
+  if (!CMailSocket::setTimeoutBounds(cfg.m_TimeoutMin * 1000, cfg.m_TimeoutMax * 1000))
+  {
+    qWarning() << "Invalid timeout bounds " << cfg.m_TimeoutMin << " - "
+               << cfg.m_TimeoutMax << " s ignored";
+  }
+  m_Monitor.updatePollTime(cfg.m_PollTime);
+  m_Monitor.updateConnectionLimits(cfg.m_MaxConnections, cfg.m_MaxHostConnections);
+  m_Monitor.updatePowerPolicy(cfg.m_BatteryPolicy, cfg.m_BatteryFactor,
+                              cfg.m_IdlePolicy, cfg.m_IdleTime);
+}
 
 void CMailApp::loadConfig(void)
 {
   CConfig &cfg = CConfig::instance();
+  // All mailboxes from one snapshot, a concurrent change is published
+  // as a new snapshot
+  m_Config = cfg.snapshot();
   QVector<QString> mailboxes;
-  cfg.getMailboxes(mailboxes);
-  for (int i = 0; i < mailboxes.size(); ++i)
-  {
-    IMailProtocol *mp = nullptr;
-    PROTOCOLS protocol;
-    QString user;
-    QString password;
-    QString server;
-    uint16_t port;
-    QString imap_mailbox;
-    cfg.getConfig(mailboxes[i], protocol, user, password, server, port,
-                  imap_mailbox);
-    switch (protocol)
+  mailboxes.reserve(m_Config->m_MailboxConfig.size());
+  for (const MAILBOX_CONFIG_T &mb : m_Config->m_MailboxConfig)
+  {
+    m_Monitor.addServer(mb.m_MailboxName, createServer(mb));
+    if (m_Paused.contains(mb.m_MailboxName))
     {
-    case PROTO_POP3:
-      mp = new CPop3(server, user, password, port, false, false);
-      break;
-    case PROTO_POP3S:
-      mp = new CPop3(server, user, password, port, true, true);
-      break;
-    case PROTO_IMAP4:
-      mp = new CImap(server, user, password, port, imap_mailbox, m_DebugProtocol, false,
-                     false);
-      break;
-    case PROTO_IMAP3:
-      mp = new CImap(server, user, password, port, imap_mailbox, m_DebugProtocol, false,
-                     false);
-      break;
-    case PROTO_IMAPS:
-      mp = new CImap(server, user, password, port, imap_mailbox, m_DebugProtocol, true,
-                     true);
-      break;
-    default:
-      qCritical() << "Invalid protocol " << protocol;
-      exit(-1);
+      m_Monitor.setPaused(mailboxes.size(), true);
     }
-
-    m_Monitor.addServer(mailboxes[i], mp);
+    mailboxes.append(mb.m_MailboxName);
   }
+  m_Traymenu.setMailboxes(mailboxes);
+  restoreSnapshot();
 
   qDebug() << "connect monitor";
 
-  m_Monitor.updatePollTime(cfg.m_PollTime);
+  applySettings();
   m_Monitor.start();
+  CStartupTimeline::mark("Monitor started");
   qDebug() << "monitor running";
 }
 
+/*
+ * Show the last known counts until the first polls are finished
+ */
+void CMailApp::restoreSnapshot()
+{
+  CStateSnapshot snapshot;
+  if (!snapshot.load())
+  {
+    return;
+  }
+  const QHash<QString, CStateSnapshot::SEntry> &entries = snapshot.getEntries();
+  for (auto it = entries.cbegin(); it != entries.cend(); ++it)
+  {
+    int idx = m_Monitor.findMailbox(it.key());
+    if (idx >= 0)
+    {
+      m_Monitor.restoreState(idx, it->m_Unread, it->m_Read, it->m_Updated, it->m_Error);
+    }
+  }
+  updateResult();
+}
+
+void CMailApp::saveSnapshot()
+{
+  CStateSnapshot::save(m_Monitor.stateCopy());
+  CSyncStore::instance().commit();
+}
+
 CMailApp::CMailApp(CTrayMenu &menu, bool debug_protocol) : m_Monitor(), m_Traymenu(menu),
                                                            m_DebugProtocol(debug_protocol)
 {
+  m_SnapshotTimer.setSingleShot(true);
+  m_SnapshotTimer.setInterval(SNAPSHOT_DELAY);
+  connect(&m_SnapshotTimer, &QTimer::timeout, this, &CMailApp::saveSnapshot);
+  m_ReloadTimer.setSingleShot(true);
+  m_ReloadTimer.setInterval(RELOAD_DELAY);
+  connect(&m_ReloadTimer, &QTimer::timeout, this, &CMailApp::reloadSettings);
+  connect(&m_Watcher, &QFileSystemWatcher::fileChanged, this, &CMailApp::settingsChanged);
+  const QString settings = CConfig::instance().fileName();
+  if (!QFileInfo::exists(settings) || !m_Watcher.addPath(settings))
+  {
+    qWarning() << "Can not watch " << settings;
+  }
+  // The OAuth2 servers are created again with the restored secrets,
+  // after the setup dialog with its changes
+  connect(&CConfig::instance(), &CConfig::secretsRestored, this, [this]()
+          {
+            if (!CConfig::instance().isUpdating())
+            {
+              reloadConfig();
+            } });
   if (!connect(&m_Monitor, &CMailMonitor::updateResult, this,
                &CMailApp::updateResult))
   {
@@ -86,11 +212,51 @@ CMailApp::CMailApp(CTrayMenu &menu, bool debug_protocol) : m_Monitor(), m_Trayme
   {
     qFatal() << "connect(qApp, &QGuiApplication::aboutToQuit failed";
   }
+  if (!connect(&m_ResumeDetector, &CResumeDetector::resumed, this,
+               &CMailApp::systemResumed))
+  {
+    qFatal() << "connect(&m_ResumeDetector, &CResumeDetector::resumed failed";
+  }
+  if (QNetworkInformation::loadBackendByFeatures(QNetworkInformation::Feature::Reachability))
+  {
+    QNetworkInformation *netinfo = QNetworkInformation::instance();
+    connect(netinfo, &QNetworkInformation::reachabilityChanged, this,
+            &CMailApp::reachabilityChanged);
+    m_Monitor.setOnline(netinfo->reachability() != QNetworkInformation::Reachability::Disconnected);
+  }
+  else
+  {
+    qWarning("No network information backend, assume network is online");
+  }
   loadConfig();
 }
 
+void CMailApp::refreshStale()
+{
+  CConfig &cfg = CConfig::instance();
+  if (cfg.m_StaleTime > 0)
+  {
+    m_Monitor.refreshStale(cfg.m_StaleTime * 1000LL);
+  }
+}
+
+void CMailApp::reachabilityChanged(QNetworkInformation::Reachability reachability)
+{
+  qDebug() << "reachabilityChanged " << reachability;
+  m_Monitor.setOnline(reachability != QNetworkInformation::Reachability::Disconnected);
+  updateResult();
+}
+
+void CMailApp::systemResumed(qint64 slept)
+{
+  qDebug() << "systemResumed after " << slept << "ms";
+  m_Monitor.resume();
+}
+
 void CMailApp::aboutToQuit()
 {
+  m_SnapshotTimer.stop();
+  saveSnapshot();
   halt();
 }
 
@@ -113,51 +279,202 @@ void CMailApp::updateResult()
   IconType itype = IconType::icNoMail;
   qDebug() << "Update Result";
   CConfig &cfg = CConfig::instance();
-  QVector<SMailData *> data = m_Monitor.getData();
+  const QVector<SMailState> data = m_Monitor.stateCopy();
   QString out;
   QString line;
-  for (int i = 0; i < data.size(); i++)
-  {
-    line = QString("%1 %2/%3\n")
-               .arg(data[i]->m_MailboxName, 6)
-               .arg(data[i]->m_Unread, 2)
-               .arg(data[i]->m_Read, 2);
-    out.append(line);
-    if (data[i]->m_Read > 0)
+  bool online = m_Monitor.isOnline();
+  bool stale = false;
+  bool polled = !data.isEmpty();
+  for (const SMailState &d : data)
+  {
+    stale = stale || d.m_Stale;
+    polled = polled && (d.m_Paused || (d.m_Updated.isValid() && !d.m_Stale));
+  }
+  if (!online)
+  {
+    out = tr("Offline, last known counts:\n");
+  }
+  else if (stale)
+  {
+    out = tr("Last known counts, updating:\n");
+  }
+  for (const SMailState &d : data)
+  {
+    line = QString("%1 %2/%3")
+               .arg(d.m_MailboxName, 6)
+               .arg(d.m_Unread, 2)
+               .arg(d.m_Read, 2);
+    if (d.m_Paused)
+    {
+      line.append(tr(" paused"));
+    }
+    else if (!online || d.m_Stale)
+    {
+      if (d.m_Updated.isValid())
+      {
+        line.append(tr(" (%1)").arg(d.m_Updated.toString("hh:mm")));
+      }
+    }
+    else if (d.m_BreakerOpen)
+    {
+      line.append(tr(" unreachable, retry at %1")
+                      .arg(d.m_NextProbe.toString("hh:mm")));
+    }
+    else if (d.m_AdmissionWait >= ADMISSION_NOTICE)
+    {
+      line.append(tr(" waited %1 s for a connection")
+                      .arg(d.m_AdmissionWait / 1000));
+    }
+    if (!d.m_LastError.isEmpty() && !d.m_BreakerOpen)
+    {
+      line.append(tr(" failed"));
+    }
+    out.append(line + "\n");
+    if (d.m_Read > 0)
     {
       if (itype == IconType::icNoMail)
       {
         itype = IconType::icOldMail;
       }
     }
-    if (data[i]->m_Unread > 0)
+    if (d.m_Unread > 0)
     {
       itype = IconType::icNewMail;
     }
   }
 
   m_Traymenu.show(cfg.getIcon(itype), out);
+  if (polled)
+  {
+    CStartupTimeline::mark("All mailboxes polled");
+  }
+  if (!m_SnapshotTimer.isActive())
+  {
+    m_SnapshotTimer.start();
+  }
 }
 
-QString CMailApp::getMailboxName(int configidx)
+void CMailApp::mailError(const QString &mailboxname, const QString &errtxt)
 {
-  return m_Monitor.getMailboxName(configidx);
+  qDebug() << "Error " << mailboxname << ":" << errtxt;
+
+  CConfig &cfg = CConfig::instance();
+  m_Traymenu.show(cfg.getIcon(IconType::icStopped), tr("Error\n") + errtxt);
 }
 
-void CMailApp::mailError(IMailProtocol *server, const QString &errtxt)
+void CMailApp::checkMailbox(const QString &mailboxname)
 {
-  qDebug() << "Error " << server->getServer() << " "
-           << getMailboxName(server->getConfigurationIndex()) << ":"
-           << errtxt;
+  m_Monitor.checkMailbox(m_Monitor.findMailbox(mailboxname));
+}
 
-  CConfig &cfg = CConfig::instance();
-  m_Traymenu.show(cfg.getIcon(IconType::icStopped), tr("Error\n") + errtxt);
+void CMailApp::pauseMailbox(const QString &mailboxname, bool paused)
+{
+  if (paused)
+  {
+    m_Paused.insert(mailboxname);
+  }
+  else
+  {
+    m_Paused.remove(mailboxname);
+  }
+  m_Monitor.setPaused(m_Monitor.findMailbox(mailboxname), paused);
+  updateResult();
+}
+
+/*
+ * Everything but the password, which is passed to the running server
+ */
+static bool sameDefinition(const MAILBOX_CONFIG_T &a, const MAILBOX_CONFIG_T &b)
+{
+  return (a.m_Protocol == b.m_Protocol) && (a.m_Server == b.m_Server) &&
+         (a.m_Port == b.m_Port) && (a.m_User == b.m_User) &&
+         (a.m_ImapMailBox == b.m_ImapMailBox) &&
+         (a.m_Transport == b.m_Transport) && (a.m_Tunnel == b.m_Tunnel) &&
+         (a.m_Auth == b.m_Auth) && (a.m_TokenUrl == b.m_TokenUrl) &&
+         (a.m_ClientId == b.m_ClientId) &&
+         (a.m_ClientSecret == b.m_ClientSecret);
 }
 
+/*
+ * Apply the differences between the running and the current
+ * configuration. Only removed, added and changed mailboxes are
+ * touched, the others keep their sessions and counts.
+ */
 void CMailApp::reloadConfig()
 {
-  m_Monitor.halt();
-  m_Monitor.quit();
-  m_Monitor.wait(10000);
-  loadConfig();
+  QElapsedTimer timer;
+  timer.start();
+  MailboxSnapshot config = CConfig::instance().snapshot();
+  MailboxSnapshot old = m_Config;
+  if (config == old)
+  {
+    applySettings();
+    return;
+  }
+  int removed = 0;
+  int added = 0;
+  int changed = 0;
+  bool moved = false; // The order of the mailboxes changed
+  for (const MAILBOX_CONFIG_T &mb : old->m_MailboxConfig)
+  {
+    if (!config->m_Index.contains(mb.m_MailboxName))
+    {
+      m_Monitor.removeServer(mb.m_MailboxName);
+      m_Paused.remove(mb.m_MailboxName);
+      removed++;
+    }
+  }
+  QVector<QString> mailboxes;
+  mailboxes.reserve(config->m_MailboxConfig.size());
+  for (const MAILBOX_CONFIG_T &mb : config->m_MailboxConfig)
+  {
+    int idx = old->m_Index.value(mb.m_MailboxName, -1);
+    moved = moved || (idx != mailboxes.size());
+    mailboxes.append(mb.m_MailboxName);
+    if (idx == -1)
+    {
+      m_Monitor.addServer(mb.m_MailboxName, createServer(mb));
+      added++;
+    }
+    else if (!sameDefinition(mb, old->m_MailboxConfig.at(idx)))
+    {
+      m_Monitor.replaceServer(mb.m_MailboxName, createServer(mb));
+      changed++;
+    }
+  }
+  m_Config = config;
+  applySettings();
+  if ((removed > 0) || (added > 0) || moved)
+  {
+    m_Traymenu.setMailboxes(mailboxes);
+  }
+  qInfo() << "Reload: " << added << " added, " << changed << " changed, "
+          << removed << " removed in " << timer.elapsed() << " ms";
+  updateResult();
+}
+
+/*
+ * The settings file was written, by us or by another program. Editors
+ * and QSettings replace the file, so the watch is renewed.
+ */
+void CMailApp::settingsChanged(const QString &path)
+{
+  if (!m_Watcher.files().contains(path) && QFileInfo::exists(path))
+  {
+    m_Watcher.addPath(path);
+  }
+  m_ReloadTimer.start();
+}
+
+void CMailApp::reloadSettings()
+{
+  CConfig &cfg = CConfig::instance();
+  if (cfg.isUpdating())
+  {
+    m_ReloadTimer.start(); // Not while the setup dialog is open
+    return;
+  }
+  qDebug() << "Settings file changed";
+  cfg.reload();
+  reloadConfig();
 }
@@ -12,6 +12,12 @@
 #define SRC_CMAILAPP_H_
 
 #include "traybiff.h"
+#include "setup/CConfig.h"
+#include "system/CResumeDetector.h"
+#include <QFileSystemWatcher>
+#include <QNetworkInformation>
+#include <QSet>
+#include <QTimer>
 
 class CMailApp : public QObject
 {
@@ -22,24 +28,55 @@ public:
 
   void halt(void)
   {
-    m_Monitor.halt();
-    m_Monitor.quit();
-    m_Monitor.wait(2000);
+    m_Monitor.stop();
+  }
+
+  void checkNow(void)
+  {
+    m_Monitor.checkNow();
+  }
+  void checkMailbox(const QString &mailboxname);
+
+  /*
+   * The user looks at the counts, refresh the stale mailboxes
+   */
+  void refreshStale(void);
+  void pauseMailbox(const QString &mailboxname, bool paused);
+  bool isPaused(const QString &mailboxname) const
+  {
+    return m_Paused.contains(mailboxname);
   }
 
 private:
   CMailMonitor m_Monitor;
+  CResumeDetector m_ResumeDetector;
   CTrayMenu &m_Traymenu;
   bool m_DebugProtocol;
+  QSet<QString> m_Paused;
+  QTimer m_SnapshotTimer; // Coalesce the writes of the state snapshot
+  inline const static int SNAPSHOT_DELAY = 5 * 1000;
+  MailboxSnapshot m_Config; // Configuration of the running servers
+  QFileSystemWatcher m_Watcher;
+  QTimer m_ReloadTimer; // Coalesce the changes of the settings file
+  inline const static int RELOAD_DELAY = 500;
+  // Admission waits shown in the tool tip, in ms
+  inline const static int ADMISSION_NOTICE = 1000;
 
   void loadConfig();
-  QString getMailboxName(int configidx);
+  void applySettings();
+  IMailProtocol *createServer(const MAILBOX_CONFIG_T &mb);
+  void restoreSnapshot();
 
 private slots:
   void updateResult();
-  void mailError(IMailProtocol *server, const QString &errtxt);
+  void mailError(const QString &mailboxname, const QString &errtxt);
   void saveStateRequest(QSessionManager &manager);
   void aboutToQuit();
+  void reachabilityChanged(QNetworkInformation::Reachability reachability);
+  void systemResumed(qint64 slept);
+  void saveSnapshot();
+  void settingsChanged(const QString &path);
+  void reloadSettings();
 
 public slots:
   void reloadConfig();
@@ -6,13 +6,18 @@
  * This code is distributed under the terms and conditions of the
  * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
  *
- * Implementation of HMAC MD5 and CRAM MD5
+ * Implementation of HMAC MD5, CRAM MD5 and SCRAM-SHA-256
  */
 #include "CCrypt.h"
 
 #include <QByteArray>
 #include <QCryptographicHash>
 #include <QDebug>
+#include <QElapsedTimer>
+#include <QMessageAuthenticationCode>
+#include <QMutexLocker>
+#include <QPasswordDigestor>
+#include <QRandomGenerator>
 
 QByteArray CCrypt::hmac_md5(const QString &k, const QString &text)
 {
@@ -88,3 +93,242 @@ QString CCrypt::cram_md5(const QString &user, const QString &password,
   response = response.toBase64();
   return response;
 }
+
+QByteArray CCrypt::hmac_sha256(const QByteArray &key, const QByteArray &text)
+{
+  return QMessageAuthenticationCode::hash(text, key, QCryptographicHash::Sha256);
+}
+
+void CCrypt::scramKeys(const QString &password, const QByteArray &salt,
+                       int iterations, QByteArray &clientKey,
+                       QByteArray &serverKey)
+{
+  // The lengths are part of the key, so that the same bytes split
+  // differently between password, salt and iteration count differ
+  const QByteArray utf8 = password.toUtf8();
+  QCryptographicHash hash(QCryptographicHash::Sha256);
+  hash.addData(QByteArray::number(utf8.size()) + ':');
+  hash.addData(utf8);
+  hash.addData(QByteArray::number(salt.size()) + ':');
+  hash.addData(salt);
+  hash.addData(QByteArray::number(iterations));
+  const QByteArray key = hash.result();
+  {
+    QMutexLocker lock(&m_ScramMutex);
+    auto it = m_ScramCache.constFind(key);
+    if (it != m_ScramCache.constEnd())
+    {
+      clientKey = it->m_ClientKey;
+      serverKey = it->m_ServerKey;
+      return;
+    }
+  }
+
+  QElapsedTimer timer;
+  timer.start();
+  QByteArray salted = QPasswordDigestor::deriveKeyPbkdf2(
+      QCryptographicHash::Sha256, password.toUtf8(), salt, iterations, 32);
+  clientKey = hmac_sha256(salted, "Client Key");
+  serverKey = hmac_sha256(salted, "Server Key");
+  qDebug() << "SCRAM key derivation with " << iterations << " iterations took "
+           << timer.elapsed() << " ms";
+
+  QMutexLocker lock(&m_ScramMutex);
+  if (m_ScramCache.size() >= SCRAM_CACHE_SIZE)
+  {
+    m_ScramCache.clear();
+  }
+  m_ScramCache.insert(key, SScramKeys{clientKey, serverKey});
+}
+
+void CCrypt::clearScramCache(void)
+{
+  QMutexLocker lock(&m_ScramMutex);
+  m_ScramCache.clear();
+}
+
+/*
+ * Read the DER header at pos, on success pos is the start and len the
+ * length of the content.
+ */
+static bool derHeader(const QByteArray &der, int &pos, int &len, char tag)
+{
+  if ((pos + 2 > der.size()) || (der.at(pos) != tag))
+  {
+    return false;
+  }
+  int first = static_cast<uchar>(der.at(pos + 1));
+  pos += 2;
+  if (first < 0x80)
+  {
+    len = first;
+  }
+  else
+  {
+    int bytes = first & 0x7f;
+    if ((bytes == 0) || (bytes > 3) || (pos + bytes > der.size()))
+    {
+      return false;
+    }
+    len = 0;
+    for (int i = 0; i < bytes; i++)
+    {
+      len = (len << 8) | static_cast<uchar>(der.at(pos++));
+    }
+  }
+  return pos + len <= der.size();
+}
+
+/*
+ * The hash is the one of the certificate signature, but at least
+ * SHA-256. The signature algorithm follows the tbsCertificate.
+ */
+QByteArray CCrypt::tlsServerEndPoint(const QSslCertificate &cert)
+{
+  static const QByteArray SHA384_RSA = QByteArray::fromHex("2a864886f70d01010c");
+  static const QByteArray SHA512_RSA = QByteArray::fromHex("2a864886f70d01010d");
+  static const QByteArray SHA384_ECDSA = QByteArray::fromHex("2a8648ce3d040303");
+  static const QByteArray SHA512_ECDSA = QByteArray::fromHex("2a8648ce3d040304");
+  static const QByteArray ED25519 = QByteArray::fromHex("2b6570");
+  static const QByteArray ED448 = QByteArray::fromHex("2b6571");
+
+  const QByteArray der = cert.toDer();
+  int pos = 0;
+  int len = 0;
+  if (der.isEmpty() || !derHeader(der, pos, len, 0x30) ||
+      !derHeader(der, pos, len, 0x30))
+  {
+    return QByteArray();
+  }
+  pos += len; // Skip tbsCertificate
+  if (!derHeader(der, pos, len, 0x30) || !derHeader(der, pos, len, 0x06))
+  {
+    return QByteArray();
+  }
+  const QByteArray oid = der.mid(pos, len);
+  if ((oid == ED25519) || (oid == ED448))
+  {
+    return QByteArray(); // No single hash function
+  }
+  QCryptographicHash::Algorithm algo = QCryptographicHash::Sha256;
+  if ((oid == SHA384_RSA) || (oid == SHA384_ECDSA))
+  {
+    algo = QCryptographicHash::Sha384;
+  }
+  else if ((oid == SHA512_RSA) || (oid == SHA512_ECDSA))
+  {
+    algo = QCryptographicHash::Sha512;
+  }
+  return QCryptographicHash::hash(der, algo);
+}
+
+/*
+ * The user name is not prepared with SASLprep, only "," and "=" are
+ * escaped as required.
+ */
+CScram::CScram(const QString &user, const QString &password,
+               const QByteArray &binding, bool serverPlus)
+    : m_Password(password)
+{
+  if (binding.isEmpty())
+  {
+    // No TLS or no binding defined for the certificate
+    m_Gs2Header = "n,,";
+  }
+  else if (serverPlus)
+  {
+    m_Gs2Header = "p=tls-server-end-point,,";
+    m_Binding = binding;
+  }
+  else
+  {
+    // y tells the server that the client could bind, a server which
+    // supports -PLUS rejects it, so a downgrade of the mechanism by an
+    // attacker is detected (RFC 5802, section 6)
+    m_Gs2Header = "y,,";
+  }
+  QByteArray random(NONCE_SIZE, '\0');
+  for (char &c : random)
+  {
+    c = static_cast<char>(QRandomGenerator::system()->bounded(256));
+  }
+  m_Nonce = random.toBase64();
+  QByteArray name = user.toUtf8();
+  name.replace("=", "=3D");
+  name.replace(",", "=2C");
+  m_ClientFirstBare = "n=" + name + ",r=" + m_Nonce;
+}
+
+bool CScram::clientFinal(const QByteArray &serverFirst, QByteArray &result)
+{
+  QByteArray nonce;
+  QByteArray salt;
+  int iterations = 0;
+  for (const QByteArray &attr : serverFirst.split(','))
+  {
+    if (attr.startsWith("r="))
+    {
+      nonce = attr.mid(2);
+    }
+    else if (attr.startsWith("s="))
+    {
+      salt = QByteArray::fromBase64(attr.mid(2));
+    }
+    else if (attr.startsWith("i="))
+    {
+      iterations = attr.mid(2).toInt();
+    }
+    else if (attr.startsWith("m="))
+    {
+      m_Error = "SCRAM: unsupported extension";
+      return false;
+    }
+  }
+  if ((nonce.size() <= m_Nonce.size()) || !nonce.startsWith(m_Nonce) ||
+      salt.isEmpty() || (iterations <= 0))
+  {
+    m_Error = "SCRAM: invalid server first message";
+    return false;
+  }
+
+  QByteArray clientKey;
+  QByteArray serverKey;
+  CCrypt::scramKeys(m_Password, salt, iterations, clientKey, serverKey);
+
+  const QByteArray withoutProof = "c=" + (m_Gs2Header + m_Binding).toBase64() +
+                                  ",r=" + nonce;
+  const QByteArray authMessage = m_ClientFirstBare + "," + serverFirst + "," +
+                                 withoutProof;
+  const QByteArray storedKey = QCryptographicHash::hash(clientKey, QCryptographicHash::Sha256);
+  QByteArray proof = CCrypt::hmac_sha256(storedKey, authMessage);
+  for (int i = 0; i < proof.size(); i++)
+  {
+    proof[i] = proof.at(i) ^ clientKey.at(i);
+  }
+  m_ServerSignature = CCrypt::hmac_sha256(serverKey, authMessage);
+  result = withoutProof + ",p=" + proof.toBase64();
+  return true;
+}
+
+bool CScram::verifyServer(const QByteArray &serverFinal)
+{
+  if (serverFinal.startsWith("e="))
+  {
+    m_Error = "SCRAM: " + QString::fromUtf8(serverFinal.mid(2));
+    return false;
+  }
+  const QByteArray signature = serverFinal.startsWith("v=")
+                                   ? QByteArray::fromBase64(serverFinal.mid(2))
+                                   : QByteArray();
+  uchar diff = (signature.size() == m_ServerSignature.size()) ? 0 : 1;
+  for (int i = 0; (i < signature.size()) && (i < m_ServerSignature.size()); i++)
+  {
+    diff |= signature.at(i) ^ m_ServerSignature.at(i);
+  }
+  if (m_ServerSignature.isEmpty() || (diff != 0))
+  {
+    m_Error = "SCRAM: server signature does not match";
+    return false;
+  }
+  return true;
+}
@@ -6,13 +6,17 @@
  * This code is distributed under the terms and conditions of the
  * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
  *
- * Implementation of HMAC MD5 and CRAM MD5
+ * Implementation of HMAC MD5, CRAM MD5 and SCRAM-SHA-256
  */
 
 #ifndef CCRYPT_H_
 #define CCRYPT_H_
 
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
 #include <QObject>
+#include <QSslCertificate>
 #include <QString>
 
 class CCrypt : public QObject
@@ -22,10 +26,87 @@ public:
   static QByteArray hmac_md5(const QString &k, const QString &text);
   static QString cram_md5(const QString &user, const QString &password,
                           const QString &challenge);
+  static QByteArray hmac_sha256(const QByteArray &key, const QByteArray &text);
+
+  /*
+   * ClientKey and ServerKey of SCRAM-SHA-256 (RFC 5802, RFC 7677).
+   * The salted password takes thousands of PBKDF2 iterations, so the
+   * keys are cached for each password, salt and iteration count.
+   */
+  static void scramKeys(const QString &password, const QByteArray &salt,
+                        int iterations, QByteArray &clientKey,
+                        QByteArray &serverKey);
+  static void clearScramCache(void);
+
+  /*
+   * Channel binding data of type tls-server-end-point (RFC 5929),
+   * empty if no binding is defined for the signature of the certificate
+   */
+  static QByteArray tlsServerEndPoint(const QSslCertificate &cert);
 
 private:
   CCrypt() {}
   virtual ~CCrypt() {}
+
+  struct SScramKeys
+  {
+    QByteArray m_ClientKey;
+    QByteArray m_ServerKey;
+  };
+
+  inline static QMutex m_ScramMutex;
+  inline static QHash<QByteArray, SScramKeys> m_ScramCache;
+  inline const static int SCRAM_CACHE_SIZE = 64;
+};
+
+/*
+ * Client side of one SCRAM-SHA-256 exchange. The messages are the
+ * plain SASL messages, the protocol does the base64 encoding.
+ */
+class CScram
+{
+public:
+  /*
+   * binding is the channel binding data of the connection, empty if
+   * the client can not bind. serverPlus tells that the server offers
+   * SCRAM-SHA-256-PLUS, the binding is only used then.
+   */
+  CScram(const QString &user, const QString &password,
+         const QByteArray &binding = QByteArray(), bool serverPlus = false);
+
+  /*
+   * Mechanism to request, -PLUS if the binding is used
+   */
+  const QString &mechanism(void) const
+  {
+    return m_Binding.isEmpty() ? MECHANISM : MECHANISM_PLUS;
+  }
+
+  QByteArray clientFirst(void) const
+  {
+    return m_Gs2Header + m_ClientFirstBare;
+  }
+  bool clientFinal(const QByteArray &serverFirst, QByteArray &result);
+  bool verifyServer(const QByteArray &serverFinal);
+
+  const QString &getError(void) const
+  {
+    return m_Error;
+  }
+
+  inline const static QString MECHANISM = "SCRAM-SHA-256";
+  inline const static QString MECHANISM_PLUS = "SCRAM-SHA-256-PLUS";
+
+private:
+  QString m_Password;
+  QByteArray m_Gs2Header;
+  QByteArray m_Binding;
+  QByteArray m_Nonce;
+  QByteArray m_ClientFirstBare;
+  QByteArray m_ServerSignature;
+  QString m_Error;
+
+  inline const static int NONCE_SIZE = 18;
 };
 
 #endif /* CCRYPT_H_ */
@@ -11,6 +11,9 @@
 
 #include "CImap.h"
 
+#include "CCrypt.h"
+#include "system/CSyncStore.h"
+
 CImap::CImap(const QString &server, const QString &user,
              const QString &password, uint16_t port, const QString &mailbox,
              bool debug_protocol, bool useSSL, bool allowSelfSigned)
@@ -24,24 +27,18 @@ CImap::CImap(const QString &server, const QString &user,
   clearError();
 }
 
-void CImap::createConnection(void)
-{
-  qRegisterMetaType<QAbstractSocket::SocketError>(
-      "QAbstractSocket::SocketError");
-  m_Socket = new QSslSocket(this);
-
-  connect(m_Socket,
-          QOverload<QAbstractSocket::SocketError>::of(
-              &QAbstractSocket::errorOccurred),
-          this, &CImap::socketError);
-  connect(m_Socket,
-          QOverload<const QList<QSslError> &>::of(&QSslSocket::sslErrors),
-          this, &CImap::sslErrors);
-}
-
 void CImap::end()
 {
-  if (m_Socket->state() == QTcpSocket::ConnectedState)
+  if ((m_Socket == nullptr) && (m_Tunnel == nullptr))
+  {
+    return;
+  }
+  if (isCancelled())
+  {
+    closeConnection(true);
+    return;
+  }
+  if (isConnected())
   {
     QStringList list;
     bool last;
@@ -54,7 +51,7 @@ void CImap::end()
       }
     }
   }
-  m_Socket->close();
+  closeConnection(false);
 }
 
 bool CImap::writeCmd(const QString &str)
@@ -67,7 +64,7 @@ bool CImap::writeCmd(const QString &str)
   QString cmd = QString("A%1 %2").arg(m_CmdSeq, 3, 10, QLatin1Char('0')).arg(str);
   if (m_DebugProtocol)
   {
-    qDebug() << "writeCmd " << cmd;
+    qDebug() << "writeCmd " << (str.startsWith("AUTHENTICATE") ? str.section(' ', 0, 1) : cmd);
   }
   return writeLine(cmd);
 }
@@ -112,6 +109,9 @@ bool CImap::getMail(int &unread, int &read)
   bool last;
   bool ok;
   int nummails = -1;
+  quint64 uidvalidity = 0;
+  quint64 uidnext = 0;
+  quint64 modseq = 0;
 
   clearError();
   if (!isConnected())
@@ -122,7 +122,18 @@ bool CImap::getMail(int &unread, int &read)
     return false;
   }
 
+  // The capabilities of the last connect, if the server announced
+  // none before the login
+  const QString key = syncKey();
+  CSyncStore::SState state;
+  bool stored = CSyncStore::instance().get(key, state);
+  bool condstore = m_Capabilities.isEmpty() ? state.m_Capabilities.contains("CONDSTORE")
+                                            : m_Capabilities.contains("CONDSTORE");
   QString cmd = "SELECT " + m_Mailbox;
+  if (condstore)
+  {
+    cmd += " (CONDSTORE)";
+  }
   if (!writeCmd(cmd))
   {
     return false;
@@ -133,7 +144,26 @@ bool CImap::getMail(int &unread, int &read)
     {
       break;
     }
-    if (list.at(1) == "EXISTS")
+    if ((list.size() > 2) && (list.at(0) == "OK"))
+    {
+      // Response codes "OK [UIDVALIDITY n]", "OK [UIDNEXT n]" and
+      // "OK [HIGHESTMODSEQ n]"
+      QString value = list.at(2);
+      value.chop(1);
+      if (list.at(1) == "[UIDVALIDITY")
+      {
+        uidvalidity = value.toULongLong();
+      }
+      else if (list.at(1) == "[UIDNEXT")
+      {
+        uidnext = value.toULongLong();
+      }
+      else if (list.at(1) == "[HIGHESTMODSEQ")
+      {
+        modseq = value.toULongLong();
+      }
+    }
+    if ((list.size() > 1) && (list.at(1) == "EXISTS"))
     {
       nummails = list.at(0).toInt(&ok);
       if (!ok)
@@ -152,6 +182,28 @@ bool CImap::getMail(int &unread, int &read)
     setError(err);
     return false;
   }
+  if (condstore && (list.isEmpty() || (list.at(0) != "OK")))
+  {
+    // Server dropped CONDSTORE, forget the cached capabilities
+    state.m_Capabilities.clear();
+    CSyncStore::instance().put(key, state);
+    const QString err = "SELECT with CONDSTORE failed";
+    qCritical() << err;
+    setError(err);
+    return false;
+  }
+
+  // Nothing changed since the last poll if the mailbox has the same
+  // UIDs and the modification sequence did not advance (RFC 7162)
+  if (stored && (modseq != 0) && (state.m_Unread >= 0) &&
+      (state.m_UidValidity == uidvalidity) && (state.m_UidNext == uidnext) &&
+      (state.m_ModSeq == modseq) && (state.m_Unread + state.m_Read == nummails))
+  {
+    unread = state.m_Unread;
+    read = state.m_Read;
+    return true;
+  }
+
   cmd = "SEARCH UNSEEN";
   if (!writeCmd(cmd))
   {
@@ -191,21 +243,40 @@ bool CImap::getMail(int &unread, int &read)
   }
 
   read = nummails - unread;
+
+  state.m_UidValidity = uidvalidity;
+  state.m_UidNext = uidnext;
+  state.m_ModSeq = modseq;
+  state.m_Unread = unread;
+  state.m_Read = read;
+  if (!m_Capabilities.isEmpty())
+  {
+    state.m_Capabilities = m_Capabilities;
+  }
+  CSyncStore::instance().put(key, state);
   return true;
 }
 
+QString CImap::syncKey(void) const
+{
+  return "imap:" + m_User + "@" + m_Server + ":" + QString::number(m_Port) + "/" + m_Mailbox;
+}
+
 void CImap::doWork(void)
 {
-  if (m_Socket == NULL)
+  clearError();
+  if (!connectToServer(m_Port))
   {
-    createConnection();
+    QString err = "P: Can not connect to host " + m_Server + " " + QString::number(m_Port) + ": " + m_ConnectError;
+    setError(err);
+    qCritical() << err;
+    return;
   }
-  clearError();
-  if (m_UseSSL)
+  if (m_UseSSL && !isTunnel())
   {
     m_Socket->setPeerVerifyMode(QSslSocket::VerifyNone);
-    m_Socket->connectToHostEncrypted(m_Server, m_Port);
-    if (!m_Socket->waitForEncrypted(TIMEOUT))
+    m_Socket->startClientEncryption();
+    if (!waitForEncrypted())
     {
       QString err = "E: Can not connect to host " + m_Server + " " + QString::number(m_Port) + ": " + m_Socket->errorString();
       qCritical() << err;
@@ -213,22 +284,12 @@ void CImap::doWork(void)
       return;
     }
   }
-  else
-  {
-    m_Socket->connectToHost(m_Server, m_Port);
-
-    if (!m_Socket->waitForConnected(TIMEOUT))
-    {
-      QString err = "P: Can not connect to host " + m_Server + " " + QString::number(m_Port) + ": " + m_Socket->errorString();
-      setError(err);
-      qCritical() << err;
-      return;
-    }
-  }
+  setPhase(TimeoutPhase::tpLogin);
   if (!startProtocol())
   {
     return;
   }
+  setPhase(TimeoutPhase::tpCommand);
 
   int unread;
   int read;
@@ -265,6 +326,15 @@ bool CImap::startProtocol()
     return false;
   }
   s = list.takeFirst();
+  if (s == "PREAUTH")
+  {
+    // Already authenticated by the tunnel, e.g. imapd started by ssh
+    if (m_DebugProtocol)
+    {
+      qDebug() << "PREAUTH " << list;
+    }
+    return true;
+  }
   if (s != "OK")
   {
     const QString err = "Error on connection";
@@ -273,6 +343,8 @@ bool CImap::startProtocol()
     end();
     return false;
   }
+  m_Capabilities.clear();
+  bool capability = false;
   QStringListIterator li(list);
   while (li.hasNext())
   {
@@ -286,6 +358,20 @@ bool CImap::startProtocol()
     {
       m_StartTLS = true;
     }
+    // Capabilities in the greeting: "* OK [CAPABILITY IMAP4rev1 ...] ready"
+    if (s == "[CAPABILITY")
+    {
+      capability = true;
+    }
+    else if (capability)
+    {
+      capability = !s.endsWith(']');
+      if (!capability)
+      {
+        s.chop(1);
+      }
+      m_Capabilities.append(s);
+    }
   }
   if (!imap)
   {
@@ -299,12 +385,203 @@ bool CImap::startProtocol()
   return success;
 }
 
+bool CImap::readCapabilities()
+{
+  QStringList list;
+  bool last;
+  m_Capabilities.clear();
+  if (!writeCmd(QString("CAPABILITY")))
+  {
+    return false;
+  }
+  while (readResponse(list, last))
+  {
+    if (last)
+    {
+      m_StartTLS = m_StartTLS || m_Capabilities.contains("STARTTLS");
+      return !list.isEmpty() && (list.at(0) == "OK");
+    }
+    if (!list.isEmpty() && (list.at(0) == "CAPABILITY"))
+    {
+      m_Capabilities = list.mid(1);
+    }
+  }
+  return false;
+}
+
+/*
+ * Read a "+ base64" continuation request. Returns false without an
+ * error if the server finished the command with NO or BAD.
+ */
+bool CImap::readContinuation(QByteArray &data)
+{
+  QStringList list;
+  do
+  {
+    if (!readLine(list))
+    {
+      const QString err = "Read error during authentication";
+      qCritical() << err;
+      setError(err);
+      return false;
+    }
+  } while (list.at(0) == "*");
+  if (list.at(0) == "+")
+  {
+    data = QByteArray::fromBase64(list.value(1).toLatin1());
+    return true;
+  }
+  qInfo() << "Authentication rejected " << list.mid(1).join(' ');
+  return false;
+}
+
+/*
+ * SASL SCRAM-SHA-256 (RFC 7677), with channel binding to the TLS
+ * certificate of the server if it offers SCRAM-SHA-256-PLUS.
+ */
+bool CImap::authenticateScram()
+{
+  QByteArray binding;
+  const bool serverPlus = m_Capabilities.contains("AUTH=" + CScram::MECHANISM_PLUS);
+  if (!isTunnel() && m_Socket->isEncrypted())
+  {
+    binding = CCrypt::tlsServerEndPoint(m_Socket->peerCertificate());
+  }
+  CScram scram(m_User, m_Password, binding, serverPlus);
+  if (!m_Capabilities.contains("AUTH=" + CScram::MECHANISM) &&
+      (scram.mechanism() != CScram::MECHANISM_PLUS))
+  {
+    return false; // Only -PLUS offered, but the client can not bind
+  }
+  QByteArray challenge;
+  QByteArray response;
+
+  writeCmd("AUTHENTICATE " + scram.mechanism());
+  if (!readContinuation(challenge))
+  {
+    return false;
+  }
+  writeLine(scram.clientFirst().toBase64());
+  if (!readContinuation(challenge))
+  {
+    return false;
+  }
+  if (!scram.clientFinal(challenge, response))
+  {
+    writeLine(QString("*"));
+    qCritical() << scram.getError();
+    setError(scram.getError());
+    return false;
+  }
+  writeLine(response.toBase64());
+  if (!readContinuation(challenge))
+  {
+    return false;
+  }
+  if (!scram.verifyServer(challenge))
+  {
+    // Do not fall back to a weaker method with an untrusted server
+    writeLine(QString("*"));
+    qCritical() << scram.getError();
+    setError(scram.getError());
+    return false;
+  }
+  writeLine(QString(""));
+
+  QStringList list;
+  bool last;
+  while (readResponse(list, last))
+  {
+    if (last)
+    {
+      return !list.isEmpty() && (list.at(0) == "OK");
+    }
+  }
+  return false;
+}
+
+/*
+ * SASL OAUTHBEARER (RFC 7628) or XOAUTH2 with the access token. A
+ * rejected token is answered with an error as continuation, which the
+ * client acknowledges before the command fails.
+ */
+bool CImap::authenticateOAuth2()
+{
+  QString token;
+  if (!getAccessToken(token))
+  {
+    return false;
+  }
+  bool bearer = m_Capabilities.contains("AUTH=OAUTHBEARER");
+  if (!bearer && !m_Capabilities.contains("AUTH=XOAUTH2"))
+  {
+    const QString err = "Server does not support OAuth2";
+    qCritical() << err;
+    setError(err);
+    return false;
+  }
+  const QString mechanism = bearer ? "OAUTHBEARER" : "XOAUTH2";
+  const QByteArray response = bearer ? COAuth2::oauthBearer(m_User, m_Server, m_Port, token)
+                                     : COAuth2::xoauth2(m_User, token);
+  QStringList list;
+  if (m_Capabilities.contains("SASL-IR"))
+  {
+    writeCmd("AUTHENTICATE " + mechanism + " " + response.toBase64());
+  }
+  else
+  {
+    QByteArray challenge;
+    writeCmd("AUTHENTICATE " + mechanism);
+    if (!readContinuation(challenge))
+    {
+      if (m_Error.isEmpty())
+      {
+        setError("OAuth2 authentication failed");
+      }
+      return false;
+    }
+    writeLine(response.toBase64());
+  }
+  do
+  {
+    if (!readLine(list))
+    {
+      const QString err = "Read error during authentication";
+      qCritical() << err;
+      setError(err);
+      return false;
+    }
+  } while (list.at(0) == "*");
+  if (list.at(0) == "+")
+  {
+    qWarning() << "OAuth2 error " << QByteArray::fromBase64(list.value(1).toLatin1());
+    writeLine(bearer ? QString("AQ==") : QString(""));
+    if (!readLine(list))
+    {
+      list.clear();
+    }
+  }
+  if (list.value(1) == "OK")
+  {
+    return true;
+  }
+  m_OAuth->invalidate();
+  const QString err = "Login failed " + list.mid(2).join(' ');
+  qCritical() << err;
+  setError(err);
+  return false;
+}
+
 bool CImap::login()
 {
   QString str;
   QStringList list;
 
-  if (m_StartTLS)
+  if (m_Capabilities.isEmpty() && !readCapabilities())
+  {
+    qWarning("CAPABILITY failed");
+  }
+  if (m_StartTLS && !isTunnel())
   {
     str = "STARTTLS";
     writeCmd(str);
@@ -320,7 +597,48 @@ bool CImap::login()
         m_Socket->setPeerVerifyMode(QSslSocket::VerifyNone);
       }
       m_Socket->startClientEncryption();
+      if (!waitForEncrypted())
+      {
+        const QString err = "STARTTLS failed: " + m_Socket->errorString();
+        qCritical() << err;
+        setError(err);
+        end();
+        return false;
+      }
+      // Capabilities before STARTTLS must be discarded (RFC 3501)
+      readCapabilities();
+    }
+  }
+  if (m_OAuth != nullptr)
+  {
+    // The password is a refresh token, never send it
+    if (authenticateOAuth2())
+    {
+      return true;
+    }
+    end();
+    return false;
+  }
+  if (m_Capabilities.contains("AUTH=" + CScram::MECHANISM) ||
+      m_Capabilities.contains("AUTH=" + CScram::MECHANISM_PLUS))
+  {
+    QElapsedTimer timer;
+    timer.start();
+    bool ok = authenticateScram();
+    if (m_DebugProtocol)
+    {
+      qDebug() << "SCRAM authentication took " << timer.elapsed() << " ms";
     }
+    if (ok)
+    {
+      return true;
+    }
+    if (!m_Error.isEmpty())
+    {
+      end();
+      return false;
+    }
+    qInfo("SCRAM-SHA-256 failed");
   }
   // Plaintext authentication
   str = "LOGIN " + m_User + " " + m_Password;
@@ -345,15 +663,3 @@ bool CImap::login()
   }
   return true;
 }
-
-// Slots
-
-void CImap::socketError(QAbstractSocket::SocketError error)
-{
-  qCritical() << "Socket error " << error;
-}
-
-void CImap::sslErrors(const QList<QSslError> &errors)
-{
-  qCritical() << "sslErrors" << errors;
-}
@@ -35,10 +35,14 @@ private:
   bool writeCmd(const QString &str);
   bool startProtocol(void);
   bool login(void);
+  bool readCapabilities(void);
+  bool readContinuation(QByteArray &data);
+  bool authenticateScram(void);
+  bool authenticateOAuth2(void);
   bool readResponse(QStringList &list, bool &last);
   void end(void);
   bool getMail(int &unread, int &read);
-  void createConnection(void);
+  QString syncKey(void) const;
 
   QString m_User = "";
   QString m_Password = "";
@@ -46,21 +50,37 @@ private:
   uint16_t m_Port = 0;
   uint16_t m_CmdSeq = 0;
   bool m_StartTLS = false;
+  QStringList m_Capabilities;
   bool m_AllowSelfSigned = false;
   bool m_DebugProtocol;
+
+  /*
+   * The verb follows the tag, UID is a prefix of the real command
+   */
+  QString commandVerb(const QString &line) const override
+  {
+    QString verb = line.section(QChar(' '), 1, 1).toUpper();
+    if (verb == "UID")
+    {
+      verb = line.section(QChar(' '), 1, 2).toUpper();
+    }
+    return verb;
+  }
+
   /*
    * Set a new password
    */
   void updatePassword(const QString newpasswd) override
   {
     m_Password = newpasswd;
+    if (m_OAuth != nullptr)
+    {
+      m_OAuth->setRefreshToken(newpasswd);
+    }
   }
 
 public slots:
   void doWork(void) override;
-private slots:
-  void socketError(QAbstractSocket::SocketError error);
-  void sslErrors(const QList<QSslError> &errors);
 };
 
 #endif /* CIMAP_H_ */
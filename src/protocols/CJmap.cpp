@@ -0,0 +1,441 @@
+/*
+ * CJmap.cpp
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Implementation of the JMAP protocol (RFC 8620, RFC 8621).
+ *
+ * The first poll fetches the counts of all mailboxes with one
+ * Mailbox/get. Later polls send Mailbox/changes with the last state
+ * and get the changed mailboxes in the same request, so an idle poll
+ * transfers only the unchanged state. State changes pushed by the
+ * EventSource channel trigger the same update immediately.
+ */
+
+#include "CJmap.h"
+
+#include <QDebug>
+#include <QEventLoop>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+static const QJsonArray MAILBOX_PROPERTIES = {"name", "role", "totalEmails",
+                                              "unreadEmails"};
+
+CJmap::CJmap(const QString &server, const QString &user,
+             const QString &password, uint16_t port, const QString &mailbox,
+             bool debug_protocol)
+    : m_User(user), m_Password(password), m_Mailbox(mailbox), m_Port(port),
+      m_DebugProtocol(debug_protocol)
+{
+  setServer(server);
+  clearError();
+}
+
+CJmap::~CJmap()
+{
+  if (m_Push != nullptr)
+  {
+    disconnect(m_Push, nullptr, this, nullptr);
+    m_Push->abort();
+  }
+}
+
+void CJmap::stopPush(void)
+{
+  if (m_Push == nullptr)
+  {
+    return;
+  }
+  disconnect(m_Push, nullptr, this, nullptr);
+  m_Push->abort();
+  m_Push->deleteLater();
+  m_Push = nullptr;
+  m_PushActive = false;
+  m_PushPending = false;
+}
+
+/*
+ * The server is a host name or an URL
+ */
+QUrl CJmap::baseUrl(void) const
+{
+  if (m_Server.contains("://"))
+  {
+    return QUrl(m_Server);
+  }
+  QUrl url;
+  url.setScheme("https");
+  url.setHost(m_Server);
+  if ((m_Port != 0) && (m_Port != 443))
+  {
+    url.setPort(m_Port);
+  }
+  return url;
+}
+
+QNetworkRequest CJmap::makeRequest(const QUrl &url) const
+{
+  QNetworkRequest request(url);
+  QByteArray credentials = (m_User + ":" + m_Password).toUtf8().toBase64();
+  request.setRawHeader("Authorization", "Basic " + credentials);
+  request.setHeader(QNetworkRequest::ContentTypeHeader, "application/json");
+  request.setTransferTimeout(TIMEOUT);
+  return request;
+}
+
+/*
+ * Wait for the reply without blocking the event processing of the
+ * server thread, so that the poll can be cancelled.
+ */
+bool CJmap::waitForReply(QNetworkReply *reply, QByteArray &data)
+{
+  QEventLoop loop;
+  connect(reply, &QNetworkReply::finished, &loop, &QEventLoop::quit);
+  connect(this, &IMailProtocol::cancelRequested, &loop, &QEventLoop::quit);
+  while (!reply->isFinished() && !isCancelled())
+  {
+    loop.exec(QEventLoop::ExcludeUserInputEvents);
+  }
+  if (!reply->isFinished())
+  {
+    reply->abort();
+    reply->deleteLater();
+    return false;
+  }
+  data = reply->readAll();
+  addTransferred(data.size());
+  reply->deleteLater();
+  if (reply->error() != QNetworkReply::NoError)
+  {
+    setError("JMAP request " + reply->url().toString() + " failed: " + reply->errorString());
+    return false;
+  }
+  if (m_DebugProtocol)
+  {
+    qDebug() << "JMAP " << data;
+  }
+  return true;
+}
+
+bool CJmap::fetchSession(void)
+{
+  QUrl url = baseUrl().resolved(QUrl("/.well-known/jmap"));
+  QByteArray data;
+  if (!waitForReply(m_Manager->get(makeRequest(url)), data))
+  {
+    return false;
+  }
+  QJsonObject session = QJsonDocument::fromJson(data).object();
+  m_ApiUrl = url.resolved(QUrl(session["apiUrl"].toString()));
+  m_EventSourceUrl = session["eventSourceUrl"].toString();
+  m_AccountId = session["primaryAccounts"].toObject()[CAP_MAIL].toString();
+  if (m_ApiUrl.isEmpty() || m_AccountId.isEmpty())
+  {
+    setError("JMAP session without mail account");
+    m_ApiUrl.clear();
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Send a batch of method calls, the responses are in the same order
+ */
+bool CJmap::post(const QJsonArray &calls, QJsonArray &responses)
+{
+  QJsonObject body{{"using", QJsonArray{CAP_CORE, CAP_MAIL}},
+                   {"methodCalls", calls}};
+  QByteArray request = QJsonDocument(body).toJson(QJsonDocument::Compact);
+  addTransferred(request.size());
+  QByteArray data;
+  if (!waitForReply(m_Manager->post(makeRequest(m_ApiUrl), request), data))
+  {
+    return false;
+  }
+  QJsonParseError err;
+  QJsonDocument doc = QJsonDocument::fromJson(data, &err);
+  if (err.error != QJsonParseError::NoError)
+  {
+    setError("JMAP invalid response: " + err.errorString());
+    return false;
+  }
+  responses = doc.object()["methodResponses"].toArray();
+  return true;
+}
+
+void CJmap::storeMailboxes(const QJsonArray &list)
+{
+  for (const auto &value : list)
+  {
+    QJsonObject obj = value.toObject();
+    SMailbox &mb = m_Mailboxes[obj["id"].toString()];
+    if (obj.contains("name"))
+    {
+      mb.m_Name = obj["name"].toString();
+    }
+    if (obj.contains("role"))
+    {
+      mb.m_Role = obj["role"].toString();
+    }
+    mb.m_Total = obj["totalEmails"].toInt(mb.m_Total);
+    mb.m_Unread = obj["unreadEmails"].toInt(mb.m_Unread);
+  }
+}
+
+bool CJmap::fetchMailboxes(void)
+{
+  QJsonArray calls{QJsonArray{"Mailbox/get",
+                              QJsonObject{{"accountId", m_AccountId},
+                                          {"ids", QJsonValue::Null},
+                                          {"properties", MAILBOX_PROPERTIES}},
+                              "0"}};
+  QJsonArray responses;
+  if (!post(calls, responses))
+  {
+    return false;
+  }
+  QJsonArray response = responses.at(0).toArray();
+  if (response.at(0).toString() != "Mailbox/get")
+  {
+    setError("JMAP Mailbox/get failed: " + response.at(1).toObject()["type"].toString());
+    return false;
+  }
+  QJsonObject result = response.at(1).toObject();
+  m_Mailboxes.clear();
+  storeMailboxes(result["list"].toArray());
+  m_State = result["state"].toString();
+  return true;
+}
+
+/*
+ * Get the changes since m_State and the changed mailboxes in one
+ * request using result references.
+ */
+bool CJmap::fetchChanges(void)
+{
+  auto getChanged = [this](const QString &path, const QString &id)
+  {
+    QJsonObject ref{{"resultOf", "0"}, {"name", "Mailbox/changes"}, {"path", path}};
+    return QJsonArray{"Mailbox/get",
+                      QJsonObject{{"accountId", m_AccountId},
+                                  {"#ids", ref},
+                                  {"properties", MAILBOX_PROPERTIES}},
+                      id};
+  };
+
+  for (int i = 0; i < MAX_CHANGES; i++)
+  {
+    QJsonArray calls{QJsonArray{"Mailbox/changes",
+                                QJsonObject{{"accountId", m_AccountId},
+                                            {"sinceState", m_State}},
+                                "0"},
+                     getChanged("/created", "1"), getChanged("/updated", "2")};
+    QJsonArray responses;
+    if (!post(calls, responses))
+    {
+      return false;
+    }
+    QJsonArray changes = responses.at(0).toArray();
+    if (changes.at(0).toString() != "Mailbox/changes")
+    {
+      // e.g. cannotCalculateChanges, start over
+      qInfo() << "JMAP Mailbox/changes: " << changes.at(1).toObject()["type"].toString();
+      return fetchMailboxes();
+    }
+    QJsonObject result = changes.at(1).toObject();
+    for (const auto &id : result["destroyed"].toArray())
+    {
+      m_Mailboxes.remove(id.toString());
+    }
+    for (int j = 1; j < responses.size(); j++)
+    {
+      QJsonArray get = responses.at(j).toArray();
+      if (get.at(0).toString() == "Mailbox/get")
+      {
+        storeMailboxes(get.at(1).toObject()["list"].toArray());
+      }
+    }
+    m_State = result["newState"].toString();
+    if (!result["hasMoreChanges"].toBool())
+    {
+      return true;
+    }
+  }
+  return fetchMailboxes();
+}
+
+bool CJmap::update(void)
+{
+  if (m_ApiUrl.isEmpty() && !fetchSession())
+  {
+    return false;
+  }
+  if (m_State.isEmpty())
+  {
+    return fetchMailboxes();
+  }
+  return fetchChanges();
+}
+
+void CJmap::reportCounts(void)
+{
+  int total = 0;
+  int unread = 0;
+  for (const auto &mb : std::as_const(m_Mailboxes))
+  {
+    if (m_Mailbox.isEmpty() ||
+        (mb.m_Name.compare(m_Mailbox, Qt::CaseInsensitive) == 0) ||
+        (mb.m_Role.compare(m_Mailbox, Qt::CaseInsensitive) == 0))
+    {
+      total += mb.m_Total;
+      unread += mb.m_Unread;
+    }
+  }
+  emit resultReady(getConfigurationIndex(), unread, total - unread);
+}
+
+/*
+ * Subscribe to the state changes of the mailboxes
+ */
+void CJmap::startPush(void)
+{
+  if ((m_Push != nullptr) || m_EventSourceUrl.isEmpty())
+  {
+    return;
+  }
+  QString url = m_EventSourceUrl;
+  url.replace("{types}", "Mailbox");
+  url.replace("{closeafter}", "no");
+  url.replace("{ping}", QString::number(PING));
+  QNetworkRequest request = makeRequest(m_ApiUrl.resolved(QUrl(url)));
+  request.setRawHeader("Accept", "text/event-stream");
+  // A ping arrives every PING s
+  request.setTransferTimeout(2 * PING * 1000);
+  m_PushBuffer.clear();
+  m_Push = m_Manager->get(request);
+  connect(m_Push, &QIODevice::readyRead, this, &CJmap::pushReadyRead);
+  connect(m_Push, &QNetworkReply::finished, this, &CJmap::pushFinished);
+  // The stream is open when the server accepted it
+  connect(m_Push, &QNetworkReply::metaDataChanged, this,
+          [this]()
+          {
+            m_PushActive =
+                m_Push->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() == 200;
+          });
+}
+
+void CJmap::pushReadyRead(void)
+{
+  QByteArray data = m_Push->readAll();
+  addTransferred(data.size());
+  m_PushBuffer += data;
+  m_PushBuffer.replace("\r\n", "\n");
+  qsizetype end;
+  bool changed = false;
+  while ((end = m_PushBuffer.indexOf("\n\n")) >= 0)
+  {
+    const QList<QByteArray> lines = m_PushBuffer.left(end).split('\n');
+    m_PushBuffer.remove(0, end + 2);
+    QByteArray event = "state";
+    QByteArray payload;
+    for (const auto &line : lines)
+    {
+      if (line.startsWith("event:"))
+      {
+        event = line.mid(6).trimmed();
+      }
+      else if (line.startsWith("data:"))
+      {
+        payload += line.mid(5).trimmed();
+      }
+    }
+    if (event != "state")
+    {
+      continue; // ping
+    }
+    QJsonObject change = QJsonDocument::fromJson(payload).object();
+    QString state = change["changed"].toObject()[m_AccountId].toObject()["Mailbox"].toString();
+    changed = changed || (!state.isEmpty() && (state != m_State));
+  }
+  if (changed)
+  {
+    if (m_DebugProtocol)
+    {
+      qDebug() << "JMAP push, mailbox state changed";
+    }
+    pushUpdate();
+  }
+}
+
+void CJmap::pushFinished(void)
+{
+  qInfo() << "JMAP push channel closed: " << m_Push->errorString();
+  m_Push->deleteLater();
+  m_Push = nullptr;
+  m_PushActive = false;
+  // Reconnected by the next poll
+}
+
+/*
+ * Update the counts after a pushed state change. Changes pushed while
+ * the request is running are fetched afterwards.
+ */
+void CJmap::pushUpdate(void)
+{
+  if (m_Busy)
+  {
+    m_PushPending = true;
+    return;
+  }
+  m_Busy = true;
+  do
+  {
+    m_PushPending = false;
+    clearError();
+    if (update())
+    {
+      reportCounts();
+    }
+  } while (m_PushPending && m_Error.isEmpty() && !isCancelled());
+  m_Busy = false;
+}
+
+void CJmap::doWork(void)
+{
+  clearError();
+  if (m_Manager == nullptr)
+  {
+    // Created here, so that it lives in the server thread
+    m_Manager = new QNetworkAccessManager(this);
+  }
+  if (m_Busy)
+  {
+    // A pushed update is running, fetch again when it is finished
+    m_PushPending = true;
+    return;
+  }
+  m_Busy = true;
+  m_PushPending = false;
+  bool ok = update();
+  m_Busy = false;
+  if (!ok)
+  {
+    if (!isCancelled())
+    {
+      qCritical() << m_Error;
+      m_ApiUrl.clear(); // Fetch the session again
+    }
+    return;
+  }
+  reportCounts();
+  startPush();
+  if (m_PushPending)
+  {
+    m_PushPending = false;
+    pushUpdate();
+  }
+}
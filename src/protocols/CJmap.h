@@ -0,0 +1,104 @@
+/*
+ * CJmap.h
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Implementation of the JMAP protocol (RFC 8620, RFC 8621).
+ */
+
+#ifndef CJMAP_H_
+#define CJMAP_H_
+
+#include <QHash>
+#include <QJsonArray>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QString>
+#include <QUrl>
+
+#include "IMailProtocol.h"
+
+class CJmap : public IMailProtocol
+{
+  Q_OBJECT
+public:
+  CJmap(const QString &server, const QString &user, const QString &password,
+        uint16_t port, const QString &mailbox, bool debug_protocol);
+  virtual ~CJmap();
+
+  /*
+   * Set a new password
+   */
+  void updatePassword(const QString newpasswd) override
+  {
+    m_Password = newpasswd;
+  }
+
+  /*
+   * The server may be given as URL
+   */
+  QString endpoint(void) const override
+  {
+    return baseUrl().host().toLower();
+  }
+
+public slots:
+  void doWork(void) override;
+  void stopPush(void) override;
+
+private slots:
+  void pushReadyRead(void);
+  void pushFinished(void);
+
+private:
+  struct SMailbox
+  {
+    QString m_Name;
+    QString m_Role;
+    int m_Total = 0;
+    int m_Unread = 0;
+  };
+
+  QUrl baseUrl(void) const;
+  QNetworkRequest makeRequest(const QUrl &url) const;
+  bool waitForReply(QNetworkReply *reply, QByteArray &data);
+  bool post(const QJsonArray &calls, QJsonArray &responses);
+  bool fetchSession(void);
+  bool fetchMailboxes(void);
+  bool fetchChanges(void);
+  bool update(void);
+  void storeMailboxes(const QJsonArray &list);
+  void reportCounts(void);
+  void startPush(void);
+  void pushUpdate(void);
+
+  QString m_User;
+  QString m_Password;
+  QString m_Mailbox; // Name or role of the counted mailbox, empty for all
+  uint16_t m_Port = 0;
+  bool m_DebugProtocol = false;
+
+  QNetworkAccessManager *m_Manager = nullptr;
+  QUrl m_ApiUrl;
+  QString m_EventSourceUrl;
+  QString m_AccountId;
+  QString m_State; // Mailbox state for Mailbox/changes
+  QHash<QString, SMailbox> m_Mailboxes;
+
+  QNetworkReply *m_Push = nullptr;
+  QByteArray m_PushBuffer;
+  bool m_Busy = false;        // A request is running
+  bool m_PushPending = false; // State change pushed while busy
+
+  inline const static QString CAP_CORE = "urn:ietf:params:jmap:core";
+  inline const static QString CAP_MAIL = "urn:ietf:params:jmap:mail";
+  inline const static int TIMEOUT = 30 * 1000;
+  inline const static int PING = 300; // s, keep alive of the push channel
+  inline const static int MAX_CHANGES = 10; // Mailbox/changes rounds per update
+};
+
+#endif /* CJMAP_H_ */
@@ -10,99 +10,886 @@
  */
 
 #include "CMailMonitor.h"
+#include "COAuth2.h"
 #include "setup/CConfig.h"
 
+#include <QRandomGenerator>
+#include <algorithm>
+
 CMailMonitor::CMailMonitor() : m_Running(false)
 {
   CConfig &inst = CConfig::instance();
   m_Polltime = inst.m_PollTime;
+  m_MaxConnections = inst.m_MaxConnections;
+  m_MaxHostConnections = inst.m_MaxHostConnections;
+  m_Policy.setBatteryPolicy(inst.m_BatteryPolicy, inst.m_BatteryFactor);
+  m_Policy.setIdlePolicy(inst.m_IdlePolicy, inst.m_IdleTime);
   connect(&inst, &CConfig::updatePassword, this, &CMailMonitor::updatePassword);
 }
 
-void CMailMonitor::updatePassword(const QString &mailbox, const QString &password)
+/*
+ * run() gives the server threads at most STOP_TIMEOUT, so the monitor
+ * thread finishes. Server threads which are still blocked are left to
+ * the end of the process, destroying a running QThread aborts.
+ */
+CMailMonitor::~CMailMonitor()
 {
-  for (auto data : m_Data)
+  halt();
+  wait();
+  qDeleteAll(m_Retired);
+  QList<QThread *> threads = m_Stopping + m_Detached;
+  QDeadlineTimer deadline(STOP_TIMEOUT);
+  for (QThread *thread : std::as_const(threads))
   {
-    if (data->m_MailboxName == mailbox)
+    if (!thread->wait(deadline))
     {
-      data->m_Server->updatePassword(password);
-      break;
+      qWarning("Server thread still running at exit, left running");
+      thread->setParent(nullptr);
     }
   }
 }
 
+bool CMailMonitor::stop(void)
+{
+  halt();
+  quit();
+  // run() waits at most STOP_TIMEOUT for the servers
+  if (wait(2 * STOP_TIMEOUT))
+  {
+    return true;
+  }
+  qWarning() << "Mail monitor did not stop within " << 2 * STOP_TIMEOUT << " ms";
+  return false;
+}
+
+/*
+ * The server uses the password in its own thread, so it is set there
+ * between two polls
+ */
+void CMailMonitor::updatePassword(const QString &mailbox, const QString &password)
+{
+  QMutexLocker lock(&m_Mutex);
+  int idx = m_Index.value(mailbox, -1);
+  if (idx == -1)
+  {
+    return;
+  }
+  IMailProtocol *server = m_Data[idx]->m_Server;
+  QMetaObject::invokeMethod(
+      server, [server, password]() { server->updatePassword(password); },
+      Qt::QueuedConnection);
+}
+
 void CMailMonitor::addServer(const QString &mailboxname, IMailProtocol *server)
 {
   auto *data = new (SMailData);
-  auto *thread = new QThread(this);
-  server->moveToThread(thread);
-  server->setConfigurationIndex(m_Data.size());
-  data->m_Server = server;
-  data->m_Thread = thread;
   data->m_MailboxName = mailboxname;
   data->m_Read = -1;
   data->m_Unread = -1;
+  data->m_Stale = false;
+  data->m_Paused = false;
 
+  QMutexLocker lock(&m_Mutex);
+  attachServer(data, server);
+  m_Index.insert(mailboxname, m_Data.size());
   m_Data.append(data);
+  if (m_Running)
+  {
+    data->m_CheckRequested = true;
+    m_CheckNow = true;
+    m_WakeUp.wakeAll();
+  }
+}
+
+void CMailMonitor::replaceServer(const QString &mailboxname, IMailProtocol *server)
+{
+  QMutexLocker lock(&m_Mutex);
+  int idx = m_Index.value(mailboxname, -1);
+  if (idx == -1)
+  {
+    lock.unlock();
+    addServer(mailboxname, server);
+    return;
+  }
+  SMailData *data = m_Data[idx];
+  IMailProtocol *oldserver = data->m_Server;
+  QThread *oldthread = data->m_Thread;
+  m_Admission.removeAll(data);
+  releaseConnection(data);
+  m_Servers.remove(data->m_Id);
+  attachServer(data, server);
+  data->m_Stale = data->m_Updated.isValid();
+  data->m_LastError.clear();
+  if (m_Running)
+  {
+    data->m_CheckRequested = true;
+    m_CheckNow = true;
+    m_WakeUp.wakeAll();
+  }
+  lock.unlock();
+  stopServer(oldserver, oldthread);
+}
+
+void CMailMonitor::removeServer(const QString &mailboxname)
+{
+  QMutexLocker lock(&m_Mutex);
+  int idx = m_Index.value(mailboxname, -1);
+  if (idx == -1)
+  {
+    return;
+  }
+  SMailData *data = m_Data.takeAt(idx);
+  m_Index.remove(mailboxname);
+  for (int i = idx; i < m_Data.size(); i++)
+  {
+    m_Index.insert(m_Data[i]->m_MailboxName, i);
+  }
+  m_Servers.remove(data->m_Id);
+  m_Admission.removeAll(data);
+  releaseConnection(data);
+  IMailProtocol *server = data->m_Server;
+  QThread *thread = data->m_Thread;
+  // Freed by the monitor thread at its next dispatch, it is not
+  // reachable through m_Data or m_Servers anymore
+  m_Retired.append(data);
+  lock.unlock();
+  stopServer(server, thread);
+}
+
+/*
+ * Run a new server object for a mailbox in its own thread. m_Mutex
+ * must be locked.
+ */
+void CMailMonitor::attachServer(SMailData *data, IMailProtocol *server)
+{
+  auto *thread = new QThread(this);
+  server->moveToThread(thread);
+  data->m_Id = m_NextId++;
+  server->setConfigurationIndex(data->m_Id);
+  data->m_Server = server;
+  data->m_Thread = thread;
+  data->m_Host = server->endpoint();
+  data->m_Local = !server->needsNetwork();
+  data->m_Limited = server->usesConnectionSlot();
+  data->m_Busy = false;
+  data->m_InFlight = false;
+  data->m_AdmissionWait = 0;
+  data->m_CheckRequested = false;
+  data->m_PollAgain = false;
+  data->m_SkippedPolls = 0;
+  m_Servers.insert(data->m_Id, data);
 
   connect(server, &IMailProtocol::mailError, this,
           &CMailMonitor::handleMailError);
   connect(server, &IMailProtocol::resultReady, this,
           &CMailMonitor::handleResultReady);
-  connect(this, &CMailMonitor::doWork, server,
-          &IMailProtocol::doWork);
+  connect(server, &IMailProtocol::pollFinished, this,
+          &CMailMonitor::handlePollFinished);
+  // The server is destroyed in its own thread when the thread stops
+  connect(thread, &QThread::finished, server, &QObject::deleteLater);
 
   thread->start();
 }
 
+/*
+ * A cancelled poll returns at its next check, the server object is
+ * deleted before the thread finishes. A poll blocked in a system call,
+ * e.g. closing a tunnel or scanning a large Maildir, must not freeze
+ * the GUI, so the thread is left to finish on its own then.
+ */
+void CMailMonitor::stopServer(IMailProtocol *server, QThread *thread)
+{
+  const QString host = server->getServer();
+  server->cancel();
+  thread->quit();
+  if (thread->wait(STOP_TIMEOUT))
+  {
+    delete (thread);
+    return;
+  }
+  qWarning() << "Server " << host << " did not stop within " << STOP_TIMEOUT
+             << " ms, detached";
+  m_Stopping.append(thread);
+  auto release = [this, thread]()
+  {
+    if (m_Stopping.removeOne(thread))
+    {
+      thread->deleteLater();
+    }
+  };
+  connect(thread, &QThread::finished, this, release);
+  if (thread->isFinished())
+  {
+    release(); // Finished before the connect
+  }
+}
+
+/*
+ * Give back the connection slot and the probe of a running poll whose
+ * server is stopped, its pollFinished is dropped. m_Mutex must be
+ * locked.
+ */
+void CMailMonitor::releaseConnection(SMailData *data)
+{
+  auto host = m_HostState.find(data->m_Host);
+  if ((host != m_HostState.end()) && (host->m_Probe == data->m_Id))
+  {
+    host->m_Probe = -1;
+  }
+  if (data->m_InFlight && data->m_Limited)
+  {
+    m_Connections--;
+    if (--m_HostConnections[data->m_Host] <= 0)
+    {
+      m_HostConnections.remove(data->m_Host);
+    }
+  }
+  data->m_InFlight = false;
+  data->m_Busy = false;
+}
+
+void CMailMonitor::restoreState(int configidx, int unread, int read,
+                                const QDateTime &updated, const QString &error)
+{
+  QMutexLocker lock(&m_Mutex);
+  if (configidx < 0 || configidx >= m_Data.size())
+  {
+    return;
+  }
+  SMailData *data = m_Data[configidx];
+  data->m_Unread = unread;
+  data->m_Read = read;
+  data->m_Updated = updated;
+  data->m_LastError = error;
+  data->m_Stale = true;
+}
+
+int CMailMonitor::findMailbox(const QString &mailboxname) const
+{
+  return m_Index.value(mailboxname, -1);
+}
+
+QVector<SMailState> CMailMonitor::stateCopy(void)
+{
+  QMutexLocker lock(&m_Mutex);
+  QVector<SMailState> state;
+  state.reserve(m_Data.size());
+  for (const SMailData *data : std::as_const(m_Data))
+  {
+    const SHostState host = m_HostState.value(data->m_Host);
+    state.append(SMailState{data->m_MailboxName, data->m_Read, data->m_Unread,
+                            data->m_Updated, data->m_Stale, data->m_LastError,
+                            data->m_Paused, host.m_BreakerOpen, host.m_NextProbe,
+                            data->m_AdmissionWait});
+  }
+  return state;
+}
+
+void CMailMonitor::checkNow()
+{
+  QMutexLocker lock(&m_Mutex);
+  for (auto data : m_Data)
+  {
+    data->m_CheckRequested = true;
+  }
+  m_CheckNow = true;
+  m_WakeUp.wakeAll();
+}
+
+void CMailMonitor::checkMailbox(int configidx)
+{
+  QMutexLocker lock(&m_Mutex);
+  if (configidx < 0 || configidx >= m_Data.size())
+  {
+    return;
+  }
+  m_Data[configidx]->m_CheckRequested = true;
+  m_CheckNow = true;
+  m_WakeUp.wakeAll();
+}
+
+void CMailMonitor::refreshStale(qint64 maxage)
+{
+  QMutexLocker lock(&m_Mutex);
+  QDateTime now = QDateTime::currentDateTime();
+  for (auto data : m_Data)
+  {
+    if (data->m_Paused || data->m_Busy || failing(data) || !reachable(data))
+    {
+      continue;
+    }
+    if (!data->m_Updated.isValid() || (data->m_Updated.msecsTo(now) > maxage))
+    {
+      qDebug() << "Mailbox " << data->m_MailboxName << " stale, refresh";
+      data->m_CheckRequested = true;
+      m_CheckNow = true;
+    }
+  }
+  if (m_CheckNow)
+  {
+    m_WakeUp.wakeAll();
+  }
+}
+
+void CMailMonitor::setPaused(int configidx, bool paused)
+{
+  QMutexLocker lock(&m_Mutex);
+  if (configidx < 0 || configidx >= m_Data.size())
+  {
+    return;
+  }
+  qDebug() << "Mailbox " << m_Data[configidx]->m_MailboxName << " paused " << paused;
+  m_Data[configidx]->m_Paused = paused;
+  if (paused)
+  {
+    // Close the push channel or file watch, the poll on resume opens it
+    QMetaObject::invokeMethod(m_Data[configidx]->m_Server, &IMailProtocol::stopPush,
+                              Qt::QueuedConnection);
+  }
+  else
+  {
+    // Refresh the counts on resume
+    m_Data[configidx]->m_CheckRequested = true;
+    m_CheckNow = true;
+    m_WakeUp.wakeAll();
+  }
+}
+
+void CMailMonitor::setOnline(bool online)
+{
+  QMutexLocker lock(&m_Mutex);
+  if (m_Online == online)
+  {
+    return;
+  }
+  qInfo() << "Network " << (online ? "online" : "offline");
+  m_Online = online;
+  if (online)
+  {
+    // Poll everything now, the slow start of the connection limit
+    // staggers the polls.
+    m_Window = RAMP_START;
+    m_NextPoll = QDeadlineTimer(m_Polltime * 1000LL, Qt::CoarseTimer);
+    for (auto data : m_Data)
+    {
+      if (data->m_Local)
+      {
+        continue;
+      }
+      m_HostState.remove(data->m_Host);
+      data->m_CheckRequested = true;
+    }
+    m_CheckNow = true;
+  }
+  else
+  {
+    // Sessions of the lost network would only hang until their timeout
+    for (auto data : m_Data)
+    {
+      if (data->m_InFlight && !data->m_Local)
+      {
+        data->m_Server->abortPoll();
+      }
+    }
+  }
+  m_WakeUp.wakeAll();
+}
+
+void CMailMonitor::resume()
+{
+  QMutexLocker lock(&m_Mutex);
+  for (auto data : m_Data)
+  {
+    if (data->m_InFlight)
+    {
+      data->m_Server->abortPoll();
+    }
+  }
+
+  // Refresh the mailboxes with the oldest results first. Invalid
+  // QDateTimes, i.e. never updated, sort before all others.
+  QVector<SMailData *> order = m_Data;
+  std::stable_sort(order.begin(), order.end(),
+                   [](const SMailData *a, const SMailData *b)
+                   { return a->m_Updated < b->m_Updated; });
+
+  m_Window = RAMP_START;
+  m_NextPoll = QDeadlineTimer(m_Polltime * 1000LL, Qt::CoarseTimer);
+  for (auto data : order)
+  {
+    if (data->m_Paused || !reachable(data))
+    {
+      continue; // Network mailboxes are polled when the network is back
+    }
+    m_HostState.remove(data->m_Host);
+    if (data->m_InFlight)
+    {
+      data->m_PollAgain = true; // Restart the aborted poll
+    }
+    else if (!data->m_Busy)
+    {
+      startPoll(data);
+    }
+  }
+  admitPolls();
+  m_WakeUp.wakeAll();
+}
+
+bool CMailMonitor::isPaused(int configidx)
+{
+  QMutexLocker lock(&m_Mutex);
+  if (configidx < 0 || configidx >= m_Data.size())
+  {
+    return false;
+  }
+  return m_Data[configidx]->m_Paused;
+}
+
+/*
+ * Wait until the poll time elapsed or a poll is requested.
+ * Returns true if all servers have to be polled.
+ */
+bool CMailMonitor::waitForNextPoll()
+{
+  QMutexLocker lock(&m_Mutex);
+
+  while (m_Running && !m_CheckNow)
+  {
+    QDeadlineTimer deadline = nextDeadline();
+    if (deadline.hasExpired())
+    {
+      break;
+    }
+    bool woken = m_WakeUp.wait(&m_Mutex, deadline);
+    m_Wakeups++;
+    if (!woken)
+    {
+      break; // Poll time or retry time elapsed
+    }
+  }
+  m_CheckNow = false;
+  return m_NextPoll.hasExpired();
+}
+
+/*
+ * Earliest of the next regular poll and the retries of failed
+ * servers. On battery the retries are batched with the regular polls.
+ * While the network is down only local mailboxes are polled.
+ * m_Mutex must be locked.
+ */
+QDeadlineTimer CMailMonitor::nextDeadline() const
+{
+  if (!m_Online &&
+      std::none_of(m_Data.begin(), m_Data.end(),
+                   [](const SMailData *data) { return data->m_Local; }))
+  {
+    return QDeadlineTimer(QDeadlineTimer::Forever);
+  }
+  if (m_OnBattery)
+  {
+    return m_NextPoll;
+  }
+  QDeadlineTimer deadline = m_NextPoll;
+  for (auto data : m_Data)
+  {
+    if (data->m_Paused || data->m_Busy || !reachable(data))
+    {
+      continue;
+    }
+    const SHostState host = m_HostState.value(data->m_Host);
+    if ((host.m_Failures > 0) && (host.m_Probe < 0) && (host.m_RetryAt < deadline))
+    {
+      deadline = host.m_RetryAt;
+    }
+  }
+  return deadline;
+}
+
+/*
+ * Exponential backoff with jitter for the host of a failed poll. After
+ * BREAKER_THRESHOLD failures the breaker opens and the host is only
+ * probed at the retry time. m_Mutex must be locked.
+ */
+void CMailMonitor::scheduleRetry(SMailData *data)
+{
+  SHostState &host = m_HostState[data->m_Host];
+  qint64 delay = RETRY_MAX;
+  if (host.m_Failures < 20)
+  {
+    delay = qMin<qint64>(RETRY_MAX, qint64(RETRY_MIN) << (host.m_Failures - 1));
+  }
+  // +-20% jitter, so that hosts failing together do not retry together
+  delay += QRandomGenerator::global()->bounded(delay * 2 / 5 + 1) - delay / 5;
+  host.m_RetryAt = QDeadlineTimer(delay, Qt::CoarseTimer);
+  host.m_NextProbe = QDateTime::currentDateTime().addMSecs(delay);
+  host.m_BreakerOpen = host.m_Failures >= BREAKER_THRESHOLD;
+  qInfo() << "Host " << data->m_Host << " of mailbox " << data->m_MailboxName
+          << " failed " << host.m_Failures << " times, retry in "
+          << delay / 1000 << "s" << (host.m_BreakerOpen ? ", breaker open" : "");
+}
+
+/*
+ * Queue a poll for admission. At most one poll per server is queued or
+ * running at any time. m_Mutex must be locked.
+ */
+void CMailMonitor::startPoll(SMailData *data)
+{
+  data->m_Busy = true;
+  data->m_PollAgain = false;
+  data->m_PollStarted.start();
+  m_Admission.append(data);
+}
+
+/*
+ * Start queued polls in FIFO order as long as the global and the per
+ * host connection limits allow it. A poll for a host at its limit does
+ * not block polls for other hosts. The global limit starts at
+ * RAMP_START and grows with every finished poll, so that not all
+ * connections are opened at once. Local mailboxes and tunnels open no
+ * connection to a host and are started at once. m_Mutex must be locked.
+ */
+void CMailMonitor::admitPolls()
+{
+  for (auto it = m_Admission.begin(); it != m_Admission.end();)
+  {
+    SMailData *data = *it;
+    if (data->m_Paused)
+    {
+      data->m_Busy = false;
+      it = m_Admission.erase(it);
+      continue;
+    }
+    if (data->m_Limited)
+    {
+      if (((m_MaxConnections > 0) &&
+           (m_Connections >= qMin(m_Window, m_MaxConnections))) ||
+          ((m_MaxHostConnections > 0) &&
+           (m_HostConnections.value(data->m_Host) >= m_MaxHostConnections)))
+      {
+        ++it;
+        continue;
+      }
+      m_Connections++;
+      m_HostConnections[data->m_Host]++;
+    }
+    it = m_Admission.erase(it);
+    data->m_InFlight = true;
+    data->m_AdmissionWait = data->m_PollStarted.elapsed();
+    if (data->m_AdmissionWait > 0)
+    {
+      qInfo() << "Mailbox " << data->m_MailboxName << " waited "
+              << data->m_AdmissionWait << "ms for a connection to " << data->m_Host;
+    }
+    QMetaObject::invokeMethod(data->m_Server, &IMailProtocol::poll,
+                              Qt::QueuedConnection);
+  }
+}
+
+/*
+ * Start a poll in the server threads. A request for a server which is
+ * still busy is merged with the running poll. If the running poll is
+ * older than the poll time, the server is polled again as soon as it
+ * is finished.
+ */
+void CMailMonitor::dispatchPolls(bool all)
+{
+  int polltime = m_Polltime;
+  if (all)
+  {
+    polltime = evaluatePolicy();
+  }
+  QMutexLocker lock(&m_Mutex);
+  qDeleteAll(m_Retired);
+  m_Retired.clear();
+
+  if (all)
+  {
+    m_NextPoll = QDeadlineTimer(polltime * 1000LL, Qt::CoarseTimer);
+  }
+  for (auto data : m_Data)
+  {
+    if (!reachable(data))
+    {
+      data->m_CheckRequested = false; // Polled when the network is back
+      continue;
+    }
+    // Failed hosts are probed at their retry time, on battery only
+    // together with the regular polls. A check requested by the user is
+    // sent as probe. One mailbox probes a host, the other mailboxes of
+    // the host wait for its result.
+    bool due = all;
+    auto host = m_HostState.find(data->m_Host);
+    bool probe = (host != m_HostState.end()) && (host->m_Failures > 0);
+    if (probe)
+    {
+      due = host->m_RetryAt.hasExpired() && (all || !m_OnBattery);
+    }
+    else if (due && m_OnBattery && data->m_Server->isPushActive())
+    {
+      // The push channel delivers the changes, the regular poll only
+      // costs power
+      due = false;
+    }
+    bool requested = due || data->m_CheckRequested;
+    data->m_CheckRequested = false;
+    if (!requested || data->m_Paused || (probe && (host->m_Probe >= 0)))
+    {
+      continue;
+    }
+    if (data->m_Busy)
+    {
+      data->m_SkippedPolls++;
+      if (data->m_PollStarted.hasExpired(m_Polltime * 1000LL))
+      {
+        data->m_PollAgain = true;
+      }
+      qInfo() << "Mailbox " << data->m_MailboxName << " still busy, "
+              << data->m_SkippedPolls << " polls skipped"
+              << (data->m_PollAgain ? ", poll again" : "");
+      continue;
+    }
+    if (probe)
+    {
+      host->m_Probe = data->m_Id;
+    }
+    startPoll(data);
+  }
+  admitPolls();
+}
+
+/*
+ * Poll time in s after the power policy. Reading the power supply and
+ * idle state may block, so m_Mutex is not held while reading.
+ */
+int CMailMonitor::evaluatePolicy()
+{
+  CPowerPolicy policy;
+  {
+    QMutexLocker lock(&m_Mutex);
+    policy = m_Policy;
+  }
+  int polltime = policy.evaluate(m_Polltime);
+  QMutexLocker lock(&m_Mutex);
+  m_OnBattery = policy.onBattery();
+  return polltime;
+}
+
+double CMailMonitor::wakeupsPerHour() const
+{
+  qint64 elapsed = m_RunTime.isValid() ? m_RunTime.elapsed() : 0;
+  if (elapsed <= 0)
+  {
+    return 0.0;
+  }
+  return m_Wakeups * 3600000.0 / elapsed;
+}
+
+double CMailMonitor::pollLatency() const
+{
+  if (m_Polls <= 0)
+  {
+    return 0.0;
+  }
+  return static_cast<double>(m_PollDuration) / m_Polls;
+}
+
+double CMailMonitor::bytesPerHour() const
+{
+  qint64 elapsed = m_RunTime.isValid() ? m_RunTime.elapsed() : 0;
+  if (elapsed <= 0)
+  {
+    return 0.0;
+  }
+  return (IMailProtocol::bytesTransferred() - m_StartBytes) * 3600000.0 / elapsed;
+}
+
 void CMailMonitor::run()
 {
   int i;
-  m_Running = true;
+  {
+    QMutexLocker lock(&m_Mutex);
+    m_Running = true;
+    m_CheckNow = false;
+    m_Window = RAMP_START;
+  }
+  m_Wakeups = 0;
+  m_StartBytes = IMailProtocol::bytesTransferred();
+  m_RunTime.start();
   qDebug() << "Start Mail Monitor " << m_Polltime;
 
+  bool all = true;
   while (m_Running)
   {
-    emit doWork();
-
-    i = 0;
-    while (m_Running && i < m_Polltime)
+    dispatchPolls(all);
+    all = waitForNextPoll();
+  }
+  qInfo() << "Mail Monitor wakeups per hour " << wakeupsPerHour()
+          << ", bytes per hour " << bytesPerHour();
+  qInfo() << "Average poll latency " << pollLatency() << " ms, token refresh "
+          << COAuth2::refreshLatency() << " ms";
+  QVector<SMailData *> data;
+  {
+    QMutexLocker lock(&m_Mutex);
+    data.swap(m_Data);
+    qDeleteAll(m_Retired);
+    m_Retired.clear();
+    m_Index.clear();
+    m_Servers.clear();
+    m_Admission.clear();
+    m_HostConnections.clear();
+    m_HostState.clear();
+    m_Connections = 0;
+  }
+  for (i = 0; i < data.size(); i++)
+  {
+    if (data[i]->m_SkippedPolls > 0)
     {
-      sleep(1);
-      i++;
+      qInfo() << "Mailbox " << data[i]->m_MailboxName << " skipped polls "
+              << data[i]->m_SkippedPolls;
     }
   }
-  for (i = 0; i < m_Data.size(); i++)
+  for (i = 0; i < data.size(); i++)
   {
-    m_Data[i]->m_Thread->quit();
+    data[i]->m_Server->cancel();
+    data[i]->m_Thread->quit();
   }
 
-  for (i = 0; i < m_Data.size(); i++)
+  // A cancelled poll returns at its next check, the server object is
+  // deleted before the thread finishes. A poll blocked in a system call
+  // must not delay the exit, its thread is left to the destructor.
+  QDeadlineTimer deadline(STOP_TIMEOUT);
+  for (i = 0; i < data.size(); i++)
   {
-    m_Data[i]->m_Thread->wait(1000);
-    delete (m_Data[i]->m_Thread);
-    delete (m_Data[i]->m_Server);
-    delete (m_Data[i]);
+    if (data[i]->m_Thread->wait(deadline))
+    {
+      delete (data[i]->m_Thread);
+    }
+    else
+    {
+      qWarning() << "Mailbox " << data[i]->m_MailboxName
+                 << " did not stop within " << STOP_TIMEOUT << " ms, detached";
+      QMutexLocker lock(&m_Mutex);
+      m_Detached.append(data[i]->m_Thread);
+    }
+    delete (data[i]);
   }
 
-  m_Data.clear();
   qDebug("Stop Mail Monitor");
 }
 
-void CMailMonitor::handleMailError(IMailProtocol *server, const QString &errtxt)
+void CMailMonitor::handleMailError(int configurationidx, const QString &errtxt)
 {
+  QMutexLocker lock(&m_Mutex);
+  SMailData *data = m_Servers.value(configurationidx);
+  if (data == nullptr)
+  {
+    return; // Server already stopped
+  }
+  data->m_LastError = errtxt;
+  const QString mailbox = data->m_MailboxName;
+  bool reported = reachable(data);
+  lock.unlock();
   qDebug() << "CMailMonitor::handleMailError Error  " << errtxt;
-  emit mailError(server, errtxt);
+  if (reported)
+  {
+    // Errors of a network which just went down are expected
+    emit mailError(mailbox, errtxt);
+  }
 }
 
 void CMailMonitor::handleResultReady(int configurationidx, int numUnread, int numRead)
 {
-  QString mboxName = getMailboxName(configurationidx);
-  if ((m_Data[configurationidx]->m_Unread != numUnread) || (m_Data[configurationidx]->m_Read != numRead))
+  QMutexLocker lock(&m_Mutex);
+  SMailData *data = m_Servers.value(configurationidx);
+  if ((data == nullptr) || data->m_Paused)
+  {
+    return; // Server already stopped or a push queued before the pause
+  }
+  data->m_Updated = QDateTime::currentDateTime();
+  data->m_LastError.clear();
+  bool stale = data->m_Stale;
+  data->m_Stale = false;
+  if (stale || (data->m_Unread != numUnread) || (data->m_Read != numRead))
+  {
+    data->m_Unread = numUnread;
+    data->m_Read = numRead;
+    lock.unlock();
+    emit updateResult();
+  }
+}
+
+void CMailMonitor::handlePollFinished(int configurationidx, bool success)
+{
+  QMutexLocker lock(&m_Mutex);
+  SMailData *data = m_Servers.value(configurationidx);
+  if (data == nullptr)
+  {
+    return; // Server already stopped
+  }
+  SHostState &host = m_HostState[data->m_Host];
+  bool breaker = host.m_BreakerOpen;
+  bool probe = host.m_Probe == data->m_Id;
+  if (probe)
+  {
+    host.m_Probe = -1;
+  }
+  if (data->m_InFlight)
+  {
+    data->m_InFlight = false;
+    m_PollDuration += data->m_PollStarted.elapsed() - data->m_AdmissionWait;
+    m_Polls++;
+    if (data->m_Limited)
+    {
+      m_Connections--;
+      if (--m_HostConnections[data->m_Host] <= 0)
+      {
+        m_HostConnections.remove(data->m_Host);
+      }
+      if (m_Window < m_MaxConnections)
+      {
+        m_Window++;
+      }
+    }
+  }
+  data->m_Busy = false;
+  if (success)
+  {
+    if (host.m_Failures > 0)
+    {
+      // The host is back, poll the mailboxes which waited for the probe
+      for (auto other : m_Data)
+      {
+        if ((other != data) && (other->m_Host == data->m_Host))
+        {
+          other->m_CheckRequested = true;
+          m_CheckNow = true;
+        }
+      }
+      m_WakeUp.wakeAll();
+    }
+    m_HostState.remove(data->m_Host);
+  }
+  else if (reachable(data))
+  {
+    // Failures while the network is down do not count. Polls started
+    // before the host failed fail with it, only the probe counts again.
+    data->m_PollAgain = false;
+    if ((host.m_Failures == 0) || probe)
+    {
+      host.m_Failures++;
+      scheduleRetry(data);
+      m_WakeUp.wakeAll(); // Recalculate the next deadline
+    }
+  }
+  bool breakerOpen = m_HostState.value(data->m_Host).m_BreakerOpen;
+  if (data->m_PollAgain && !data->m_Paused && m_Running)
+  {
+    startPoll(data);
+  }
+  admitPolls();
+  if (breaker != breakerOpen)
   {
-    m_Data[configurationidx]->m_MailboxName = mboxName;
-    m_Data[configurationidx]->m_Unread = numUnread;
-    m_Data[configurationidx]->m_Read = numRead;
+    lock.unlock();
     emit updateResult();
   }
 }
@@ -17,15 +17,68 @@
 #include <QSharedPointer>
 #include <QDebug>
 #include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QElapsedTimer>
+#include <QDateTime>
+#include <QHash>
+#include <QList>
+#include <atomic>
 #include "IMailProtocol.h"
+#include "system/CPowerPolicy.h"
 
 struct SMailData
 {
+  int m_Id;              // Configuration index of the server, never reused
   IMailProtocol *m_Server;
   QThread *m_Thread;
   QString m_MailboxName;
   int m_Read;
   int m_Unread;
+  QDateTime m_Updated;   // Time of the last result
+  bool m_Stale;          // Counts restored from the snapshot, not yet polled
+  QString m_LastError;   // Error of the last poll
+  bool m_Paused;         // Mailbox is not polled
+  QString m_Host;        // Endpoint for the connection limit and backoff
+  bool m_Local;          // Local mailbox, polled without network
+  bool m_Limited;        // Poll takes a connection slot
+  bool m_Busy;           // Poll is queued or running
+  bool m_InFlight;       // Poll is running in the server thread
+  bool m_CheckRequested; // Poll requested by the user
+  bool m_PollAgain;      // Poll again when the running poll is finished
+  int m_SkippedPolls;    // Polls merged into a running poll
+  QElapsedTimer m_PollStarted;
+  qint64 m_AdmissionWait; // ms the last poll waited for a connection slot
+};
+
+/*
+ * Backoff of a failed host, shared by all its mailboxes
+ */
+struct SHostState
+{
+  int m_Failures = 0;         // Consecutive failed polls
+  bool m_BreakerOpen = false; // Host unreachable, only probes are sent
+  QDeadlineTimer m_RetryAt;
+  QDateTime m_NextProbe;      // m_RetryAt for display
+  int m_Probe = -1;           // Id of the mailbox probing the host
+};
+
+/*
+ * State of a mailbox for display, a copy taken under the lock of the
+ * monitor
+ */
+struct SMailState
+{
+  QString m_MailboxName;
+  int m_Read;
+  int m_Unread;
+  QDateTime m_Updated;
+  bool m_Stale;
+  QString m_LastError;
+  bool m_Paused;
+  bool m_BreakerOpen;
+  QDateTime m_NextProbe;
+  qint64 m_AdmissionWait; // ms the last poll waited for a connection slot
 };
 
 class CMailMonitor : public QThread
@@ -34,46 +87,219 @@ class CMailMonitor : public QThread
 public:
   CMailMonitor();
 
-  virtual ~CMailMonitor()
-  {
-    halt();
-  }
+  virtual ~CMailMonitor();
+  /*
+   * Add a mailbox. While the monitor is running the new mailbox is
+   * polled immediately.
+   */
   void addServer(const QString &mailboxname, IMailProtocol *server);
 
+  /*
+   * Stop the server of a mailbox and run a new one, e.g. after the
+   * definition changed. The counts are kept until the first poll.
+   */
+  void replaceServer(const QString &mailboxname, IMailProtocol *server);
+
+  /*
+   * Stop and remove a mailbox, the other mailboxes are not touched
+   */
+  void removeServer(const QString &mailboxname);
+
   void run();
 
+  /*
+   * Stop the monitor. Running polls are cancelled, the monitor thread
+   * stops as soon as all server threads are finished.
+   */
   void halt()
   {
+    QMutexLocker lock(&m_Mutex);
     m_Running = false;
+    m_WakeUp.wakeAll();
   }
 
-  QString getMailboxName(int configidx) const
-  {
-    return m_Data[configidx]->m_MailboxName;
-  }
+  /*
+   * Halt the monitor and wait for the monitor thread. Server threads
+   * blocked in a system call are left running after STOP_TIMEOUT.
+   * Returns false if the monitor thread did not stop in time.
+   */
+  bool stop(void);
+
+  /*
+   * Wake up the monitor thread and poll all servers immediately
+   */
+  void checkNow();
+
+  /*
+   * Poll a single mailbox immediately
+   */
+  void checkMailbox(int configidx);
+
+  /*
+   * Poll the mailboxes whose last result is older than maxage ms, e.g.
+   * when the user looks at the counts. Paused, busy and failed
+   * mailboxes are skipped.
+   */
+  void refreshStale(qint64 maxage);
+
+  /*
+   * Show the last known state of a mailbox until its first poll
+   * finished
+   */
+  void restoreState(int configidx, int unread, int read,
+                    const QDateTime &updated, const QString &error);
+
+  /*
+   * Pause or resume polling of a mailbox
+   */
+  void setPaused(int configidx, bool paused);
+  bool isPaused(int configidx);
+
+  int findMailbox(const QString &mailboxname) const;
 
-  const QVector<SMailData *> &getData(void) const
+  /*
+   * Number of wakeups of the monitor thread since start and per hour
+   */
+  qint64 wakeups() const
   {
-    return (m_Data);
+    return m_Wakeups;
   }
+  double wakeupsPerHour() const;
+
+  /*
+   * Protocol bytes transferred per hour since start
+   */
+  double bytesPerHour() const;
+
+  /*
+   * Average time of the polls in ms, without the admission wait.
+   * OAuth2 token refreshes run in the background and are measured
+   * by COAuth2::refreshLatency().
+   */
+  double pollLatency() const;
+
+  /*
+   * State of all mailboxes. The monitor thread updates the state
+   * concurrently, so it is copied under the lock.
+   */
+  QVector<SMailState> stateCopy(void);
 
   void updatePollTime(int tm) {
     m_Polltime = tm;
   }
-  
+
+  /*
+   * Suspend polling of network mailboxes while the network is not
+   * reachable, local mailboxes are still polled. When the network
+   * comes back all network mailboxes are polled.
+   */
+  void setOnline(bool online);
+  bool isOnline() const
+  {
+    return m_Online;
+  }
+
+  /*
+   * The system resumed from suspend. Sessions opened before the
+   * suspend are aborted and all mailboxes are refreshed.
+   */
+  void resume();
+
+  /*
+   * Maximum number of concurrent connections, <= 0 for no limit
+   */
+  void updateConnectionLimits(int global, int perhost)
+  {
+    QMutexLocker lock(&m_Mutex);
+    m_MaxConnections = global;
+    m_MaxHostConnections = perhost;
+  }
+
+  /*
+   * Stretch the poll time on battery by factor and when the user is
+   * idle for more than idletime minutes.
+   */
+  void updatePowerPolicy(bool battery, int factor, bool idle, int idletime)
+  {
+    QMutexLocker lock(&m_Mutex);
+    m_Policy.setBatteryPolicy(battery, factor);
+    m_Policy.setIdlePolicy(idle, idletime);
+  }
+
 signals:
   void updateResult(void);
-  void mailError(IMailProtocol *server, const QString &errtxt);
-  void doWork(void);
+  void mailError(const QString &mailboxname, const QString &errtxt);
 
 private:
   std::atomic_bool m_Running;
+  std::atomic_bool m_Online = true;
+  bool m_CheckNow = false;
   int m_Polltime;
   QVector<SMailData *> m_Data;
+  QHash<QString, int> m_Index; // Mailbox name to index in m_Data
+  // Configuration index of the servers to their data. A signal of a
+  // removed server may still be queued, so the index is never reused.
+  QHash<int, SMailData *> m_Servers;
+  int m_NextId = 0;
+  QVector<SMailData *> m_Retired; // Removed, freed by the monitor thread
+  QList<QThread *> m_Stopping;    // Threads of stopped servers still running
+  QList<QThread *> m_Detached;    // Server threads still running after run()
+  inline const static int STOP_TIMEOUT = 2000; // ms
+  void attachServer(SMailData *data, IMailProtocol *server);
+  void stopServer(IMailProtocol *server, QThread *thread);
+  void releaseConnection(SMailData *data);
+
+  // Wait for the next poll, halt or check now request
+  QMutex m_Mutex;
+  QWaitCondition m_WakeUp;
+  QDeadlineTimer m_NextPoll;
+  QElapsedTimer m_RunTime;
+  std::atomic<qint64> m_Wakeups = 0;
+  qint64 m_StartBytes = 0;
+  qint64 m_PollDuration = 0; // Sum of the poll durations in ms
+  qint64 m_Polls = 0;
+
+  // Poll time stretched by the power policy, evaluated once per poll
+  CPowerPolicy m_Policy;
+  bool m_OnBattery = false;
+  int evaluatePolicy();
+
+  bool waitForNextPoll();
+  QDeadlineTimer nextDeadline() const;
+  void dispatchPolls(bool all);
+  void startPoll(SMailData *data);
+  void admitPolls();
+  void scheduleRetry(SMailData *data);
+  bool failing(const SMailData *data) const
+  {
+    return m_HostState.value(data->m_Host).m_Failures > 0;
+  }
+
+  // Local mailboxes are polled while the network is down
+  bool reachable(const SMailData *data) const
+  {
+    return m_Online || data->m_Local;
+  }
+
+  // Admission of polls, FIFO per host
+  QList<SMailData *> m_Admission;
+  QHash<QString, int> m_HostConnections;
+  int m_Connections = 0;
+  int m_Window = 0; // Slow start of the global limit
+  int m_MaxConnections;
+  int m_MaxHostConnections;
+  inline const static int RAMP_START = 2;
+
+  // Retry of failed hosts, one mailbox probes a host at a time
+  QHash<QString, SHostState> m_HostState;
+  inline const static int RETRY_MIN = 15 * 1000;
+  inline const static int RETRY_MAX = 60 * 60 * 1000;
+  inline const static int BREAKER_THRESHOLD = 5;
 
 private slots:
-  void handleMailError(IMailProtocol *server, const QString &errtxt);
+  void handleMailError(int configurationidx, const QString &errtxt);
   void handleResultReady(int configurationidx, int numUnread, int numRead);
+  void handlePollFinished(int configurationidx, bool success);
   void updatePassword(const QString &mailbox, const QString &password);
 };
 
@@ -11,8 +11,288 @@
 
 #include "CMailSocket.h"
 
+#include <QEventLoop>
+#include <QTimer>
+
+#include "CResolver.h"
+
+QSslSocket *CMailSocket::createSocket(void)
+{
+  qRegisterMetaType<QAbstractSocket::SocketError>(
+      "QAbstractSocket::SocketError");
+  QSslSocket *socket = new QSslSocket(this);
+
+  connect(socket,
+          QOverload<QAbstractSocket::SocketError>::of(
+              &QAbstractSocket::errorOccurred),
+          this, &CMailSocket::socketError);
+  connect(socket,
+          QOverload<const QList<QSslError> &>::of(&QSslSocket::sslErrors),
+          this, &CMailSocket::sslErrors);
+  return socket;
+}
+
+/*
+ * Get the addresses of the server from the shared cache, or wait
+ * for the lookup if the server is not cached yet.
+ */
+bool CMailSocket::resolveServer(QList<QHostAddress> &addresses)
+{
+  QHostAddress literal;
+  if (literal.setAddress(m_Server))
+  {
+    addresses = {literal};
+    return true;
+  }
+  CResolver &resolver = CResolver::instance();
+  if (resolver.lookup(m_Server, addresses))
+  {
+    return true;
+  }
+
+  bool finished = false;
+  QEventLoop loop;
+  QTimer timer;
+  timer.setSingleShot(true);
+  connect(&timer, &QTimer::timeout, &loop, &QEventLoop::quit);
+  connect(this, &IMailProtocol::cancelRequested, &loop, &QEventLoop::quit);
+  connect(&resolver, &CResolver::resolved, &loop,
+          [this, &loop, &finished](const QString &host)
+          {
+            if (host == m_Server)
+            {
+              finished = true;
+              loop.quit();
+            }
+          });
+  resolver.requestLookup(m_Server);
+  timer.start(getTimeout(TimeoutPhase::tpConnect));
+
+  while (!finished && !isCancelled() && timer.isActive())
+  {
+    loop.exec(QEventLoop::ExcludeUserInputEvents);
+  }
+  return resolver.lookup(m_Server, addresses);
+}
+
+/*
+ * Start the tunnel command or connect the Unix socket. The server may
+ * greet with PREAUTH, so the connection is ready after the greeting.
+ */
+bool CMailSocket::connectTunnel(void)
+{
+  closeConnection(true);
+  QElapsedTimer started;
+  started.start();
+  std::function<bool()> ready;
+  if (m_Transport == TRANSPORT_COMMAND)
+  {
+    QProcess *process = new QProcess(this);
+    // Messages of e.g. ssh go to our stderr
+    process->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+    m_Tunnel = process;
+    if (m_Debug)
+    {
+      qDebug() << "Start tunnel " << m_TunnelPath;
+    }
+    process->startCommand(m_TunnelPath);
+    ready = [process]()
+    { return process->state() == QProcess::Running; };
+  }
+  else
+  {
+    QLocalSocket *socket = new QLocalSocket(this);
+    m_Tunnel = socket;
+    if (m_Debug)
+    {
+      qDebug() << "Connect to " << m_TunnelPath;
+    }
+    socket->connectToServer(m_TunnelPath);
+    ready = [socket]()
+    { return socket->state() == QLocalSocket::ConnectedState; };
+  }
+  if (!waitForPhase(TimeoutPhase::tpConnect, ready, started))
+  {
+    m_ConnectError = isCancelled() ? "Cancelled" : m_Tunnel->errorString();
+    closeConnection(true);
+    return false;
+  }
+  return true;
+}
+
+void CMailSocket::closeConnection(bool abort)
+{
+  if (m_Socket != nullptr)
+  {
+    if (abort)
+    {
+      m_Socket->abort();
+    }
+    else
+    {
+      m_Socket->close();
+    }
+  }
+  if (m_Tunnel != nullptr)
+  {
+    if (QProcess *process = qobject_cast<QProcess *>(m_Tunnel))
+    {
+      // The server exits on end of input, kill it if it hangs
+      process->closeWriteChannel();
+      if (abort || !process->waitForFinished(getTimeout(TimeoutPhase::tpCommand)))
+      {
+        process->kill();
+        process->waitForFinished();
+      }
+    }
+    else if (QLocalSocket *socket = qobject_cast<QLocalSocket *>(m_Tunnel))
+    {
+      if (abort)
+      {
+        socket->abort();
+      }
+      else
+      {
+        socket->disconnectFromServer();
+      }
+    }
+    m_Tunnel->deleteLater();
+    m_Tunnel = nullptr;
+  }
+}
+
+bool CMailSocket::connectToServer(uint16_t port)
+{
+  QList<QHostAddress> addresses;
+  m_ConnectError.clear();
+  if (isTunnel())
+  {
+    return connectTunnel();
+  }
+  if (!resolveServer(addresses))
+  {
+    m_ConnectError = isCancelled() ? "Cancelled" : "Host not found";
+    return false;
+  }
+
+  // Alternate the address families, starting with the family which
+  // won the last race.
+  CResolver &resolver = CResolver::instance();
+  QAbstractSocket::NetworkLayerProtocol preferred = resolver.preferredProtocol(m_Server);
+  QList<QHostAddress> first;
+  QList<QHostAddress> second;
+  for (const auto &addr : addresses)
+  {
+    (addr.protocol() == preferred ? first : second).append(addr);
+  }
+  addresses.clear();
+  for (int i = 0; i < qMax(first.size(), second.size()); i++)
+  {
+    if (i < first.size())
+    {
+      addresses.append(first[i]);
+    }
+    if (i < second.size())
+    {
+      addresses.append(second[i]);
+    }
+  }
+
+  QList<QSslSocket *> attempts;
+  QSslSocket *winner = nullptr;
+  QEventLoop loop;
+  QTimer delay;
+  QTimer timeout;
+  delay.setSingleShot(true);
+  timeout.setSingleShot(true);
+  connect(&delay, &QTimer::timeout, &loop, &QEventLoop::quit);
+  connect(&timeout, &QTimer::timeout, &loop, &QEventLoop::quit);
+  connect(this, &IMailProtocol::cancelRequested, &loop, &QEventLoop::quit);
+  int next = 0;
+
+  while (!isCancelled())
+  {
+    bool pending = false;
+    for (auto *socket : attempts)
+    {
+      if (socket->state() == QAbstractSocket::ConnectedState)
+      {
+        winner = socket;
+        break;
+      }
+      pending = pending || (socket->state() != QAbstractSocket::UnconnectedState);
+    }
+    if (winner != nullptr)
+    {
+      break;
+    }
+    // Start the next attempt if the previous failed or did not connect
+    // within the connection attempt delay.
+    if ((next < addresses.size()) && (!pending || !delay.isActive()))
+    {
+      QSslSocket *socket = createSocket();
+      connect(socket, &QAbstractSocket::stateChanged, &loop, &QEventLoop::quit);
+      attempts.append(socket);
+      if (m_Debug)
+      {
+        qDebug() << "Connect to " << addresses[next];
+      }
+      socket->connectToHost(addresses[next++], port);
+      delay.start(CONNECTION_ATTEMPT_DELAY);
+      timeout.start(getTimeout(TimeoutPhase::tpConnect));
+      continue;
+    }
+    if (!pending || !timeout.isActive())
+    {
+      break;
+    }
+    loop.exec(QEventLoop::ExcludeUserInputEvents);
+  }
+
+  for (auto *socket : attempts)
+  {
+    if (socket == winner)
+    {
+      continue;
+    }
+    if (socket->error() != QAbstractSocket::UnknownSocketError)
+    {
+      m_ConnectError = socket->errorString();
+    }
+    socket->abort();
+    socket->deleteLater();
+  }
+  if (winner == nullptr)
+  {
+    if (!isCancelled() && !timeout.isActive())
+    {
+      m_ConnectError = "Connection timed out";
+      timedOut(TimeoutPhase::tpConnect);
+    }
+    return false;
+  }
+
+  disconnect(winner, &QAbstractSocket::stateChanged, &loop, &QEventLoop::quit);
+  addSample(TimeoutPhase::tpConnect,
+            getTimeout(TimeoutPhase::tpConnect) - timeout.remainingTime());
+  resolver.setPreferredProtocol(m_Server, winner->peerAddress().protocol());
+  if (m_Socket != nullptr)
+  {
+    m_Socket->abort();
+    m_Socket->deleteLater();
+  }
+  m_Socket = winner;
+  // Verify the certificate against the name, not the address
+  m_Socket->setPeerVerifyName(m_Server);
+  return true;
+}
+
 bool CMailSocket::isConnected()
 {
+  if (isTunnel())
+  {
+    return (m_Tunnel != nullptr) && isAlive() && m_Tunnel->isOpen();
+  }
   if (m_Socket == nullptr)
   {
     return false;
@@ -24,11 +304,224 @@ bool CMailSocket::isConnected()
   return (m_Socket->state() == QTcpSocket::ConnectedState);
 }
 
+void CMailSocket::setOAuth2(const QString &tokenurl, const QString &clientid,
+                            const QString &secret, const QString &refreshtoken)
+{
+  delete m_OAuth;
+  m_OAuth = new COAuth2(tokenurl, clientid, secret, this);
+  connect(m_OAuth, &COAuth2::refreshTokenChanged, this, &CMailSocket::refreshTokenChanged);
+  m_OAuth->setRefreshToken(refreshtoken);
+}
+
+bool CMailSocket::getAccessToken(QString &token)
+{
+  token = m_OAuth->accessToken();
+  if (token.isEmpty())
+  {
+    QElapsedTimer started;
+    started.start();
+    QEventLoop loop;
+    QTimer timer;
+    timer.setSingleShot(true);
+    connect(&timer, &QTimer::timeout, &loop, &QEventLoop::quit);
+    connect(m_OAuth, &COAuth2::tokenChanged, &loop, &QEventLoop::quit);
+    connect(this, &IMailProtocol::cancelRequested, &loop, &QEventLoop::quit);
+    timer.start(m_TimeoutMax);
+    if (!isCancelled())
+    {
+      loop.exec(QEventLoop::ExcludeUserInputEvents);
+    }
+    token = m_OAuth->accessToken();
+    qDebug() << "Waited " << started.elapsed() << " ms for the access token";
+  }
+  if (token.isEmpty())
+  {
+    const QString err = "No OAuth2 access token";
+    qCritical() << err;
+    setError(err);
+    return false;
+  }
+  return true;
+}
+
+/*
+ * False if the connection was closed or is not yet opened
+ */
+bool CMailSocket::isAlive(void) const
+{
+  if (!isTunnel())
+  {
+    return (m_Socket != nullptr) &&
+           (m_Socket->state() != QAbstractSocket::UnconnectedState);
+  }
+  if (QProcess *process = qobject_cast<QProcess *>(m_Tunnel))
+  {
+    return process->state() != QProcess::NotRunning;
+  }
+  if (QLocalSocket *socket = qobject_cast<QLocalSocket *>(m_Tunnel))
+  {
+    return socket->state() != QLocalSocket::UnconnectedState;
+  }
+  return false;
+}
+
+/*
+ * Run a local event loop until done() returns true, the socket is
+ * disconnected, the timeout elapsed or the poll is cancelled.
+ * Only one poll per server is queued by the monitor, so the local
+ * event loop does not reenter doWork().
+ */
+bool CMailSocket::waitForSocket(const std::function<bool()> &done, int timeout)
+{
+  if (done())
+  {
+    return true;
+  }
+  QEventLoop loop;
+  QTimer timer;
+  timer.setSingleShot(true);
+  connect(&timer, &QTimer::timeout, &loop, &QEventLoop::quit);
+  connect(device(), &QIODevice::readyRead, &loop, &QEventLoop::quit);
+  if (QProcess *process = qobject_cast<QProcess *>(m_Tunnel))
+  {
+    connect(process, &QProcess::stateChanged, &loop, &QEventLoop::quit);
+  }
+  else if (QLocalSocket *socket = qobject_cast<QLocalSocket *>(m_Tunnel))
+  {
+    connect(socket, &QLocalSocket::stateChanged, &loop, &QEventLoop::quit);
+  }
+  else
+  {
+    connect(m_Socket, &QAbstractSocket::connected, &loop, &QEventLoop::quit);
+    connect(m_Socket, &QSslSocket::encrypted, &loop, &QEventLoop::quit);
+    connect(m_Socket, &QAbstractSocket::stateChanged, &loop, &QEventLoop::quit);
+  }
+  connect(this, &IMailProtocol::cancelRequested, &loop, &QEventLoop::quit);
+  timer.start(timeout);
+
+  while (!done() && !isCancelled() && timer.isActive() && isAlive())
+  {
+    loop.exec(QEventLoop::ExcludeUserInputEvents);
+  }
+  return done();
+}
+
+/*
+ * Wait for a phase and update its round trip time.
+ */
+bool CMailSocket::waitForPhase(TimeoutPhase phase,
+                               const std::function<bool()> &done,
+                               const QElapsedTimer &started)
+{
+  if (done())
+  {
+    return true;
+  }
+  if (!waitForSocket(done, getTimeout(phase)))
+  {
+    if (!isCancelled())
+    {
+      timedOut(phase);
+    }
+    return false;
+  }
+  if (started.isValid())
+  {
+    addSample(phase, started.elapsed());
+  }
+  return true;
+}
+
+bool CMailSocket::waitForEncrypted(void)
+{
+  QElapsedTimer started;
+  started.start();
+  return waitForPhase(TimeoutPhase::tpHandshake, [this]()
+                      { return m_Socket->isEncrypted(); },
+                      started);
+}
+
+bool CMailSocket::waitForReadLine(void)
+{
+  // The round trip is measured from the last command sent
+  QElapsedTimer started = m_LastWrite;
+  m_LastWrite.invalidate();
+  return waitForPhase(m_Phase, [this]()
+                      { return device()->canReadLine(); },
+                      started);
+}
+
+/*
+ * Estimator of a phase. In the command phase every verb has its own,
+ * a verb without samples starts with TIMEOUT.
+ */
+CMailSocket::SRtt &CMailSocket::rtt(TimeoutPhase phase)
+{
+  if ((phase == TimeoutPhase::tpCommand) && !m_Verb.isEmpty())
+  {
+    return m_CommandRtt[m_Verb];
+  }
+  return m_Rtt[static_cast<int>(phase)];
+}
+
+const CMailSocket::SRtt &CMailSocket::rtt(TimeoutPhase phase) const
+{
+  if ((phase == TimeoutPhase::tpCommand) && !m_Verb.isEmpty())
+  {
+    static const SRtt unmeasured;
+    auto it = m_CommandRtt.constFind(m_Verb);
+    return (it != m_CommandRtt.constEnd()) ? *it : unmeasured;
+  }
+  return m_Rtt[static_cast<int>(phase)];
+}
+
+void CMailSocket::addSample(TimeoutPhase phase, qint64 sample)
+{
+  SRtt &r = rtt(phase);
+  if (!r.m_Valid)
+  {
+    r.m_Srtt = sample;
+    r.m_RttVar = sample / 2.0;
+    r.m_Valid = true;
+  }
+  else
+  {
+    r.m_RttVar = 0.75 * r.m_RttVar + 0.25 * qAbs(r.m_Srtt - sample);
+    r.m_Srtt = 0.875 * r.m_Srtt + 0.125 * sample;
+  }
+  if (m_Debug)
+  {
+    qDebug() << "RTT phase " << static_cast<int>(phase) << m_Verb << sample
+             << "ms timeout " << getTimeout(phase) << "ms";
+  }
+}
+
+void CMailSocket::timedOut(TimeoutPhase phase)
+{
+  // Back off like TCP does after a retransmission timeout
+  SRtt &r = rtt(phase);
+  if (r.m_Valid)
+  {
+    r.m_RttVar = qMax(r.m_RttVar * 2.0, r.m_Srtt);
+  }
+}
+
+int CMailSocket::getTimeout(TimeoutPhase phase) const
+{
+  const SRtt &r = rtt(phase);
+  double timeout = TIMEOUT;
+  if (r.m_Valid)
+  {
+    timeout = r.m_Srtt + 4.0 * r.m_RttVar;
+  }
+  return qBound<int>(m_TimeoutMin, qRound(timeout), m_TimeoutMax);
+}
+
 bool CMailSocket::readLine(QString &result)
 {
-  if (m_Socket->bytesAvailable() == 0)
+  if (!device()->canReadLine())
   {
-    if (!m_Socket->waitForReadyRead(TIMEOUT))
+    if (!waitForReadLine())
     {
       const QString err = "readLine: Connection timed out";
       if (m_Debug)
@@ -39,7 +532,9 @@ bool CMailSocket::readLine(QString &result)
       return false;
     }
   }
-  result = m_Socket->readLine();
+  QByteArray line = device()->readLine();
+  addTransferred(line.size());
+  result = line;
   result.chop(2);
 
   if (m_Debug)
@@ -72,7 +567,7 @@ bool CMailSocket::writeLine(const QString &str)
 {
   if (m_Debug)
   {
-    if (str.contains("PASS") || str.contains("LOGIN"))
+    if (str.contains("PASS") || str.contains("LOGIN") || str.contains("AUTH"))
     {
       qDebug() << "writeLine xxxxx";
     }
@@ -83,7 +578,13 @@ bool CMailSocket::writeLine(const QString &str)
   }
   QByteArray arr = str.toLocal8Bit();
   arr = arr + "\r\n";
-  int size = m_Socket->write(arr);
+  if (m_Phase == TimeoutPhase::tpCommand)
+  {
+    m_Verb = commandVerb(str);
+  }
+  m_LastWrite.start();
+  int size = device()->write(arr);
+  addTransferred(qMax(size, 0));
   if (size != arr.size())
   {
     QString err = QString("writeLine can not write all data %1 of %2")
@@ -95,3 +596,15 @@ bool CMailSocket::writeLine(const QString &str)
   }
   return (true);
 }
+
+// Slots
+
+void CMailSocket::socketError(QAbstractSocket::SocketError error)
+{
+  qCritical() << "Socket error " << error;
+}
+
+void CMailSocket::sslErrors(const QList<QSslError> &errors)
+{
+  qCritical() << "sslErrors" << errors;
+}
@@ -12,13 +12,22 @@
 #ifndef CMAILSOCKET_H_
 #define CMAILSOCKET_H_
 
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QHostAddress>
+#include <QLocalSocket>
 #include <QMessageLogger>
+#include <QProcess>
 #include <QSslSocket>
 #include <QString>
 #include <QStringList>
+#include <functional>
 #include <iostream>
 
+#include "COAuth2.h"
 #include "IMailProtocol.h"
+#include "mailtypes.h"
 
 class CMailSocket : public IMailProtocol
 {
@@ -27,23 +36,185 @@ public:
   CMailSocket() {}
   virtual ~CMailSocket() {}
 
+  /*
+   * Talk to the server over the stdin/stdout of a command or a Unix
+   * domain socket instead of TCP. Such a connection is already
+   * trusted, TLS is not used.
+   */
+  void setTransport(TRANSPORTS transport, const QString &tunnel)
+  {
+    m_Transport = transport;
+    m_TunnelPath = tunnel;
+  }
+
+  /*
+   * Authenticate with OAuth 2.0 access tokens instead of the password.
+   * The password is the refresh token then.
+   */
+  void setOAuth2(const QString &tokenurl, const QString &clientid,
+                 const QString &secret, const QString &refreshtoken);
+
+  /*
+   * A tunnel is its own endpoint, the command or socket decides where
+   * it connects to. It takes no connection slot.
+   */
+  QString endpoint(void) const override
+  {
+    return isTunnel() ? "tunnel:" + m_TunnelPath : m_Server.toLower();
+  }
+  bool usesConnectionSlot(void) const override
+  {
+    return !isTunnel();
+  }
+
+signals:
+  /*
+   * The token endpoint issued a new refresh token
+   */
+  void refreshTokenChanged(const QString &token);
+
 protected:
   bool readLine(QStringList &result);
   bool readLine(QString &result);
   bool writeLine(const QString &str);
 
   bool isConnected(void);
+
+  /*
+   * Get the access token, waits only if there is no valid token
+   */
+  bool getAccessToken(QString &token);
+  bool isTunnel(void) const
+  {
+    return m_Transport != TRANSPORT_TCP;
+  }
+
+  /*
+   * Resolve the server and connect to port. The addresses of both
+   * families are raced as described in RFC 8305 (Happy Eyeballs).
+   * On success m_Socket is the connected socket, otherwise
+   * m_ConnectError contains the reason. With a tunnel transport the
+   * command is started or the Unix socket is connected instead.
+   */
+  bool connectToServer(uint16_t port);
+
+  /*
+   * Close the connection, abort drops it without waiting for pending
+   * data.
+   */
+  void closeConnection(bool abort);
+
+  /*
+   * Wait for the socket without blocking the event processing of the
+   * server thread, so that a poll can be cancelled at any time.
+   * The timeout is derived from the measured round trip times of the
+   * current phase.
+   */
+  bool waitForEncrypted(void);
+  bool waitForReadLine(void);
   void enableDebug(bool enable)
   {
     m_Debug = enable;
   }
 
+  enum class TimeoutPhase
+  {
+    tpConnect,
+    tpHandshake,
+    tpLogin,
+    tpCommand,
+    tpFirst = tpConnect,
+    tpLast = tpCommand
+  };
+
+  /*
+   * Set the phase used for the timeout of readLine. In the command
+   * phase the timeout is estimated per command verb, a SEARCH or LIST
+   * takes much longer than a NOOP.
+   */
+  void setPhase(TimeoutPhase phase)
+  {
+    m_Phase = phase;
+  }
+  int getTimeout(TimeoutPhase phase) const;
+
   inline const static int TIMEOUT = 10 * 1000;
 
+public:
+  /*
+   * Limits for the adaptive timeouts in ms. Returns false and keeps
+   * the current limits if min is not positive or greater than max.
+   */
+  static bool setTimeoutBounds(int min, int max)
+  {
+    if ((min <= 0) || (min > max))
+    {
+      return false;
+    }
+    m_TimeoutMin = min;
+    m_TimeoutMax = max;
+    return true;
+  }
+
 protected:
   QSslSocket *m_Socket = nullptr;
+  QIODevice *m_Tunnel = nullptr; // QProcess or QLocalSocket
+  COAuth2 *m_OAuth = nullptr;
+  QString m_ConnectError;
   bool m_UseSSL = false;
   bool m_Debug = false;
+
+  /*
+   * Verb of a command line for its timeout estimator
+   */
+  virtual QString commandVerb(const QString &line) const
+  {
+    return line.section(QChar(' '), 0, 0).toUpper();
+  }
+
+private slots:
+  void socketError(QAbstractSocket::SocketError error);
+  void sslErrors(const QList<QSslError> &errors);
+
+private:
+  TRANSPORTS m_Transport = TRANSPORT_TCP;
+  QString m_TunnelPath;
+
+  QSslSocket *createSocket(void);
+  bool connectTunnel(void);
+  QIODevice *device(void) const
+  {
+    return isTunnel() ? m_Tunnel : m_Socket;
+  }
+  bool isAlive(void) const;
+  bool resolveServer(QList<QHostAddress> &addresses);
+  bool waitForSocket(const std::function<bool()> &done, int timeout);
+  bool waitForPhase(TimeoutPhase phase, const std::function<bool()> &done,
+                    const QElapsedTimer &started);
+  void addSample(TimeoutPhase phase, qint64 sample);
+  void timedOut(TimeoutPhase phase);
+
+  // Smoothed round trip time and variance per phase like the TCP
+  // retransmission timer (RFC 6298)
+  struct SRtt
+  {
+    bool m_Valid = false;
+    double m_Srtt = 0.0;
+    double m_RttVar = 0.0;
+  };
+  SRtt m_Rtt[static_cast<int>(TimeoutPhase::tpLast) + 1];
+  QHash<QString, SRtt> m_CommandRtt; // Command phase, per verb
+  QString m_Verb;                    // Verb of the last command
+  TimeoutPhase m_Phase = TimeoutPhase::tpCommand;
+  SRtt &rtt(TimeoutPhase phase);
+  const SRtt &rtt(TimeoutPhase phase) const;
+  QElapsedTimer m_LastWrite;
+
+  // RFC 8305 Connection Attempt Delay in ms
+  inline const static int CONNECTION_ATTEMPT_DELAY = 250;
+
+  inline static std::atomic_int m_TimeoutMin = 1000;
+  inline static std::atomic_int m_TimeoutMax = 30 * 1000;
 };
 
 #endif /* CMAILSOCKET_H_ */
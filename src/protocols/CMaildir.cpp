@@ -0,0 +1,354 @@
+/*
+ * CMaildir.cpp
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Count the mails of a local Maildir.
+ *
+ * Mails in new/ are unread, mails in cur/ are read if the info after
+ * ":2," contains the flag S. The directories are scanned once, after
+ * that inotify reports every delivery, flag change (a rename in cur/)
+ * and deletion, so that the counts are updated without rescans.
+ * The counts are stored with the modification times of new/ and cur/,
+ * after a restart they are taken without a scan if both are unchanged.
+ */
+
+#include "CMaildir.h"
+
+#include <QDataStream>
+#include <QDebug>
+#include <QFile>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "system/CSyncStore.h"
+
+static const uint32_t WATCH_MASK = IN_CREATE | IN_MOVED_TO | IN_DELETE |
+                                   IN_MOVED_FROM | IN_DELETE_SELF |
+                                   IN_MOVE_SELF | IN_ONLYDIR;
+
+CMaildir::CMaildir(const QString &path)
+{
+  setServer(path);
+  clearError();
+}
+
+CMaildir::~CMaildir()
+{
+  stopWatch();
+}
+
+QString CMaildir::folderPath(Folder folder) const
+{
+  return m_Server + ((folder == Folder::fdNew) ? "/new" : "/cur");
+}
+
+/*
+ * Add or remove a mail. Names starting with a dot are temporary files.
+ */
+void CMaildir::count(Folder folder, const char *name, int delta)
+{
+  if (name[0] == '.')
+  {
+    return;
+  }
+  if (folder == Folder::fdNew)
+  {
+    m_Unread += delta;
+    return;
+  }
+  const char *info = strstr(name, ":2,");
+  if ((info != nullptr) && (strchr(info + 3, 'S') != nullptr))
+  {
+    m_Read += delta;
+  }
+  else
+  {
+    m_Unread += delta;
+  }
+}
+
+/*
+ * Read the directory entries with getdents64 in large batches instead
+ * of one readdir() call per entry.
+ */
+bool CMaildir::scanFolder(Folder folder)
+{
+  const QString path = folderPath(folder);
+  int fd = open(QFile::encodeName(path).constData(),
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    setError("Can not open " + path + ": " + strerror(errno));
+    return false;
+  }
+  std::vector<char> buffer(DIRENT_BUFFER);
+  ssize_t size;
+  while ((size = getdents64(fd, buffer.data(), buffer.size())) > 0)
+  {
+    for (ssize_t pos = 0; pos < size;)
+    {
+      auto *entry = reinterpret_cast<struct dirent64 *>(buffer.data() + pos);
+      pos += entry->d_reclen;
+      if (entry->d_type != DT_DIR)
+      {
+        count(folder, entry->d_name, 1);
+      }
+    }
+    if (isCancelled())
+    {
+      break;
+    }
+  }
+  if (size < 0)
+  {
+    setError("Can not read " + path + ": " + strerror(errno));
+  }
+  close(fd);
+  return size == 0;
+}
+
+/*
+ * Count all mails. The watches are set before the scan. If mails
+ * changed during the scan, the events can not be told apart from the
+ * scanned entries, so the scan is repeated. If the Maildir is still
+ * changing after MAX_RESCANS, the counts are reported but neither kept
+ * up to date by the events nor saved, the next poll scans again.
+ */
+bool CMaildir::scan(void)
+{
+  stopWatch();
+  bool watching = startWatch();
+  qint64 newTime = 0;
+  qint64 curTime = 0;
+  bool times = folderTimes(newTime, curTime);
+  if (watching && times && !m_Restored)
+  {
+    m_Restored = true;
+    if (restoreState(newTime, curTime) && !drainEvents())
+    {
+      m_Valid = true;
+      m_PushActive = true;
+      qDebug() << "Maildir " << m_Server << " unchanged, unread " << m_Unread
+               << " read " << m_Read;
+      return true;
+    }
+  }
+  bool settled = false;
+  for (int i = 0; (i < MAX_RESCANS) && !settled; i++)
+  {
+    m_Unread = 0;
+    m_Read = 0;
+    if (!scanFolder(Folder::fdNew) || !scanFolder(Folder::fdCur))
+    {
+      stopWatch();
+      return false;
+    }
+    settled = !watching || !drainEvents();
+  }
+  if (!settled)
+  {
+    qInfo() << "Maildir " << m_Server << " changed during " << MAX_RESCANS
+            << " scans, scan again at the next poll";
+    m_Valid = false;
+  }
+  else
+  {
+    m_Valid = watching;
+    if (times)
+    {
+      saveState(newTime, curTime);
+    }
+  }
+  m_PushActive = m_Valid;
+  qDebug() << "Maildir " << m_Server << " scanned, unread " << m_Unread
+           << " read " << m_Read;
+  return true;
+}
+
+/*
+ * Modification times of new/ and cur/ in ns. Taken before the counts
+ * are updated, a later change leads to a different time.
+ */
+bool CMaildir::folderTimes(qint64 &newTime, qint64 &curTime) const
+{
+  struct stat st;
+  if (stat(QFile::encodeName(folderPath(Folder::fdNew)).constData(), &st) < 0)
+  {
+    return false;
+  }
+  newTime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  if (stat(QFile::encodeName(folderPath(Folder::fdCur)).constData(), &st) < 0)
+  {
+    return false;
+  }
+  curTime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  return true;
+}
+
+bool CMaildir::restoreState(qint64 newTime, qint64 curTime)
+{
+  CSyncStore::SState state;
+  if (!CSyncStore::instance().get(syncKey(), state) || (state.m_Unread < 0) ||
+      (state.m_Read < 0))
+  {
+    return false;
+  }
+  qint64 storedNew;
+  qint64 storedCur;
+  QDataStream in(state.m_Checkpoint);
+  in.setVersion(QDataStream::Qt_6_0);
+  in >> storedNew >> storedCur;
+  if ((in.status() != QDataStream::Ok) || (storedNew != newTime) || (storedCur != curTime))
+  {
+    return false;
+  }
+  m_Unread = state.m_Unread;
+  m_Read = state.m_Read;
+  return true;
+}
+
+void CMaildir::saveState(qint64 newTime, qint64 curTime)
+{
+  CSyncStore::SState state;
+  QDataStream out(&state.m_Checkpoint, QIODevice::WriteOnly);
+  out.setVersion(QDataStream::Qt_6_0);
+  out << newTime << curTime;
+  state.m_Unread = m_Unread;
+  state.m_Read = m_Read;
+  CSyncStore::instance().put(syncKey(), state);
+}
+
+QString CMaildir::syncKey(void) const
+{
+  return "maildir:" + m_Server;
+}
+
+bool CMaildir::startWatch(void)
+{
+  m_Inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (m_Inotify < 0)
+  {
+    qWarning() << "inotify not available, Maildir " << m_Server << " is rescanned";
+    return false;
+  }
+  m_WatchNew = inotify_add_watch(m_Inotify,
+                                 QFile::encodeName(folderPath(Folder::fdNew)).constData(),
+                                 WATCH_MASK);
+  m_WatchCur = inotify_add_watch(m_Inotify,
+                                 QFile::encodeName(folderPath(Folder::fdCur)).constData(),
+                                 WATCH_MASK);
+  if ((m_WatchNew < 0) || (m_WatchCur < 0))
+  {
+    stopWatch();
+    return false;
+  }
+  // Created here, so that the notifier lives in the server thread
+  m_Notifier = new QSocketNotifier(m_Inotify, QSocketNotifier::Read, this);
+  connect(m_Notifier, &QSocketNotifier::activated, this, &CMaildir::readEvents);
+  return true;
+}
+
+void CMaildir::stopWatch(void)
+{
+  m_Valid = false;
+  m_PushActive = false;
+  if (m_Notifier != nullptr)
+  {
+    // May be called from the activated signal of the notifier
+    m_Notifier->setEnabled(false);
+    m_Notifier->deleteLater();
+    m_Notifier = nullptr;
+  }
+  if (m_Inotify >= 0)
+  {
+    close(m_Inotify);
+  }
+  m_Inotify = -1;
+  m_WatchNew = -1;
+  m_WatchCur = -1;
+}
+
+/*
+ * Discard pending events, returns true if there were any
+ */
+bool CMaildir::drainEvents(void)
+{
+  std::vector<char> buffer(EVENT_BUFFER);
+  bool pending = false;
+  while (read(m_Inotify, buffer.data(), buffer.size()) > 0)
+  {
+    pending = true;
+  }
+  return pending;
+}
+
+void CMaildir::readEvents(void)
+{
+  std::vector<char> buffer(EVENT_BUFFER);
+  int oldunread = m_Unread;
+  int oldread = m_Read;
+  qint64 newTime = 0;
+  qint64 curTime = 0;
+  bool times = folderTimes(newTime, curTime);
+  ssize_t size;
+  while (m_Valid && ((size = read(m_Inotify, buffer.data(), buffer.size())) > 0))
+  {
+    for (ssize_t pos = 0; pos < size;)
+    {
+      auto *event = reinterpret_cast<struct inotify_event *>(buffer.data() + pos);
+      pos += sizeof(struct inotify_event) + event->len;
+      if (event->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+      {
+        // Events lost or the Maildir moved away
+        qInfo() << "Maildir " << m_Server << " rescan, event " << Qt::hex
+                << event->mask;
+        m_Valid = false;
+        break;
+      }
+      if ((event->len == 0) || (event->mask & IN_ISDIR))
+      {
+        continue;
+      }
+      Folder folder = (event->wd == m_WatchNew) ? Folder::fdNew : Folder::fdCur;
+      int delta = (event->mask & (IN_CREATE | IN_MOVED_TO)) ? 1 : -1;
+      count(folder, event->name, delta);
+    }
+  }
+  if (!m_Valid)
+  {
+    clearError();
+    if (!scan())
+    {
+      return;
+    }
+  }
+  else if (times)
+  {
+    saveState(newTime, curTime);
+  }
+  if ((oldunread != m_Unread) || (oldread != m_Read))
+  {
+    emit resultReady(getConfigurationIndex(), m_Unread, m_Read);
+  }
+}
+
+void CMaildir::doWork(void)
+{
+  clearError();
+  if (!m_Valid && !scan())
+  {
+    qCritical() << m_Error;
+    return;
+  }
+  emit resultReady(getConfigurationIndex(), m_Unread, m_Read);
+}
@@ -0,0 +1,83 @@
+/*
+ * CMaildir.h
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Count the mails of a local Maildir.
+ */
+
+#ifndef CMAILDIR_H_
+#define CMAILDIR_H_
+
+#include <QSocketNotifier>
+#include <QString>
+
+#include "IMailProtocol.h"
+
+class CMaildir : public IMailProtocol
+{
+  Q_OBJECT
+public:
+  CMaildir(const QString &path);
+  virtual ~CMaildir();
+
+  /*
+   * A Maildir has no password
+   */
+  void updatePassword(const QString newpasswd) override
+  {
+    Q_UNUSED(newpasswd);
+  }
+
+  bool needsNetwork(void) const override
+  {
+    return false;
+  }
+
+public slots:
+  void doWork(void) override;
+  void stopPush(void) override
+  {
+    stopWatch();
+  }
+
+private slots:
+  void readEvents(void);
+
+private:
+  enum class Folder
+  {
+    fdNew,
+    fdCur
+  };
+
+  bool scan(void);
+  bool scanFolder(Folder folder);
+  bool startWatch(void);
+  void stopWatch(void);
+  bool drainEvents(void);
+  void count(Folder folder, const char *name, int delta);
+  QString folderPath(Folder folder) const;
+  bool folderTimes(qint64 &newTime, qint64 &curTime) const;
+  bool restoreState(qint64 newTime, qint64 curTime);
+  void saveState(qint64 newTime, qint64 curTime);
+  QString syncKey(void) const;
+
+  int m_Unread = 0;
+  int m_Read = 0;
+  bool m_Valid = false;    // Counts are kept up to date by inotify
+  bool m_Restored = false; // Stored counts tried at the first scan
+  int m_Inotify = -1;
+  int m_WatchNew = -1;
+  int m_WatchCur = -1;
+  QSocketNotifier *m_Notifier = nullptr;
+
+  inline const static int DIRENT_BUFFER = 1024 * 1024;
+  inline const static int EVENT_BUFFER = 64 * 1024;
+  inline const static int MAX_RESCANS = 3;
+};
+
+#endif /* CMAILDIR_H_ */
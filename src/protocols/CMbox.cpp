@@ -0,0 +1,335 @@
+/*
+ * CMbox.cpp
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Count the mails of a local mbox file.
+ *
+ * The file is read in chunks with pread() and searched with memmem(),
+ * which the C library implements with vector instructions. It is not
+ * memory mapped, a mapping raises SIGBUS when the file is truncated
+ * during the scan. Size, inode and modification time are taken from
+ * the opened file. A message is read if its Status header contains R.
+ * Mail is delivered by appending, so after the first scan only the
+ * appended bytes are scanned. The file
+ * is scanned again completely if it was truncated, replaced or
+ * rewritten by a mail client.
+ */
+
+#include "CMbox.h"
+
+#include <QDataStream>
+#include <QDebug>
+#include <QHash>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "system/CSyncStore.h"
+
+static const char FROM_LINE[] = "\nFrom ";
+static const char STATUS_HEADER[] = "\nStatus:";
+
+CMbox::CMbox(const QString &path)
+{
+  setServer(path);
+  clearError();
+}
+
+/*
+ * Start of the next message after pos or nullptr
+ */
+const char *CMbox::findFrom(const char *pos, const char *end)
+{
+  const char *from = static_cast<const char *>(
+      memmem(pos, end - pos, FROM_LINE, sizeof(FROM_LINE) - 1));
+  return (from == nullptr) ? nullptr : from + 1;
+}
+
+/*
+ * Search the Status header in the header lines [msg, end)
+ */
+bool CMbox::isRead(const char *msg, const char *end)
+{
+  const char *status = static_cast<const char *>(
+      memmem(msg, end - msg, STATUS_HEADER, sizeof(STATUS_HEADER) - 1));
+  if (status == nullptr)
+  {
+    return false;
+  }
+  for (const char *p = status + sizeof(STATUS_HEADER) - 1; (p < end) && (*p != '\n'); p++)
+  {
+    if (*p == 'R')
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Append up to CHUNK_SIZE bytes at pos to buffer. eof is set at the end
+ * of the file, also if it was truncated since it was opened.
+ */
+bool CMbox::readChunk(int fd, qint64 pos, qint64 size, QByteArray &buffer, bool &eof)
+{
+  qint64 want = qMin(CHUNK_SIZE, size - pos);
+  qsizetype old = buffer.size();
+  buffer.resize(old + want);
+  qint64 got = 0;
+  while (got < want)
+  {
+    ssize_t n = pread(fd, buffer.data() + old + got, want - got, pos + got);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      buffer.resize(old + got);
+      setError("Can not read " + m_Server + ": " + strerror(errno));
+      return false;
+    }
+    if (n == 0)
+    {
+      break; // Truncated
+    }
+    got += n;
+  }
+  buffer.resize(old + got);
+  eof = (got < want) || (pos + got >= size);
+  return true;
+}
+
+bool CMbox::fingerprint(int fd, qint64 offset, size_t &result)
+{
+  qint64 start = qMax<qint64>(0, offset - FINGERPRINT_SIZE);
+  if (offset == start)
+  {
+    result = 0;
+    return true;
+  }
+  QByteArray data;
+  bool eof;
+  if (!readChunk(fd, start, offset, data, eof) || (data.size() != offset - start))
+  {
+    return false;
+  }
+  // Fixed seed, the fingerprint is stored across restarts
+  result = qHashBits(data.constData(), data.size(), 0);
+  return true;
+}
+
+/*
+ * Scan from the checkpoint to size and move the checkpoint to the
+ * start of the last message. Only the headers of the current message
+ * and the bytes of a From line split between two chunks are kept.
+ */
+bool CMbox::scan(int fd, qint64 size)
+{
+  const qint64 offset = m_Check.m_Offset;
+  QByteArray buffer;    // File contents from pos on
+  qint64 pos = offset;
+  qsizetype at = 0;     // Scan position in buffer
+  qint64 msg = -1;      // Start of the current message
+  bool headers = false; // The end of the headers of msg is not found yet
+  bool read = false;
+  bool eof = (size <= offset);
+  int messages = 0;
+  while (!eof)
+  {
+    if (!readChunk(fd, pos + buffer.size(), size, buffer, eof))
+    {
+      return false;
+    }
+    if ((msg < 0) && (pos == offset) && buffer.startsWith("From "))
+    {
+      msg = offset;
+      headers = true;
+    }
+    for (;;)
+    {
+      const char *begin = buffer.constData() + at;
+      const char *end = buffer.constData() + buffer.size();
+      if (headers)
+      {
+        const char *blank = static_cast<const char *>(memmem(begin, end - begin, "\n\n", 2));
+        if ((blank == nullptr) && !eof && (end - begin < HEADER_LIMIT))
+        {
+          break; // Read the rest of the headers
+        }
+        if (blank == nullptr)
+        {
+          blank = end; // Incomplete message
+        }
+        read = isRead(begin, blank);
+        headers = false;
+        at = blank - buffer.constData();
+        continue;
+      }
+      const char *from = findFrom(begin, end);
+      if (from == nullptr)
+      {
+        // Keep the start of a From line split between two chunks
+        at = qMax<qsizetype>(at, buffer.size() - (sizeof(FROM_LINE) - 2));
+        break;
+      }
+      if (msg >= 0)
+      {
+        if (read)
+        {
+          m_Check.m_Read++;
+        }
+        else
+        {
+          m_Check.m_Unread++;
+        }
+        if ((++messages % CANCEL_CHECK == 0) && isCancelled())
+        {
+          return false;
+        }
+      }
+      at = from - buffer.constData();
+      msg = pos + at;
+      headers = true;
+      read = false;
+    }
+    buffer.remove(0, at);
+    pos += at;
+    at = 0;
+  }
+  if (msg >= 0)
+  {
+    if (headers)
+    {
+      read = isRead(buffer.constData(), buffer.constData() + buffer.size());
+    }
+    m_Check.m_Offset = msg;
+    m_Check.m_LastUnread = read ? 0 : 1;
+    m_Check.m_LastRead = read ? 1 : 0;
+  }
+  return true;
+}
+
+/*
+ * Checkpoint of the last run, the first poll after a start then scans
+ * only the mails delivered meanwhile
+ */
+void CMbox::loadCheckpoint(void)
+{
+  CSyncStore::SState state;
+  if (!CSyncStore::instance().get(syncKey(), state) || state.m_Checkpoint.isEmpty())
+  {
+    return;
+  }
+  SCheckpoint check;
+  quint64 print;
+  QDataStream in(state.m_Checkpoint);
+  in.setVersion(QDataStream::Qt_6_0);
+  in >> check.m_Offset >> check.m_Size >> check.m_Modified >> check.m_Inode >> print >>
+      check.m_Unread >> check.m_Read >> check.m_LastUnread >> check.m_LastRead;
+  if (in.status() == QDataStream::Ok)
+  {
+    check.m_Fingerprint = print;
+    check.m_Valid = true;
+    m_Check = check;
+  }
+}
+
+void CMbox::saveCheckpoint(void)
+{
+  CSyncStore::SState state;
+  QDataStream out(&state.m_Checkpoint, QIODevice::WriteOnly);
+  out.setVersion(QDataStream::Qt_6_0);
+  out << m_Check.m_Offset << m_Check.m_Size << m_Check.m_Modified << m_Check.m_Inode
+      << static_cast<quint64>(m_Check.m_Fingerprint) << m_Check.m_Unread << m_Check.m_Read
+      << m_Check.m_LastUnread << m_Check.m_LastRead;
+  state.m_Unread = m_Check.m_Unread + m_Check.m_LastUnread;
+  state.m_Read = m_Check.m_Read + m_Check.m_LastRead;
+  CSyncStore::instance().put(syncKey(), state);
+}
+
+QString CMbox::syncKey(void) const
+{
+  return "mbox:" + m_Server;
+}
+
+void CMbox::doWork(void)
+{
+  clearError();
+  if (!m_Check.m_Valid)
+  {
+    loadCheckpoint();
+  }
+  // Size, inode and modification time of the file which is read
+  int fd = ::open(QFile::encodeName(m_Server).constData(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    if (errno != ENOENT)
+    {
+      setError("Can not open " + m_Server + ": " + strerror(errno));
+      qCritical() << m_Error;
+      return;
+    }
+    // Empty spool files are removed
+    if (m_Check.m_Valid)
+    {
+      CSyncStore::instance().remove(syncKey());
+    }
+    m_Check = SCheckpoint();
+    emit resultReady(getConfigurationIndex(), 0, 0);
+    return;
+  }
+  QFile file; // Closes fd
+  file.open(fd, QIODevice::ReadOnly, QFileDevice::AutoCloseHandle);
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+  {
+    setError("Can not access " + m_Server + ": " + strerror(errno));
+    qCritical() << m_Error;
+    return;
+  }
+  qint64 modified = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  bool same = m_Check.m_Valid && (m_Check.m_Inode == st.st_ino);
+  if (same && (m_Check.m_Size == st.st_size) && (m_Check.m_Modified == modified))
+  {
+    emit resultReady(getConfigurationIndex(), m_Check.m_Unread + m_Check.m_LastUnread,
+                     m_Check.m_Read + m_Check.m_LastRead);
+    return;
+  }
+
+  size_t print = 0;
+  bool append = same && (st.st_size > m_Check.m_Size) &&
+                fingerprint(fd, m_Check.m_Offset, print) &&
+                (print == m_Check.m_Fingerprint);
+  if (!append)
+  {
+    if (m_Check.m_Valid)
+    {
+      qInfo() << "mbox " << m_Server << " rewritten, full scan";
+    }
+    m_Check = SCheckpoint();
+  }
+  if (!scan(fd, st.st_size) ||
+      !fingerprint(fd, m_Check.m_Offset, m_Check.m_Fingerprint))
+  {
+    if (!m_Error.isEmpty())
+    {
+      qCritical() << m_Error;
+    }
+    m_Check = SCheckpoint();
+    return;
+  }
+  m_Check.m_Valid = true;
+  m_Check.m_Size = st.st_size;
+  m_Check.m_Modified = modified;
+  m_Check.m_Inode = st.st_ino;
+  saveCheckpoint();
+  emit resultReady(getConfigurationIndex(), m_Check.m_Unread + m_Check.m_LastUnread,
+                   m_Check.m_Read + m_Check.m_LastRead);
+}
@@ -0,0 +1,83 @@
+/*
+ * CMbox.h
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Count the mails of a local mbox file.
+ */
+
+#ifndef CMBOX_H_
+#define CMBOX_H_
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+
+#include "IMailProtocol.h"
+
+class CMbox : public IMailProtocol
+{
+  Q_OBJECT
+public:
+  CMbox(const QString &path);
+  virtual ~CMbox() {}
+
+  /*
+   * A mbox has no password
+   */
+  void updatePassword(const QString newpasswd) override
+  {
+    Q_UNUSED(newpasswd);
+  }
+
+  bool needsNetwork(void) const override
+  {
+    return false;
+  }
+
+public slots:
+  void doWork(void) override;
+
+private:
+  /*
+   * Scan position. All messages before m_Offset are counted in
+   * m_Unread and m_Read. The last message starts at m_Offset, it is
+   * scanned again after an append because it may have been incomplete.
+   */
+  struct SCheckpoint
+  {
+    bool m_Valid = false;
+    qint64 m_Offset = 0;
+    qint64 m_Size = 0;
+    qint64 m_Modified = 0; // ns
+    quint64 m_Inode = 0;
+    size_t m_Fingerprint = 0;
+    int m_Unread = 0;
+    int m_Read = 0;
+    int m_LastUnread = 0; // The message at m_Offset
+    int m_LastRead = 0;
+  };
+
+  bool scan(int fd, qint64 size);
+  bool readChunk(int fd, qint64 pos, qint64 size, QByteArray &buffer, bool &eof);
+  bool fingerprint(int fd, qint64 offset, size_t &result);
+  void loadCheckpoint(void);
+  void saveCheckpoint(void);
+  QString syncKey(void) const;
+  static bool isRead(const char *msg, const char *end);
+  static const char *findFrom(const char *pos, const char *end);
+
+  SCheckpoint m_Check;
+
+  // Bytes before the checkpoint to detect a rewritten file
+  inline const static qint64 FINGERPRINT_SIZE = 4096;
+  inline const static int CANCEL_CHECK = 1024; // messages
+  inline const static qint64 CHUNK_SIZE = 1024 * 1024;
+  // Longer headers are cut, e.g. in a file which is no mbox
+  inline const static qsizetype HEADER_LIMIT = 1024 * 1024;
+};
+
+#endif /* CMBOX_H_ */
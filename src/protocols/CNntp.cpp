@@ -0,0 +1,431 @@
+/*
+ * CNntp.cpp
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Count new articles of news groups (RFC 3977).
+ *
+ * The high water marks of all groups are requested in one round trip,
+ * either with LIST COUNTS or with pipelined GROUP commands. Articles
+ * above the last read mark are unread. The mark is taken from the
+ * ~/.newsrc of the news reader. Groups not found there are counted
+ * from the high water mark of the first poll, which is kept in the
+ * sync state store. This mark is never advanced, all articles arrived
+ * since the group was added stay unread. To count from the read
+ * articles, subscribe to the group in a news reader.
+ *
+ * A server which advertises MODE-READER is switched to reading with
+ * MODE READER before the login (RFC 3977, section 5.3).
+ */
+
+#include "CNntp.h"
+
+#include <QDir>
+#include <QFile>
+#include <QRegularExpression>
+
+#include "system/CSyncStore.h"
+
+CNntp::CNntp(const QString &server, const QString &user,
+             const QString &password, uint16_t port, const QString &groups,
+             bool debug_protocol, bool useSSL)
+    : m_User(user), m_Password(password), m_Port(port),
+      m_DebugProtocol(debug_protocol)
+{
+  m_UseSSL = useSSL;
+  setServer(server);
+  for (const QString &group : groups.split(',', Qt::SkipEmptyParts))
+  {
+    m_Groups.append(group.trimmed());
+  }
+  clearError();
+}
+
+void CNntp::end()
+{
+  if (m_Socket == nullptr)
+  {
+    return;
+  }
+  if (isCancelled())
+  {
+    closeConnection(true);
+    return;
+  }
+  if (isConnected())
+  {
+    int code;
+    QString text;
+    writeLine(QString("QUIT"));
+    readStatus(code, text);
+  }
+  closeConnection(false);
+}
+
+bool CNntp::readStatus(int &code, QString &text)
+{
+  QString line;
+  if (!readLine(line))
+  {
+    return false;
+  }
+  bool ok;
+  code = line.left(3).toInt(&ok);
+  text = line.mid(4);
+  if (!ok)
+  {
+    const QString err = "Protocol error " + line;
+    qCritical() << err;
+    setError(err);
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Read the lines of a multi line response up to the terminating dot
+ */
+bool CNntp::readMultiLine(QStringList &lines)
+{
+  QString line;
+  lines.clear();
+  while (readLine(line))
+  {
+    if (line == ".")
+    {
+      return true;
+    }
+    if (line.startsWith(".."))
+    {
+      line.remove(0, 1);
+    }
+    lines.append(line);
+  }
+  return false;
+}
+
+/*
+ * A server without CAPABILITIES has no capabilities. false only for
+ * a connection error.
+ */
+bool CNntp::capabilities(QStringList &caps)
+{
+  int code;
+  QString text;
+  caps.clear();
+  writeLine(QString("CAPABILITIES"));
+  if (!readStatus(code, text))
+  {
+    return m_Error.isEmpty();
+  }
+  return (code != 101) || readMultiLine(caps);
+}
+
+bool CNntp::modeReader(void)
+{
+  int code;
+  QString text;
+  writeLine(QString("MODE READER"));
+  if (!readStatus(code, text))
+  {
+    return false;
+  }
+  if ((code != 200) && (code != 201))
+  {
+    const QString err = "MODE READER failed: " + text;
+    qCritical() << err;
+    setError(err);
+    return false;
+  }
+  return true;
+}
+
+bool CNntp::startProtocol(void)
+{
+  int code;
+  QString text;
+  if (!readStatus(code, text))
+  {
+    return false;
+  }
+  if ((code != 200) && (code != 201))
+  {
+    const QString err = "Service not available: " + text;
+    qCritical() << err;
+    setError(err);
+    return false;
+  }
+  if (m_ListCounts < 0)
+  {
+    QStringList caps;
+    if (!capabilities(caps))
+    {
+      return false;
+    }
+    m_ModeReader = caps.contains("MODE-READER");
+    if (m_ModeReader && (!modeReader() || !capabilities(caps)))
+    {
+      return false;
+    }
+    m_ListCounts = 0;
+    for (const QString &cap : std::as_const(caps))
+    {
+      if (cap.startsWith("LIST ") && cap.contains(" COUNTS"))
+      {
+        m_ListCounts = 1;
+      }
+    }
+  }
+  else if (m_ModeReader && !modeReader())
+  {
+    return false;
+  }
+  if (!m_User.isEmpty() && !login())
+  {
+    return false;
+  }
+  return m_Error.isEmpty();
+}
+
+bool CNntp::login(void)
+{
+  int code;
+  QString text;
+  writeLine("AUTHINFO USER " + m_User);
+  if (!readStatus(code, text))
+  {
+    return false;
+  }
+  if (code == 381)
+  {
+    writeLine("AUTHINFO PASS " + m_Password);
+    if (!readStatus(code, text))
+    {
+      return false;
+    }
+  }
+  if (code != 281)
+  {
+    const QString err = "Login failed " + text;
+    qCritical() << err;
+    setError(err);
+    return false;
+  }
+  return true;
+}
+
+/*
+ * One LIST COUNTS for all groups: "group high low count status"
+ */
+bool CNntp::listCounts(QHash<QString, SGroup> &groups)
+{
+  int code;
+  QString text;
+  QStringList lines;
+  writeLine("LIST COUNTS " + m_Groups.join(','));
+  if (!readStatus(code, text))
+  {
+    return false;
+  }
+  if (code != 215)
+  {
+    m_ListCounts = 0;
+    return pipelineGroups(groups);
+  }
+  if (!readMultiLine(lines))
+  {
+    return false;
+  }
+  for (const QString &line : lines)
+  {
+    QStringList fields = line.split(' ', Qt::SkipEmptyParts);
+    if (fields.size() >= 4)
+    {
+      SGroup &group = groups[fields[0]];
+      group.m_High = fields[1].toLongLong();
+      group.m_Count = fields[3].toLongLong();
+      group.m_Valid = true;
+    }
+  }
+  return true;
+}
+
+/*
+ * Send all GROUP commands before reading the first response:
+ * "211 count low high group"
+ */
+bool CNntp::pipelineGroups(QHash<QString, SGroup> &groups)
+{
+  for (const QString &name : std::as_const(m_Groups))
+  {
+    if (!writeLine("GROUP " + name))
+    {
+      return false;
+    }
+  }
+  for (const QString &name : std::as_const(m_Groups))
+  {
+    int code;
+    QString text;
+    if (!readStatus(code, text))
+    {
+      return false;
+    }
+    if (code != 211)
+    {
+      qWarning() << "Group " << name << ": " << text;
+      continue;
+    }
+    QStringList fields = text.split(' ', Qt::SkipEmptyParts);
+    if (fields.size() >= 3)
+    {
+      SGroup &group = groups[name];
+      group.m_Count = fields[0].toLongLong();
+      group.m_High = fields[2].toLongLong();
+      group.m_Valid = true;
+    }
+  }
+  return true;
+}
+
+bool CNntp::getGroups(QHash<QString, SGroup> &groups)
+{
+  if (m_Groups.isEmpty())
+  {
+    return true;
+  }
+  if (m_ListCounts > 0)
+  {
+    return listCounts(groups);
+  }
+  return pipelineGroups(groups);
+}
+
+/*
+ * Highest article number read per group from ~/.newsrc, lines look
+ * like "group: 1-1234,1240"
+ */
+void CNntp::readNewsrc(QHash<QString, qint64> &marks)
+{
+  QFile file(QDir::home().filePath(NEWSRC));
+  if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+  {
+    return;
+  }
+  while (!file.atEnd())
+  {
+    QString line = QString::fromLocal8Bit(file.readLine()).trimmed();
+    qsizetype sep = line.indexOf(QRegularExpression("[:!]"));
+    if (sep <= 0)
+    {
+      continue;
+    }
+    qint64 high = 0;
+    for (const QString &range : line.mid(sep + 1).split(',', Qt::SkipEmptyParts))
+    {
+      high = qMax(high, range.section('-', -1).trimmed().toLongLong());
+    }
+    marks[line.left(sep)] = high;
+  }
+}
+
+void CNntp::countArticles(const QHash<QString, SGroup> &groups, int &unread, int &read)
+{
+  QHash<QString, qint64> newsrc;
+  readNewsrc(newsrc);
+  CSyncStore::SState state;
+  CSyncStore::instance().get(syncKey(), state);
+  bool changed = false;
+
+  unread = 0;
+  read = 0;
+  for (auto it = groups.cbegin(); it != groups.cend(); ++it)
+  {
+    if (!it->m_Valid)
+    {
+      continue;
+    }
+    qint64 mark = newsrc.value(it.key(), -1);
+    if (mark < 0)
+    {
+      // Not read by a news reader, count from the first poll
+      mark = state.m_Marks.value(it.key(), -1);
+      if (mark < 0)
+      {
+        mark = it->m_High;
+        state.m_Marks.insert(it.key(), mark);
+        changed = true;
+      }
+    }
+    qint64 count = qBound<qint64>(0, it->m_High - mark, it->m_Count);
+    unread += count;
+    read += it->m_Count - count;
+  }
+  // Groups removed from the configuration
+  for (auto it = state.m_Marks.begin(); it != state.m_Marks.end();)
+  {
+    if (m_Groups.contains(it.key()))
+    {
+      ++it;
+    }
+    else
+    {
+      it = state.m_Marks.erase(it);
+      changed = true;
+    }
+  }
+  if (changed || (state.m_Unread != unread) || (state.m_Read != read))
+  {
+    state.m_Unread = unread;
+    state.m_Read = read;
+    CSyncStore::instance().put(syncKey(), state);
+  }
+}
+
+QString CNntp::syncKey(void) const
+{
+  return "nntp:" + m_User + "@" + m_Server + ":" + QString::number(m_Port);
+}
+
+void CNntp::doWork(void)
+{
+  clearError();
+  if (!connectToServer(m_Port))
+  {
+    QString err = "P: Can not connect to host " + m_Server + " " + QString::number(m_Port) + ": " + m_ConnectError;
+    setError(err);
+    qCritical() << err;
+    return;
+  }
+  if (m_UseSSL)
+  {
+    m_Socket->startClientEncryption();
+    if (!waitForEncrypted())
+    {
+      QString err = "E: Can not connect to host " + m_Server + " " + QString::number(m_Port) + ": " + m_Socket->errorString();
+      qCritical() << err;
+      setError(err);
+      return;
+    }
+  }
+  setPhase(TimeoutPhase::tpLogin);
+  if (!startProtocol())
+  {
+    end();
+    return;
+  }
+  setPhase(TimeoutPhase::tpCommand);
+
+  QHash<QString, SGroup> groups;
+  if (getGroups(groups))
+  {
+    int unread;
+    int read;
+    countArticles(groups, unread, read);
+    emit resultReady(getConfigurationIndex(), unread, read);
+  }
+  end();
+}
@@ -0,0 +1,77 @@
+/*
+ * CNntp.h
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Count new articles of news groups (RFC 3977).
+ */
+
+#ifndef CNNTP_H_
+#define CNNTP_H_
+
+#include <QHash>
+#include <QString>
+#include <QStringList>
+
+#include "CMailSocket.h"
+
+class CNntp : public CMailSocket
+{
+  Q_OBJECT
+public:
+  /*
+   * groups is a comma separated list of news groups
+   */
+  CNntp(const QString &server, const QString &user, const QString &password,
+        uint16_t port, const QString &groups, bool debug_protocol,
+        bool useSSL = false);
+  virtual ~CNntp() { end(); }
+
+  /*
+   * Set a new password
+   */
+  void updatePassword(const QString newpasswd) override
+  {
+    m_Password = newpasswd;
+  }
+
+public slots:
+  void doWork(void) override;
+
+private:
+  struct SGroup
+  {
+    qint64 m_Count = 0;
+    qint64 m_High = 0;
+    bool m_Valid = false;
+  };
+
+  bool readStatus(int &code, QString &text);
+  bool readMultiLine(QStringList &lines);
+  bool capabilities(QStringList &caps);
+  bool modeReader(void);
+  bool startProtocol(void);
+  bool login(void);
+  bool getGroups(QHash<QString, SGroup> &groups);
+  bool listCounts(QHash<QString, SGroup> &groups);
+  bool pipelineGroups(QHash<QString, SGroup> &groups);
+  void countArticles(const QHash<QString, SGroup> &groups, int &unread, int &read);
+  void readNewsrc(QHash<QString, qint64> &marks);
+  QString syncKey(void) const;
+  void end(void);
+
+  QString m_User;
+  QString m_Password;
+  QStringList m_Groups;
+  uint16_t m_Port = 0;
+  bool m_DebugProtocol = false;
+  int m_ListCounts = -1; // LIST COUNTS supported, -1 unknown
+  bool m_ModeReader = false; // Switch with MODE READER
+
+  inline const static QString NEWSRC = ".newsrc";
+};
+
+#endif /* CNNTP_H_ */
@@ -0,0 +1,232 @@
+/*
+ * COAuth2.cpp
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Access tokens for OAuth 2.0 bearer authentication (RFC 6749, RFC 7628).
+ *
+ * The access token is refreshed with the refresh token in the
+ * background some minutes before it expires, so a poll takes the
+ * current token without waiting for the token endpoint. Only when
+ * there is no valid token at all, e.g. at start or after a suspend,
+ * the poll waits for the refresh.
+ */
+
+#include "COAuth2.h"
+
+#include <QHostAddress>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutexLocker>
+#include <QNetworkRequest>
+#include <QUrl>
+
+COAuth2::COAuth2(const QString &tokenurl, const QString &clientid,
+                 const QString &secret, QObject *parent)
+    : QObject(parent), m_TokenUrl(tokenurl), m_ClientId(clientid),
+      m_ClientSecret(secret)
+{
+  m_Timer = new QTimer(this);
+  m_Timer->setSingleShot(true);
+  connect(m_Timer, &QTimer::timeout, this, &COAuth2::refresh);
+}
+
+void COAuth2::setRefreshToken(const QString &token)
+{
+  QMutexLocker lock(&m_Mutex);
+  if (token == m_RefreshToken)
+  {
+    return;
+  }
+  m_RefreshToken = token;
+  m_AccessToken.clear();
+  m_Revoked = false;
+  lock.unlock();
+  if (!token.isEmpty())
+  {
+    requestRefresh();
+  }
+}
+
+QString COAuth2::accessToken(void)
+{
+  QMutexLocker lock(&m_Mutex);
+  if (!m_AccessToken.isEmpty() &&
+      (QDateTime::currentDateTimeUtc().secsTo(m_Expiry) > EXPIRY_MARGIN))
+  {
+    return m_AccessToken;
+  }
+  bool refresh = !m_RefreshToken.isEmpty() && !m_Revoked;
+  lock.unlock();
+  if (refresh)
+  {
+    requestRefresh();
+  }
+  return QString();
+}
+
+void COAuth2::invalidate(void)
+{
+  QMutexLocker lock(&m_Mutex);
+  m_AccessToken.clear();
+  lock.unlock();
+  requestRefresh();
+}
+
+/*
+ * The refresh runs in the thread of this object
+ */
+void COAuth2::requestRefresh(void)
+{
+  QMetaObject::invokeMethod(this, &COAuth2::refresh, Qt::QueuedConnection);
+}
+
+void COAuth2::schedule(int seconds)
+{
+  m_Timer->start(seconds * 1000);
+}
+
+bool COAuth2::isValidUrl(void) const
+{
+  QUrl url(m_TokenUrl);
+  if (!url.isValid() || url.host().isEmpty())
+  {
+    return false;
+  }
+  if (url.scheme() == "https")
+  {
+    return true;
+  }
+  return (url.scheme() == "http") &&
+         ((url.host() == "localhost") || QHostAddress(url.host()).isLoopback());
+}
+
+void COAuth2::refresh(void)
+{
+  if (m_Reply != nullptr)
+  {
+    return; // Running
+  }
+  QMutexLocker lock(&m_Mutex);
+  const QString token = m_RefreshToken;
+  bool revoked = m_Revoked;
+  lock.unlock();
+  if (token.isEmpty() || revoked)
+  {
+    return;
+  }
+  if (!isValidUrl())
+  {
+    qCritical() << "Invalid token endpoint " << m_TokenUrl;
+    emit tokenChanged();
+    return;
+  }
+  if (m_Manager == nullptr)
+  {
+    m_Manager = new QNetworkAccessManager(this);
+  }
+  m_Timer->stop();
+
+  QByteArray form = "grant_type=refresh_token&refresh_token=" +
+                    QUrl::toPercentEncoding(token) +
+                    "&client_id=" + QUrl::toPercentEncoding(m_ClientId);
+  if (!m_ClientSecret.isEmpty())
+  {
+    form += "&client_secret=" + QUrl::toPercentEncoding(m_ClientSecret);
+  }
+  QNetworkRequest request{QUrl(m_TokenUrl)};
+  request.setHeader(QNetworkRequest::ContentTypeHeader, "application/x-www-form-urlencoded");
+  request.setRawHeader("Accept", "application/json");
+  request.setTransferTimeout(TIMEOUT);
+  m_Started.start();
+  m_Reply = m_Manager->post(request, form);
+  connect(m_Reply, &QNetworkReply::finished, this, &COAuth2::refreshFinished);
+}
+
+void COAuth2::refreshFinished(void)
+{
+  QNetworkReply *reply = m_Reply;
+  m_Reply = nullptr;
+  reply->deleteLater();
+  qint64 elapsed = m_Started.elapsed();
+  m_RefreshTime += elapsed;
+  m_Refreshes++;
+
+  const QJsonObject obj = QJsonDocument::fromJson(reply->readAll()).object();
+  const QString access = obj.value("access_token").toString();
+  if ((reply->error() != QNetworkReply::NoError) || access.isEmpty())
+  {
+    const QString error = obj.value("error").toString();
+    qWarning() << "Token refresh failed after " << elapsed << " ms: "
+               << reply->errorString() << " " << error;
+    if (error == "invalid_grant")
+    {
+      // Refresh token revoked or expired, wait for a new one
+      QMutexLocker lock(&m_Mutex);
+      m_Revoked = true;
+    }
+    else
+    {
+      m_Failures++;
+      schedule(qMin(RETRY_MAX, RETRY_MIN << qMin(m_Failures - 1, 8)));
+    }
+    emit tokenChanged();
+    return;
+  }
+  qInfo() << "Token refresh took " << elapsed << " ms";
+  m_Failures = 0;
+  int expires = obj.value("expires_in").toVariant().toInt();
+  if (expires <= 0)
+  {
+    expires = 3600;
+  }
+  const QString rotated = obj.value("refresh_token").toString();
+  bool changed = false;
+  {
+    QMutexLocker lock(&m_Mutex);
+    m_AccessToken = access;
+    m_Expiry = QDateTime::currentDateTimeUtc().addSecs(expires);
+    if (!rotated.isEmpty() && (rotated != m_RefreshToken))
+    {
+      m_RefreshToken = rotated;
+      changed = true;
+    }
+  }
+  if (changed)
+  {
+    emit refreshTokenChanged(rotated);
+  }
+  // Ahead of the expiry, short lived tokens after three quarters of
+  // their lifetime
+  schedule(qMax(RETRY_MIN, expires - qMin(REFRESH_AHEAD, expires / 4)));
+  emit tokenChanged();
+}
+
+QByteArray COAuth2::xoauth2(const QString &user, const QString &token)
+{
+  return "user=" + user.toUtf8() + "\x01" + "auth=Bearer " + token.toUtf8() + "\x01\x01";
+}
+
+QByteArray COAuth2::oauthBearer(const QString &user, const QString &host,
+                                uint16_t port, const QString &token)
+{
+  QByteArray name = user.toUtf8();
+  name.replace("=", "=3D");
+  name.replace(",", "=2C");
+  return "n,a=" + name + ",\x01" + "host=" + host.toUtf8() + "\x01" +
+         "port=" + QByteArray::number(port) + "\x01" +
+         "auth=Bearer " + token.toUtf8() + "\x01\x01";
+}
+
+double COAuth2::refreshLatency(void)
+{
+  qint64 refreshes = m_Refreshes;
+  if (refreshes <= 0)
+  {
+    return 0.0;
+  }
+  return static_cast<double>(m_RefreshTime) / refreshes;
+}
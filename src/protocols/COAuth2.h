@@ -0,0 +1,111 @@
+/*
+ * COAuth2.h
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Access tokens for OAuth 2.0 bearer authentication (RFC 6749, RFC 7628).
+ */
+
+#ifndef COAUTH2_H_
+#define COAUTH2_H_
+
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QObject>
+#include <QString>
+#include <QTimer>
+#include <atomic>
+
+class COAuth2 : public QObject
+{
+  Q_OBJECT
+public:
+  /*
+   * The token endpoint must use https, plain http is accepted for
+   * loopback addresses, e.g. a local stand-in token server.
+   */
+  COAuth2(const QString &tokenurl, const QString &clientid,
+          const QString &secret, QObject *parent = nullptr);
+
+  /*
+   * Set the refresh token. May be called from any thread.
+   */
+  void setRefreshToken(const QString &token);
+
+  /*
+   * Current access token, empty if there is no valid one. A refresh
+   * is started then. May be called from any thread.
+   */
+  QString accessToken(void);
+
+  /*
+   * The server rejected the access token, get a new one
+   */
+  void invalidate(void);
+
+  /*
+   * Initial client responses of the SASL mechanisms
+   */
+  static QByteArray xoauth2(const QString &user, const QString &token);
+  static QByteArray oauthBearer(const QString &user, const QString &host,
+                                uint16_t port, const QString &token);
+
+  /*
+   * Average time of the token refreshes in ms since start
+   */
+  static double refreshLatency(void);
+
+signals:
+  /*
+   * A refresh finished, successful or not
+   */
+  void tokenChanged(void);
+
+  /*
+   * The token endpoint issued a new refresh token, which must be stored
+   */
+  void refreshTokenChanged(const QString &token);
+
+private slots:
+  void refresh(void);
+  void refreshFinished(void);
+
+private:
+  void requestRefresh(void);
+  void schedule(int seconds);
+  bool isValidUrl(void) const;
+
+  QString m_TokenUrl;
+  QString m_ClientId;
+  QString m_ClientSecret;
+
+  // Tokens, shared with the threads of the callers
+  QMutex m_Mutex;
+  QString m_RefreshToken;
+  QString m_AccessToken;
+  QDateTime m_Expiry; // Wall clock, the monotonic clock stops on suspend
+  bool m_Revoked = false;
+
+  QNetworkAccessManager *m_Manager = nullptr;
+  QNetworkReply *m_Reply = nullptr;
+  QTimer *m_Timer = nullptr;
+  QElapsedTimer m_Started;
+  int m_Failures = 0;
+
+  inline const static int REFRESH_AHEAD = 300; // s before the expiry
+  inline const static int EXPIRY_MARGIN = 30;  // s, token is not used anymore
+  inline const static int RETRY_MIN = 15;      // s
+  inline const static int RETRY_MAX = 3600;    // s
+  inline const static int TIMEOUT = 30 * 1000;
+
+  inline static std::atomic<qint64> m_RefreshTime = 0;
+  inline static std::atomic<qint64> m_Refreshes = 0;
+};
+
+#endif /* COAUTH2_H_ */
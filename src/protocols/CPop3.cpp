@@ -11,6 +11,7 @@
 
 #include "CPop3.h"
 
+#include <QCryptographicHash>
 #include <QRegularExpression>
 #include <QRegularExpressionMatch>
 
@@ -31,21 +32,6 @@ CPop3::CPop3(const QString &server, const QString &user,
 
 CPop3::~CPop3() { end(); }
 
-void CPop3::createConnection(void)
-{
-  qRegisterMetaType<QAbstractSocket::SocketError>(
-      "QAbstractSocket::SocketError");
-  m_Socket = new QSslSocket(this);
-
-  connect(m_Socket,
-          QOverload<QAbstractSocket::SocketError>::of(
-              &QAbstractSocket::errorOccurred),
-          this, &CPop3::socketError);
-  connect(m_Socket,
-          QOverload<const QList<QSslError> &>::of(&QSslSocket::sslErrors),
-          this, &CPop3::sslErrors);
-}
-
 bool CPop3::readResponse(QStringList &result)
 {
   if (!readLine(result))
@@ -68,19 +54,22 @@ bool CPop3::readResponse(QStringList &result)
 
 void CPop3::doWork(void)
 {
-  if (m_Socket == NULL)
+  clearError();
+  if (!connectToServer(m_Port))
   {
-    createConnection();
+    QString err = "P: Can not connect to host " + m_Server + " " + QString::number(m_Port) + ": " + m_ConnectError;
+    setError(err);
+    qCritical() << err;
+    return;
   }
-  clearError();
   if (m_UseSSL)
   {
     if (m_AllowSelfSigned)
     {
       m_Socket->setPeerVerifyMode(QSslSocket::VerifyNone);
     }
-    m_Socket->connectToHostEncrypted(m_Server, m_Port);
-    if (!m_Socket->waitForEncrypted(TIMEOUT))
+    m_Socket->startClientEncryption();
+    if (!waitForEncrypted())
     {
       QString err = "E: Can not connect to host " + m_Server + " " + QString::number(m_Port) + ": " + m_Socket->errorString();
       qCritical() << err;
@@ -88,22 +77,12 @@ void CPop3::doWork(void)
       return;
     }
   }
-  else
-  {
-    m_Socket->connectToHost(m_Server, m_Port);
-
-    if (!m_Socket->waitForConnected(TIMEOUT))
-    {
-      QString err = "P: Can not connect to host " + m_Server + " " + QString::number(m_Port) + ": " + m_Socket->errorString();
-      setError(err);
-      qCritical() << err;
-      return;
-    }
-  }
+  setPhase(TimeoutPhase::tpLogin);
   if (!startProtocol())
   {
     return;
   }
+  setPhase(TimeoutPhase::tpCommand);
   int unread;
   int read;
   if (getMail(unread, read))
@@ -143,6 +122,15 @@ CPop3::Pop3Return CPop3::readChall(QString &result)
 
 void CPop3::end()
 {
+  if (m_Socket == nullptr)
+  {
+    return;
+  }
+  if (isCancelled())
+  {
+    m_Socket->abort();
+    return;
+  }
   if (m_Socket->state() == QTcpSocket::ConnectedState)
   {
     writeLine(QString("QUIT"));
@@ -152,8 +140,13 @@ void CPop3::end()
 
 CPop3::Pop3Return CPop3::readCapa()
 {
-  QString response = m_Socket->readLine();
-  while ((!response.isNull()) && (response.left(1) != "."))
+  QString response;
+  m_AuthCramMd5 = false;
+  m_AuthScram = false;
+  m_AuthScramPlus = false;
+  m_AuthXOAuth2 = false;
+  m_AuthOAuthBearer = false;
+  while (readLine(response) && (response != "."))
   {
     if (m_Debug)
     {
@@ -161,56 +154,224 @@ CPop3::Pop3Return CPop3::readCapa()
     }
     if (response.left(4) == "SASL")
     {
-      m_AuthCramMd5 = response.contains("CRAM-MD5");
+      const QStringList mechanisms = response.split(' ', Qt::SkipEmptyParts);
+      m_AuthCramMd5 = mechanisms.contains("CRAM-MD5");
+      m_AuthScram = mechanisms.contains(CScram::MECHANISM);
+      m_AuthScramPlus = mechanisms.contains(CScram::MECHANISM_PLUS);
+      m_AuthXOAuth2 = mechanisms.contains("XOAUTH2");
+      m_AuthOAuthBearer = mechanisms.contains("OAUTHBEARER");
     }
     else if (response.left(4) == "STLS")
     {
       m_StartTLS = true;
     }
-    response = m_Socket->readLine();
   }
   return (POP3_OK);
 }
 
+/*
+ * Read a "+ base64" continuation (RFC 5034). Returns false without an
+ * error if the server finished the command with -ERR.
+ */
+bool CPop3::readContinuation(QByteArray &data)
+{
+  QStringList list;
+  if (!readLine(list))
+  {
+    return false;
+  }
+  if (list.at(0) == "+")
+  {
+    data = QByteArray::fromBase64(list.value(1).toLatin1());
+    return true;
+  }
+  qInfo() << "Authentication rejected " << list.mid(1).join(' ');
+  return false;
+}
+
+/*
+ * SASL SCRAM-SHA-256 (RFC 7677), with channel binding to the TLS
+ * certificate of the server if it offers SCRAM-SHA-256-PLUS.
+ */
+bool CPop3::authenticateScram()
+{
+  QByteArray binding;
+  if (m_Socket->isEncrypted())
+  {
+    binding = CCrypt::tlsServerEndPoint(m_Socket->peerCertificate());
+  }
+  CScram scram(m_User, m_Password, binding, m_AuthScramPlus);
+  if (!m_AuthScram && (scram.mechanism() != CScram::MECHANISM_PLUS))
+  {
+    return false; // Only -PLUS offered, but the client can not bind
+  }
+  QByteArray challenge;
+  QByteArray response;
+
+  writeLine("AUTH " + scram.mechanism());
+  if (!readContinuation(challenge))
+  {
+    return false;
+  }
+  writeLine(scram.clientFirst().toBase64());
+  if (!readContinuation(challenge))
+  {
+    return false;
+  }
+  if (!scram.clientFinal(challenge, response))
+  {
+    writeLine(QString("*"));
+    qCritical() << scram.getError();
+    setError(scram.getError());
+    return false;
+  }
+  writeLine(response.toBase64());
+  if (!readContinuation(challenge))
+  {
+    return false;
+  }
+  if (!scram.verifyServer(challenge))
+  {
+    // Do not fall back to a weaker method with an untrusted server
+    writeLine(QString("*"));
+    qCritical() << scram.getError();
+    setError(scram.getError());
+    return false;
+  }
+  writeLine(QString(""));
+  QStringList list;
+  return readResponse(list);
+}
+
+/*
+ * SASL OAUTHBEARER (RFC 7628) or XOAUTH2 with the access token as
+ * initial response. A rejected token is answered with an error as
+ * continuation, which the client acknowledges before -ERR.
+ */
+bool CPop3::authenticateOAuth2()
+{
+  QString token;
+  if (!getAccessToken(token))
+  {
+    return false;
+  }
+  bool bearer = m_AuthOAuthBearer;
+  if (!bearer && !m_AuthXOAuth2)
+  {
+    const QString err = "Server does not support OAuth2";
+    qCritical() << err;
+    setError(err);
+    return false;
+  }
+  const QByteArray response = bearer ? COAuth2::oauthBearer(m_User, m_Server, m_Port, token)
+                                     : COAuth2::xoauth2(m_User, token);
+  writeLine(QString(bearer ? "AUTH OAUTHBEARER " : "AUTH XOAUTH2 ") + response.toBase64());
+  QStringList list;
+  if (!readLine(list))
+  {
+    return false;
+  }
+  if (list.at(0) == "+")
+  {
+    qWarning() << "OAuth2 error " << QByteArray::fromBase64(list.value(1).toLatin1());
+    writeLine(bearer ? QString("AQ==") : QString(""));
+    if (!readLine(list))
+    {
+      return false;
+    }
+  }
+  if (list.at(0) == "+OK")
+  {
+    return true;
+  }
+  m_OAuth->invalidate();
+  const QString err = "Login failed " + list.mid(1).join(' ');
+  qCritical() << err;
+  setError(err);
+  return false;
+}
+
 bool CPop3::login()
 {
   QString str;
   QStringList list;
 
   // Get Capabilities
-  if (!m_UseSSL)
+  str = "CAPA";
+  writeLine(str);
+  if (!readResponse(list))
+  {
+    qWarning("CAPA not supported");
+  }
+  else
+  {
+    readCapa();
+  }
+
+  if (m_StartTLS && !m_UseSSL)
   {
-    str = "CAPA";
+    str = "STLS";
     writeLine(str);
     if (!readResponse(list))
     {
-      qWarning("CAPA not supported");
+      qWarning("Error on STLS");
     }
     else
     {
-      readCapa();
-    }
-
-    if (m_StartTLS)
-    {
-      str = "STLS";
-      writeLine(str);
-      if (!readResponse(list))
+      qInfo("Starting TLS");
+      if (m_AllowSelfSigned)
       {
-        qWarning("Error on STLS");
+        m_Socket->setPeerVerifyMode(QSslSocket::VerifyNone);
       }
-      else
+      m_Socket->startClientEncryption();
+      if (!waitForEncrypted())
       {
-        qInfo("Starting TLS");
-        if (m_AllowSelfSigned)
-        {
-          m_Socket->setPeerVerifyMode(QSslSocket::VerifyNone);
-        }
-        m_Socket->startClientEncryption();
+        const QString err = "STLS failed: " + m_Socket->errorString();
+        qCritical() << err;
+        setError(err);
+        end();
+        return false;
+      }
+      // Capabilities before STLS must be discarded (RFC 2595)
+      writeLine(QString("CAPA"));
+      if (readResponse(list))
+      {
+        readCapa();
       }
     }
   }
 
+  if (m_OAuth != nullptr)
+  {
+    // The password is a refresh token, never send it
+    if (authenticateOAuth2())
+    {
+      return true;
+    }
+    end();
+    return false;
+  }
+  if (m_AuthScram || m_AuthScramPlus)
+  {
+    QElapsedTimer timer;
+    timer.start();
+    bool ok = authenticateScram();
+    if (m_Debug)
+    {
+      qDebug() << "SCRAM authentication took " << timer.elapsed() << " ms";
+    }
+    if (ok)
+    {
+      return true;
+    }
+    if (!m_Error.isEmpty())
+    {
+      end();
+      return false;
+    }
+    qInfo("SCRAM-SHA-256 failed");
+  }
+
   // First try CRAM-MD5
   if (m_AuthCramMd5)
   {
@@ -344,14 +505,3 @@ bool CPop3::startProtocol()
   }
   return success;
 }
-// Slots
-
-void CPop3::socketError(QAbstractSocket::SocketError socketError)
-{
-  qCritical() << "Socket error " << socketError;
-}
-
-void CPop3::sslErrors(const QList<QSslError> &errors)
-{
-  qCritical() << "sslErrors" << errors;
-}
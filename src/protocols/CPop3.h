@@ -46,13 +46,19 @@ private:
   bool login(void);
   Pop3Return readCapa(void);
   Pop3Return readChall(QString &result);
+  bool readContinuation(QByteArray &data);
+  bool authenticateScram(void);
+  bool authenticateOAuth2(void);
   bool startProtocol(void);
   bool readResponse(QStringList &result);
   void end();
   bool getMail(int &unread, int &read);
-  void createConnection(void);
 
   bool m_AuthCramMd5 = false;
+  bool m_AuthScram = false;
+  bool m_AuthScramPlus = false;
+  bool m_AuthXOAuth2 = false;
+  bool m_AuthOAuthBearer = false;
   bool m_AuthApop = false;
   bool m_StartTLS = false;
   bool m_AllowSelfSigned = false;
@@ -64,13 +70,14 @@ private:
   void updatePassword(const QString newpasswd) override
   {
     m_Password = newpasswd;
+    if (m_OAuth != nullptr)
+    {
+      m_OAuth->setRefreshToken(newpasswd);
+    }
   }
 
 public slots:
   void doWork(void) override;
-private slots:
-  void socketError(QAbstractSocket::SocketError socketError);
-  void sslErrors(const QList<QSslError> &errors);
 };
 
 #endif /* CPOP3_H_ */
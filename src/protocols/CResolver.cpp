@@ -0,0 +1,247 @@
+/*
+ * CResolver.cpp
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Shared DNS cache for all mail servers.
+ */
+
+#include "CResolver.h"
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QDnsLookup>
+#include <QHostInfo>
+#include <QSet>
+#include <memory>
+
+CResolver::CResolver() : m_PrefetchTimer(this)
+{
+  m_PrefetchTimer.setSingleShot(true);
+  m_PrefetchTimer.setTimerType(Qt::CoarseTimer);
+  connect(&m_PrefetchTimer, &QTimer::timeout, this, &CResolver::prefetch);
+  // Lookups and prefetch timer run in the event loop of the main thread
+  if (QCoreApplication::instance() != nullptr)
+  {
+    moveToThread(QCoreApplication::instance()->thread());
+  }
+}
+
+bool CResolver::lookup(const QString &host, QList<QHostAddress> &addresses)
+{
+  QMutexLocker lock(&m_Mutex);
+  auto it = m_Cache.find(host);
+  if ((it == m_Cache.end()) || it->m_Addresses.isEmpty())
+  {
+    return false;
+  }
+  addresses = it->m_Addresses;
+  it->m_LastUsed.start();
+  if (it->m_Expires.hasExpired() && !it->m_Pending)
+  {
+    // Use the stale entry and refresh it in the background
+    QMetaObject::invokeMethod(this, [this, host]()
+                              { startLookup(host); }, Qt::QueuedConnection);
+  }
+  return true;
+}
+
+void CResolver::requestLookup(const QString &host)
+{
+  QMetaObject::invokeMethod(this, [this, host]()
+                            { startLookup(host); }, Qt::QueuedConnection);
+}
+
+QAbstractSocket::NetworkLayerProtocol CResolver::preferredProtocol(const QString &host)
+{
+  QMutexLocker lock(&m_Mutex);
+  auto it = m_Cache.find(host);
+  if (it == m_Cache.end())
+  {
+    return QAbstractSocket::IPv6Protocol;
+  }
+  return it->m_Preferred;
+}
+
+void CResolver::setPreferredProtocol(const QString &host,
+                                     QAbstractSocket::NetworkLayerProtocol protocol)
+{
+  QMutexLocker lock(&m_Mutex);
+  auto it = m_Cache.find(host);
+  if (it != m_Cache.end())
+  {
+    it->m_Preferred = protocol;
+  }
+}
+
+/*
+ * The addresses are resolved by the system resolver with QHostInfo,
+ * so /etc/hosts, nsswitch.conf and the address order of getaddrinfo()
+ * apply. The A and AAAA records are only queried for their TTL, which
+ * is used if the DNS returns the same addresses. Otherwise the entry
+ * expires after DEFAULT_TTL.
+ */
+void CResolver::startLookup(const QString &host)
+{
+  {
+    QMutexLocker lock(&m_Mutex);
+    SEntry &entry = m_Cache[host];
+    if (entry.m_Pending)
+    {
+      return;
+    }
+    entry.m_Pending = true;
+  }
+  QHostInfo::lookupHost(host, this, [this, host](const QHostInfo &info)
+                        {
+                          const QList<QHostAddress> addresses = info.addresses();
+                          if (addresses.isEmpty() || !QHostAddress(host).isNull())
+                          {
+                            // Not found or an address literal
+                            finishLookup(host, addresses, DEFAULT_TTL);
+                            return;
+                          }
+                          lookupTtl(host, addresses);
+                        });
+}
+
+/*
+ * Query A and AAAA records in parallel
+ */
+void CResolver::lookupTtl(const QString &host, const QList<QHostAddress> &addresses)
+{
+  struct SResult
+  {
+    QSet<QHostAddress> m_Addresses;
+    qint64 m_Ttl = -1;
+    int m_Pending = 2;
+  };
+  auto result = std::make_shared<SResult>();
+
+  auto done = [this, host, addresses, result](QDnsLookup *dns)
+  {
+    if (dns->error() == QDnsLookup::NoError)
+    {
+      for (const auto &record : dns->hostAddressRecords())
+      {
+        result->m_Addresses.insert(record.value());
+        if ((result->m_Ttl < 0) || (record.timeToLive() < result->m_Ttl))
+        {
+          result->m_Ttl = record.timeToLive();
+        }
+      }
+    }
+    dns->deleteLater();
+    if (--result->m_Pending > 0)
+    {
+      return;
+    }
+    QSet<QHostAddress> system(addresses.cbegin(), addresses.cend());
+    bool same = (result->m_Ttl >= 0) && (result->m_Addresses == system);
+    finishLookup(host, addresses, same ? result->m_Ttl : DEFAULT_TTL);
+  };
+
+  for (auto type : {QDnsLookup::AAAA, QDnsLookup::A})
+  {
+    auto *dns = new QDnsLookup(type, host, this);
+    connect(dns, &QDnsLookup::finished, this, [done, dns]()
+            { done(dns); });
+    dns->lookup();
+  }
+}
+
+void CResolver::finishLookup(const QString &host,
+                             const QList<QHostAddress> &addresses, qint64 ttl)
+{
+  {
+    QMutexLocker lock(&m_Mutex);
+    SEntry &entry = m_Cache[host];
+    entry.m_Pending = false;
+    if (!addresses.isEmpty())
+    {
+      entry.m_Addresses = addresses;
+      entry.m_Ttl = qMax<qint64>(ttl, MIN_TTL);
+      entry.m_Expires = QDeadlineTimer(entry.m_Ttl * 1000, Qt::CoarseTimer);
+    }
+    else if (!entry.m_Addresses.isEmpty())
+    {
+      // Keep the stale addresses and try again later
+      entry.m_Expires = QDeadlineTimer(MIN_TTL * 1000LL, Qt::CoarseTimer);
+    }
+    if (!entry.m_LastUsed.isValid())
+    {
+      entry.m_LastUsed.start();
+    }
+  }
+  qDebug() << "Resolved " << host << addresses << " TTL " << ttl;
+  schedulePrefetch();
+  emit resolved(host);
+}
+
+/*
+ * Start the prefetch timer for the next entry which expires. Entries
+ * which were not used for a long time are dropped.
+ */
+void CResolver::schedulePrefetch()
+{
+  QMutexLocker lock(&m_Mutex);
+  qint64 next = -1;
+  for (auto it = m_Cache.begin(); it != m_Cache.end();)
+  {
+    if (it->m_Pending)
+    {
+      ++it;
+      continue;
+    }
+    if (it->m_Addresses.isEmpty() || it->m_LastUsed.hasExpired(UNUSED_TIME))
+    {
+      it = m_Cache.erase(it);
+      continue;
+    }
+    if (it->m_Ttl < PREFETCH_MIN_TTL)
+    {
+      ++it;
+      continue;
+    }
+    qint64 remaining = qMax<qint64>(0, it->m_Expires.remainingTime() - PREFETCH_MARGIN);
+    if ((next < 0) || (remaining < next))
+    {
+      next = remaining;
+    }
+    ++it;
+  }
+  if (next < 0)
+  {
+    m_PrefetchTimer.stop();
+  }
+  else
+  {
+    m_PrefetchTimer.start(next);
+  }
+}
+
+void CResolver::prefetch()
+{
+  QStringList hosts;
+  {
+    QMutexLocker lock(&m_Mutex);
+    for (auto it = m_Cache.cbegin(); it != m_Cache.cend(); ++it)
+    {
+      if (!it->m_Pending && !it->m_Addresses.isEmpty() &&
+          (it->m_Ttl >= PREFETCH_MIN_TTL) &&
+          !it->m_LastUsed.hasExpired(UNUSED_TIME) &&
+          (it->m_Expires.remainingTime() <= PREFETCH_MARGIN))
+      {
+        hosts.append(it.key());
+      }
+    }
+  }
+  for (const QString &host : hosts)
+  {
+    startLookup(host);
+  }
+  schedulePrefetch();
+}
@@ -0,0 +1,101 @@
+/*
+ * CResolver.h
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Shared DNS cache for all mail servers.
+ */
+
+#ifndef CRESOLVER_H_
+#define CRESOLVER_H_
+
+#include <QAbstractSocket>
+#include <QDeadlineTimer>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QHostAddress>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QString>
+#include <QTimer>
+
+class CResolver : public QObject
+{
+  Q_OBJECT
+public:
+  /*
+   * The resolver lives in the main thread, all public methods are
+   * thread safe.
+   */
+  static CResolver &instance()
+  {
+    static CResolver instance;
+    return instance;
+  }
+  virtual ~CResolver() {}
+
+  /*
+   * Get the cached addresses of host. An expired entry is still returned
+   * and refreshed in the background. Returns false if the host is not
+   * cached, use requestLookup() and wait for resolved().
+   */
+  bool lookup(const QString &host, QList<QHostAddress> &addresses);
+
+  /*
+   * Start an asynchronous lookup of host
+   */
+  void requestLookup(const QString &host);
+
+  /*
+   * Address family which won the last connection race to host
+   */
+  QAbstractSocket::NetworkLayerProtocol preferredProtocol(const QString &host);
+  void setPreferredProtocol(const QString &host,
+                            QAbstractSocket::NetworkLayerProtocol protocol);
+
+signals:
+  void resolved(const QString &host);
+
+private slots:
+  void startLookup(const QString &host);
+  void prefetch();
+
+private:
+  CResolver();
+  CResolver(const CResolver &);
+  CResolver &operator=(const CResolver &);
+
+  struct SEntry
+  {
+    QList<QHostAddress> m_Addresses;
+    QDeadlineTimer m_Expires;
+    qint64 m_Ttl = 0;
+    QElapsedTimer m_LastUsed;
+    QAbstractSocket::NetworkLayerProtocol m_Preferred =
+        QAbstractSocket::IPv6Protocol;
+    bool m_Pending = false;
+  };
+
+  void lookupTtl(const QString &host, const QList<QHostAddress> &addresses);
+  void finishLookup(const QString &host, const QList<QHostAddress> &addresses,
+                    qint64 ttl);
+  void schedulePrefetch();
+
+  QMutex m_Mutex;
+  QHash<QString, SEntry> m_Cache;
+  QTimer m_PrefetchTimer;
+
+  inline const static int DEFAULT_TTL = 300;              // s, if the TTL is unknown
+  inline const static int MIN_TTL = 30;                   // s
+  inline const static int PREFETCH_MARGIN = 10 * 1000;    // ms before expiry
+  inline const static int UNUSED_TIME = 60 * 60 * 1000;   // ms, no prefetch
+  // Entries with a shorter TTL are refreshed on use only, to avoid
+  // frequent wakeups.
+  inline const static int PREFETCH_MIN_TTL = DEFAULT_TTL; // s
+};
+
+#endif /* CRESOLVER_H_ */
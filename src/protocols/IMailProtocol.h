@@ -15,6 +15,7 @@
 #include <QObject>
 #include <QString>
 #include <unistd.h>
+#include <atomic>
 
 class IMailProtocol : public QObject
 {
@@ -47,22 +48,124 @@ public:
   {
     return m_ConfigurationIdx;
   }
+
+  /*
+   * The mailbox is reached through the network. Local mailboxes are
+   * polled while the network is down and do not take a connection
+   * slot.
+   */
+  virtual bool needsNetwork(void) const
+  {
+    return true;
+  }
+
+  /*
+   * Host or path the mailbox is read from. Mailboxes with the same
+   * endpoint share the connection limit and the backoff of the host.
+   */
+  virtual QString endpoint(void) const
+  {
+    return m_Server;
+  }
+
+  /*
+   * The poll opens a connection to the endpoint which counts against
+   * the connection limits
+   */
+  virtual bool usesConnectionSlot(void) const
+  {
+    return needsNetwork();
+  }
   /*
    * Set a new password
    */
   virtual void updatePassword(const QString newpasswd) = 0;
 
+  /*
+   * Abort the running poll and all further polls. May be called from
+   * any thread.
+   */
+  void cancel()
+  {
+    m_Cancelled = true;
+    emit cancelRequested();
+  }
+
+  /*
+   * Abort only the running poll, e.g. a session which was open while
+   * the system was suspended. May be called from any thread.
+   */
+  void abortPoll()
+  {
+    m_Aborted = true;
+    emit cancelRequested();
+  }
+
+  bool isCancelled(void) const
+  {
+    return m_Cancelled || m_Aborted;
+  }
+
+  /*
+   * The server or the file system pushes the changes, e.g. a JMAP
+   * event stream or an inotify watch is open. May be called from any
+   * thread.
+   */
+  bool isPushActive(void) const
+  {
+    return m_PushActive;
+  }
+
+  /*
+   * Protocol bytes sent and received by all servers since start
+   */
+  static qint64 bytesTransferred(void)
+  {
+    return m_Transferred;
+  }
+
 public slots:
   virtual void doWork(void) = 0;
 
+  /*
+   * Stop the updates pushed by the server or the file system, e.g.
+   * while the mailbox is paused. The next poll starts them again.
+   */
+  virtual void stopPush(void) {}
+
+  /*
+   * Run one poll and signal its completion to the monitor. A cancelled
+   * or aborted poll is not reported as failure of the server.
+   */
+  void poll(void)
+  {
+    m_Aborted = false;
+    if (!m_Cancelled)
+    {
+      doWork();
+    }
+    emit pollFinished(m_ConfigurationIdx, m_Error.isEmpty() || isCancelled());
+  }
+
 signals:
-  void mailError(IMailProtocol *srv, const QString &errtxt);
+  void mailError(int configurationidx, const QString &errtxt);
   void resultReady(int configurationidx, int numUnread, int numRead);
+  void pollFinished(int configurationidx, bool success);
+  void cancelRequested(void);
 
 protected:
   QString m_Error;
   QString m_Server;
   int m_ConfigurationIdx = 0;
+  std::atomic_bool m_Cancelled = false;
+  std::atomic_bool m_Aborted = false;
+  std::atomic_bool m_PushActive = false;
+  inline static std::atomic<qint64> m_Transferred = 0;
+
+  static void addTransferred(qint64 bytes)
+  {
+    m_Transferred += bytes;
+  }
 
   /*
    * Set an error text
@@ -70,8 +173,11 @@ protected:
   void setError(const QString &err)
   {
     m_Error = err;
-    emit mailError(this, err);
-    sleep(1); /* Delay in case of errors */
+    if (isCancelled())
+    {
+      return; // Errors caused by the cancellation are not reported
+    }
+    emit mailError(m_ConfigurationIdx, err);
   }
 
   /*
@@ -0,0 +1,47 @@
+/*
+ * mailtypes.h
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Protocols, transports and authentication methods of a mailbox. No
+ * dependencies, so that the protocols and the configuration can use
+ * them without the application headers.
+ */
+
+#ifndef MAILTYPES_H_
+#define MAILTYPES_H_
+
+typedef enum
+{
+  PROTO_POP3,
+  PROTO_POP3S,
+  PROTO_IMAP4,
+  PROTO_IMAP3,
+  PROTO_IMAPS,
+  PROTO_MAILDIR,
+  PROTO_MBOX,
+  PROTO_JMAP,
+  PROTO_NNTP,
+  PROTO_NNTPS,
+  PROTO_LAST
+} PROTOCOLS;
+
+typedef enum
+{
+  TRANSPORT_TCP,     // TCP with optional TLS
+  TRANSPORT_COMMAND, // stdin/stdout of a command, e.g. ssh host imapd
+  TRANSPORT_UNIX,    // Unix domain socket
+  TRANSPORT_LAST
+} TRANSPORTS;
+
+typedef enum
+{
+  AUTH_PASSWORD, // Password, SCRAM or plaintext
+  AUTH_OAUTH2,   // OAuth 2.0 bearer token, the password is the refresh token
+  AUTH_LAST
+} AUTHS;
+
+#endif /* MAILTYPES_H_ */
@@ -10,6 +10,19 @@
  */
 
 #include "CConfig.h"
+#include "system/CStartupTimeline.h"
+
+#include <QDateTime>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <QTimer>
 
 CConfig::CConfig() : m_KeyChain(this)
 {
@@ -18,11 +31,45 @@ CConfig::CConfig() : m_KeyChain(this)
   connect(&m_KeyChain, &CKeyChain::keyRestored, this, &CConfig::keyRestored);
   connect(&m_KeyChain, &CKeyChain::keyStored, this, &CConfig::keyStored);
   connect(&m_KeyChain, &CKeyChain::error, this, &CConfig::keyError);
+  connect(&m_KeyChain, &CKeyChain::idle, this, []()
+          { CStartupTimeline::mark("Passwords restored"); });
+  m_RestoreTimer.setSingleShot(true);
+  m_RestoreTimer.setInterval(0);
+  connect(&m_RestoreTimer, &QTimer::timeout, this, &CConfig::applyRestoredPasswords);
+  load();
+}
+
+QString CConfig::fileName() const
+{
+  QSettings settings;
+  return settings.fileName();
+}
+
+/*
+ * Read the settings file. The passwords and client secrets of known
+ * mailboxes are kept, only those of new mailboxes and of mailboxes
+ * whose keychain entries were written by another instance, e.g. by an
+ * import, are read from the keychain. A client secret in the settings
+ * file of an older version is moved to the keychain.
+ */
+void CConfig::load()
+{
+  QSettings settings;
+  MailboxSnapshot current = snapshot();
 
   qInfo() << "Config file " << settings.fileName();
 
   settings.beginGroup(GROUP_MAIN);
   m_PollTime = settings.value(KEY_POLL, 360).toInt();
+  m_TimeoutMin = settings.value(KEY_TIMEOUT_MIN, 1).toInt();
+  m_TimeoutMax = settings.value(KEY_TIMEOUT_MAX, 30).toInt();
+  m_MaxConnections = settings.value(KEY_MAX_CONNECTIONS, 8).toInt();
+  m_MaxHostConnections = settings.value(KEY_MAX_HOST_CONNECTIONS, 2).toInt();
+  m_BatteryPolicy = settings.value(KEY_BATTERY_POLICY, true).toBool();
+  m_BatteryFactor = settings.value(KEY_BATTERY_FACTOR, 3).toInt();
+  m_IdlePolicy = settings.value(KEY_IDLE_POLICY, true).toBool();
+  m_IdleTime = settings.value(KEY_IDLE_TIME, 30).toInt();
+  m_StaleTime = settings.value(KEY_STALE_TIME, 60).toInt();
   m_DockInPanel = settings.value(KEY_DOCK, false).toBool();
   m_UseSessionManangement = settings.value(KEY_USE_SESSION, false).toBool();
 
@@ -35,35 +82,80 @@ CConfig::CConfig() : m_KeyChain(this)
 
   settings.beginGroup(GROUP_MAILBOX);
   int servers = settings.beginReadArray(ARRAY_MAILBOX);
-  if (servers < 1)
+  m_isConfigured = servers > 0;
+  if (!m_isConfigured)
   {
     qWarning("Config Server Array empty");
   }
-  else
-  {
-    m_isConfigured = true;
-  }
+  auto snapshot = std::make_shared<MAILBOX_SNAPSHOT_T>();
+  snapshot->m_MailboxConfig.reserve(servers);
+  QSet<int> plainSecrets;
   for (int j = 0; j < servers; j++)
   {
+    MAILBOX_CONFIG_T cfg;
     settings.setArrayIndex(j);
-    const QString &mailboxName = settings.value(KEY_MAILBOX_NAME, QString("")).toString();
-    int protocol = settings.value(KEY_PROTOCOL, QVariant((int)PROTO_POP3)).toInt();
-    const QString &user = settings.value(KEY_USER_NAME, QString("")).toString();
-    const QString &server = settings.value(KEY_SERVER, QString("")).toString();
-    const QString &imap_mailbox = settings.value(KEY_IMAP_MAILBOX, QString("")).toString();
-    int port = settings.value(KEY_PORT, 0).toInt();
-    qInfo() << "Reading Mailbox" << mailboxName << " " << user;
-    addConfig(mailboxName, (PROTOCOLS)protocol, user, server,
-              port, imap_mailbox);
-    getPassword(mailboxName);
+    cfg.m_MailboxName = settings.value(KEY_MAILBOX_NAME, QString("")).toString();
+    cfg.m_Protocol = (PROTOCOLS)settings.value(KEY_PROTOCOL, QVariant((int)PROTO_POP3)).toInt();
+    cfg.m_User = settings.value(KEY_USER_NAME, QString("")).toString();
+    cfg.m_Server = settings.value(KEY_SERVER, QString("")).toString();
+    cfg.m_ImapMailBox = settings.value(KEY_IMAP_MAILBOX, QString("")).toString();
+    cfg.m_Port = settings.value(KEY_PORT, 0).toInt();
+    cfg.m_Transport = (TRANSPORTS)settings.value(KEY_TRANSPORT, QVariant((int)TRANSPORT_TCP)).toInt();
+    cfg.m_Tunnel = settings.value(KEY_TUNNEL, QString("")).toString();
+    cfg.m_Auth = (AUTHS)settings.value(KEY_AUTH, QVariant((int)AUTH_PASSWORD)).toInt();
+    cfg.m_TokenUrl = settings.value(KEY_TOKEN_URL, QString("")).toString();
+    cfg.m_ClientId = settings.value(KEY_CLIENT_ID, QString("")).toString();
+    cfg.m_ClientSecret = settings.value(KEY_CLIENT_SECRET, QString("")).toString();
+    cfg.m_KeyStamp = settings.value(KEY_KEY_STAMP, 0).toLongLong();
+    if (cfg.m_MailboxName.isEmpty())
+    {
+      qDebug() << "Skip empty mailbox name";
+      continue;
+    }
+    qInfo() << "Reading Mailbox" << cfg.m_MailboxName << " " << cfg.m_User;
+    int idx = current->m_Index.value(cfg.m_MailboxName, -1);
+    bool plain = !cfg.m_ClientSecret.isEmpty();
+    if (idx != -1)
+    {
+      // Until the keychain answers
+      cfg.m_Password = current->m_MailboxConfig.at(idx).m_Password;
+      if (!plain)
+      {
+        cfg.m_ClientSecret = current->m_MailboxConfig.at(idx).m_ClientSecret;
+      }
+    }
+    if ((idx == -1) || (current->m_MailboxConfig.at(idx).m_KeyStamp != cfg.m_KeyStamp))
+    {
+      getPassword(cfg.m_MailboxName);
+      if (!plain && (cfg.m_Auth == AUTH_OAUTH2))
+      {
+        m_KeyChain.readKey(secretKey(cfg.m_MailboxName));
+      }
+    }
+    int pos = insertMailbox(*snapshot, cfg);
+    if (plain)
+    {
+      storePassword(secretKey(cfg.m_MailboxName), cfg.m_ClientSecret);
+      plainSecrets.insert(pos);
+    }
   }
   settings.endArray();
   settings.endGroup();
+  m_SavedSize = servers;
+  m_Dirty = plainSecrets; // Written without the secret on the next save
+  if (snapshot->m_MailboxConfig.size() != servers)
+  {
+    // Empty or duplicate names were dropped, the entries moved
+    reindex(*snapshot, 0);
+  }
+  publish(snapshot);
 }
 
-void CConfig::keyError(const QString &errorText)
+void CConfig::keyError(const QString &key, const QString &errorText)
 {
-  qWarning() << "Error getting password " << errorText;
+  qWarning() << "Keychain error " << key << ": " << errorText;
+  // Unknown state, write again on the next save
+  m_KeyChainValues.remove(key);
 }
 
 void CConfig::keyStored(const QString &key)
@@ -74,32 +166,130 @@ void CConfig::keyStored(const QString &key)
 void CConfig::keyRestored(const QString &key, const QString &value)
 {
   qDebug() << "Restore Passwd " << key;
-  int idx = findMailbox(key);
+  m_KeyChainValues.insert(key, value);
+  m_RestoredPasswords.insert(key, value);
+  m_RestoreTimer.start();
+}
+
+/*
+ * The keychain answers the reads at start one by one, all passwords
+ * read so far are published in one snapshot
+ */
+void CConfig::applyRestoredPasswords()
+{
+  auto snapshot = edit();
+  QHash<QString, QString> changed;
+  bool secrets = false;
+  for (auto it = m_RestoredPasswords.cbegin(); it != m_RestoredPasswords.cend(); ++it)
+  {
+    bool secret = it.key().endsWith(SECRET_SUFFIX);
+    const QString mailboxname = secret ? it.key().chopped(SECRET_SUFFIX.size()) : it.key();
+    int idx = snapshot->m_Index.value(mailboxname, -1);
+    if (idx == -1)
+    {
+      qInfo() << "keyRestored " << it.key() << "not found";
+      continue;
+    }
+    MAILBOX_CONFIG_T &cfg = snapshot->m_MailboxConfig[idx];
+    if (m_Updating)
+    {
+      m_UpdatePasswords.insert(it.key(), it.value());
+    }
+    if (secret)
+    {
+      secrets = secrets || (cfg.m_ClientSecret != it.value());
+      cfg.m_ClientSecret = it.value();
+      continue;
+    }
+    if (cfg.m_Password != it.value())
+    {
+      cfg.m_Password = it.value();
+      changed.insert(it.key(), it.value());
+    }
+  }
+  m_RestoredPasswords.clear();
+  if (changed.isEmpty() && !secrets)
+  {
+    return;
+  }
+  publish(snapshot);
+  for (auto it = changed.cbegin(); it != changed.cend(); ++it)
+  {
+    updatePassword(it.key(), it.value());
+  }
+  if (secrets)
+  {
+    emit secretsRestored();
+  }
+}
+
+void CConfig::applyPassword(const QString &mailboxname, const QString &passwd)
+{
+  MailboxSnapshot config = snapshot();
+  int idx = config->m_Index.value(mailboxname, -1);
   if (idx == -1)
   {
-    qInfo() << "keyRestored " << key << "not found";
+    qInfo() << "applyPassword " << mailboxname << "not found";
     return;
   }
-  m_CurrentConfig.m_MailboxConfig[idx].m_Password = value;
-  updatePassword(key, value);
+  if (config->m_MailboxConfig.at(idx).m_Password == passwd)
+  {
+    return;
+  }
+  auto snapshot = edit();
+  snapshot->m_MailboxConfig[idx].m_Password = passwd;
+  publish(snapshot);
+  updatePassword(mailboxname, passwd);
 }
 
-QIcon CConfig::getIconInfo(QSettings &settings, const QString &key,
-                           const QString &name, const QIcon &fallback,
-                           QString &iconname)
+/*
+ * Write the password, or the client secret under its secretKey(), only
+ * if the keychain does not have it already. An empty value is not
+ * written before the keychain was read. true if it is written.
+ */
+bool CConfig::storePassword(const QString &mailboxname, const QString &passwd)
 {
-  iconname.clear();
-  QString file = settings.value(key, QString("")).toString();
-  qDebug() << "getIconInfo " << key << " " << file;
-  if (!file.isEmpty())
+  auto stored = m_KeyChainValues.constFind(mailboxname);
+  if (stored == m_KeyChainValues.constEnd())
   {
-    QPixmap p;
-    if (p.load(file))
+    if (passwd.isEmpty())
     {
-      iconname = file;
-      return QIcon(p);
+      return false;
     }
   }
+  else if (stored.value() == passwd)
+  {
+    return false;
+  }
+  m_KeyChainValues.insert(mailboxname, passwd);
+  m_KeyChain.writeKey(mailboxname, passwd);
+  return true;
+}
+
+void CConfig::setPassword(const QString &mailboxname, const QString &passwd)
+{
+  m_RestoredPasswords.remove(mailboxname);
+  if (m_Updating)
+  {
+    m_UpdatePasswords.insert(mailboxname, passwd);
+  }
+  storePassword(mailboxname, passwd);
+  applyPassword(mailboxname, passwd);
+}
+
+/*
+ * A QIcon of a file or theme is only decoded when it is painted
+ */
+QIcon CConfig::getIconInfo(const QString &file, const QString &name,
+                           const QIcon &fallback, QString &iconname)
+{
+  iconname.clear();
+  qDebug() << "getIconInfo " << name << " " << file;
+  if (!file.isEmpty() && QFileInfo(file).isReadable())
+  {
+    iconname = file;
+    return QIcon(file);
+  }
 
   auto ic = QIcon::fromTheme(name);
   if (ic.isNull())
@@ -112,16 +302,30 @@ QIcon CConfig::getIconInfo(QSettings &settings, const QString &key,
   return ic;
 }
 
+/*
+ * Only the file name is read at start, the icon is loaded on first use
+ */
 void CConfig::LoadIcon(QSettings &settings, const IconType &type)
 {
-  const QIcon fbicon = QIcon(FALLBACK_ICON);
-  assert(!fbicon.isNull());
-  QString iconname;
   int tp = static_cast<int>(type);
-  auto ic = getIconInfo(settings, IC_KEYS[tp], DEFAULT_THEME_ICONS[tp],
-                        fbicon, iconname);
-  setIcon(type, ic);
-  setIconName(type, iconname);
+  setIconName(type, settings.value(IC_KEYS[tp], QString("")).toString());
+  m_CurrentConfig.m_IcLoaded[tp] = false;
+}
+
+QIcon CConfig::getIcon(const IconType &type)
+{
+  int tp = static_cast<int>(type);
+  if (!m_CurrentConfig.m_IcLoaded[tp])
+  {
+    const QIcon fbicon = QIcon(FALLBACK_ICON);
+    assert(!fbicon.isNull());
+    QString iconname;
+    auto ic = getIconInfo(getIconName(type), DEFAULT_THEME_ICONS[tp], fbicon,
+                          iconname);
+    setIcon(type, ic);
+    setIconName(type, iconname);
+  }
+  return m_CurrentConfig.m_IcType[tp];
 }
 
 QIcon CConfig::ResetIcon(const IconType &type)
@@ -135,65 +339,118 @@ QIcon CConfig::ResetIcon(const IconType &type)
   return m_CurrentConfig.m_IcType[static_cast<int>(type)];
 }
 
-int CConfig::findMailbox(const QString &mailboxname) const
+/*
+ * Writable copy of the current snapshot. The entries are shared with
+ * the current snapshot until they are changed.
+ */
+std::shared_ptr<MAILBOX_SNAPSHOT_T> CConfig::edit() const
+{
+  return std::make_shared<MAILBOX_SNAPSHOT_T>(*snapshot());
+}
+
+/*
+ * Readers holding the old snapshot keep it until they release it
+ */
+void CConfig::publish(MailboxSnapshot snapshot)
+{
+  std::atomic_store(&m_Snapshot, std::move(snapshot));
+}
+
+int CConfig::insertMailbox(MAILBOX_SNAPSHOT_T &snapshot, const MAILBOX_CONFIG_T &cfg)
 {
-  for (int i = 0; i < m_CurrentConfig.m_MailboxConfig.size(); ++i)
+  int idx = snapshot.m_Index.value(cfg.m_MailboxName, -1);
+  if (idx != -1)
   {
-    if (m_CurrentConfig.m_MailboxConfig.at(i).m_MailboxName == mailboxname)
-    {
-      return i;
-    }
+    snapshot.m_MailboxConfig[idx] = cfg;
   }
-  return -1;
+  else
+  {
+    idx = snapshot.m_MailboxConfig.size();
+    snapshot.m_Index.insert(cfg.m_MailboxName, idx);
+    snapshot.m_MailboxConfig.append(cfg);
+  }
+  m_Dirty.insert(idx);
+  m_isConfigured = true;
+  return idx;
 }
 
-void CConfig::addConfig(const QString &mailboxname, PROTOCOLS protocol,
-                        const QString &user, const QString &server, uint16_t port,
-                        const QString &imap_mailbox)
+/*
+ * Update the index of the entries from position from on, they are
+ * written again on the next save
+ */
+void CConfig::reindex(MAILBOX_SNAPSHOT_T &snapshot, int from)
 {
-  MAILBOX_CONFIG_T config;
+  for (int i = from; i < snapshot.m_MailboxConfig.size(); ++i)
+  {
+    snapshot.m_Index.insert(snapshot.m_MailboxConfig.at(i).m_MailboxName, i);
+    m_Dirty.insert(i);
+  }
+}
 
+void CConfig::addConfig(const MAILBOX_CONFIG_T &config)
+{
+  const QString &mailboxname = config.m_MailboxName;
   if (mailboxname.size() == 0)
   {
     qDebug() << "addConfig empty mailbox name";
     return;
   }
-  qDebug() << "addConfig" << mailboxname << user;
-  config.m_MailboxName = mailboxname;
-  config.m_Protocol = protocol;
-  config.m_User = user;
-  config.m_Server = server;
-  config.m_Port = port;
-  config.m_ImapMailBox = imap_mailbox;
+  qDebug() << "addConfig" << mailboxname << config.m_User;
 
-  int idx = findMailbox(mailboxname);
-  if (idx != -1)
+  auto snapshot = edit();
+  int idx = snapshot->m_Index.value(mailboxname, -1);
+  bool changed = (idx != -1) &&
+                 (snapshot->m_MailboxConfig.at(idx).m_Password != config.m_Password);
+  m_RestoredPasswords.remove(mailboxname);
+  m_RestoredPasswords.remove(secretKey(mailboxname));
+  if (m_Updating)
   {
-    m_CurrentConfig.m_MailboxConfig[idx] = config;
+    m_UpdatePasswords.insert(mailboxname, config.m_Password);
+    m_UpdatePasswords.insert(secretKey(mailboxname), config.m_ClientSecret);
   }
-  else
+  MAILBOX_CONFIG_T stamped = config;
+  stamped.m_KeyStamp = (idx != -1) ? snapshot->m_MailboxConfig.at(idx).m_KeyStamp : 0;
+  bool written = storePassword(mailboxname, config.m_Password);
+  if (storePassword(secretKey(mailboxname), config.m_ClientSecret) || written)
   {
-    m_CurrentConfig.m_MailboxConfig.append(config);
+    stamped.m_KeyStamp = QDateTime::currentMSecsSinceEpoch();
+  }
+  insertMailbox(*snapshot, stamped);
+  publish(snapshot);
+  if (changed)
+  {
+    emit updatePassword(mailboxname, config.m_Password);
   }
-  m_isConfigured = true;
 }
 
 void CConfig::deleteConfig(const QString &mailboxname)
 {
-  int idx = findMailbox(mailboxname);
+  auto snapshot = edit();
+  int idx = snapshot->m_Index.value(mailboxname, -1);
   if (idx != -1)
   {
     m_KeyChain.deleteKey(mailboxname);
-    m_CurrentConfig.m_MailboxConfig.remove(idx);
+    m_KeyChainValues.remove(mailboxname);
+    const QString secret = secretKey(mailboxname);
+    if (m_KeyChainValues.remove(secret) || !snapshot->m_MailboxConfig.at(idx).m_ClientSecret.isEmpty())
+    {
+      m_KeyChain.deleteKey(secret);
+    }
+    snapshot->m_MailboxConfig.remove(idx);
+    snapshot->m_Index.remove(mailboxname);
+    reindex(*snapshot, idx);
+    publish(snapshot);
   }
 }
 
 void CConfig::getMailboxes(QVector<QString> &mailboxes) const
 {
+  MailboxSnapshot config = snapshot();
   mailboxes.clear();
-  for (int i = 0; i < m_CurrentConfig.m_MailboxConfig.size(); ++i)
+  mailboxes.reserve(config->m_MailboxConfig.size());
+  for (const MAILBOX_CONFIG_T &cfg : config->m_MailboxConfig)
   {
-    mailboxes.append(m_CurrentConfig.m_MailboxConfig[i].m_MailboxName);
+    mailboxes.append(cfg.m_MailboxName);
   }
 }
 
@@ -201,13 +458,14 @@ void CConfig::getConfig(const QString &mailboxname, PROTOCOLS &protocol,
                         QString &user, QString &password, QString &server,
                         uint16_t &port, QString &imap_mailbox) const
 {
-  int idx = findMailbox(mailboxname);
+  MailboxSnapshot config = snapshot();
+  int idx = config->m_Index.value(mailboxname, -1);
   if (idx == -1)
   {
     qInfo("getConfig %s not found", qUtf8Printable(mailboxname));
     return;
   }
-  const MAILBOX_CONFIG_T &cfg = m_CurrentConfig.m_MailboxConfig.at(idx);
+  const MAILBOX_CONFIG_T &cfg = config->m_MailboxConfig.at(idx);
   protocol = cfg.m_Protocol;
   user = cfg.m_User;
   password = cfg.m_Password;
@@ -216,14 +474,110 @@ void CConfig::getConfig(const QString &mailboxname, PROTOCOLS &protocol,
   imap_mailbox = cfg.m_ImapMailBox;
 }
 
+void CConfig::getTransport(const QString &mailboxname, TRANSPORTS &transport,
+                           QString &tunnel) const
+{
+  MailboxSnapshot config = snapshot();
+  int idx = config->m_Index.value(mailboxname, -1);
+  if (idx == -1)
+  {
+    transport = TRANSPORT_TCP;
+    tunnel.clear();
+    return;
+  }
+  const MAILBOX_CONFIG_T &cfg = config->m_MailboxConfig.at(idx);
+  transport = cfg.m_Transport;
+  tunnel = cfg.m_Tunnel;
+}
+
+void CConfig::getOAuth(const QString &mailboxname, AUTHS &auth,
+                       QString &tokenurl, QString &clientid,
+                       QString &secret) const
+{
+  MailboxSnapshot config = snapshot();
+  int idx = config->m_Index.value(mailboxname, -1);
+  if (idx == -1)
+  {
+    auth = AUTH_PASSWORD;
+    tokenurl.clear();
+    clientid.clear();
+    secret.clear();
+    return;
+  }
+  const MAILBOX_CONFIG_T &cfg = config->m_MailboxConfig.at(idx);
+  auth = cfg.m_Auth;
+  tokenurl = cfg.m_TokenUrl;
+  clientid = cfg.m_ClientId;
+  secret = cfg.m_ClientSecret;
+}
+
+/*
+ * Only the snapshot pointer and the icon file names are kept, the
+ * icons of a changed name are loaded again on abort
+ */
 void CConfig::beginUpdate()
 {
-  m_OldConfig = m_CurrentConfig;
+  m_Updating = true;
+  m_OldSnapshot = snapshot();
+  m_UpdatePasswords.clear();
+  for (int i = 0; i <= static_cast<int>(IconType::icLast); ++i)
+  {
+    m_OldIconNames[i] = m_CurrentConfig.m_IcTypeFileName[i];
+  }
+  m_OldDirty = m_Dirty;
 }
 
 void CConfig::abortUpdate()
 {
-  m_CurrentConfig = m_OldConfig;
+  m_Updating = false;
+  if (m_OldSnapshot)
+  {
+    // The keychain keeps the passwords and secrets restored, rotated
+    // or saved while the dialog was open
+    auto snapshot = std::make_shared<MAILBOX_SNAPSHOT_T>(*m_OldSnapshot);
+    QHash<QString, QString> changed;
+    for (auto it = m_UpdatePasswords.cbegin(); it != m_UpdatePasswords.cend(); ++it)
+    {
+      bool secret = it.key().endsWith(SECRET_SUFFIX);
+      int idx = snapshot->m_Index.value(secret ? it.key().chopped(SECRET_SUFFIX.size()) : it.key(), -1);
+      if (idx == -1)
+      {
+        continue;
+      }
+      MAILBOX_CONFIG_T &cfg = snapshot->m_MailboxConfig[idx];
+      if (secret)
+      {
+        cfg.m_ClientSecret = it.value();
+      }
+      else if (cfg.m_Password != it.value())
+      {
+        cfg.m_Password = it.value();
+        changed.insert(it.key(), it.value());
+      }
+    }
+    // Write the entries of mailboxes deleted in the dialog again
+    for (const MAILBOX_CONFIG_T &cfg : std::as_const(snapshot->m_MailboxConfig))
+    {
+      storePassword(cfg.m_MailboxName, cfg.m_Password);
+      storePassword(secretKey(cfg.m_MailboxName), cfg.m_ClientSecret);
+    }
+    publish(snapshot);
+    m_OldSnapshot.reset();
+    for (auto it = changed.cbegin(); it != changed.cend(); ++it)
+    {
+      emit updatePassword(it.key(), it.value());
+    }
+  }
+  m_UpdatePasswords.clear();
+  for (int i = 0; i <= static_cast<int>(IconType::icLast); ++i)
+  {
+    if (m_CurrentConfig.m_IcTypeFileName[i] != m_OldIconNames[i])
+    {
+      m_CurrentConfig.m_IcTypeFileName[i] = m_OldIconNames[i];
+      m_CurrentConfig.m_IcLoaded[i] = false;
+    }
+  }
+  m_Dirty = m_OldDirty;
 }
 
 void CConfig::saveIconName(QSettings &settings, const IconType &type,
@@ -243,9 +597,19 @@ void CConfig::saveIconName(QSettings &settings, const IconType &type,
 void CConfig::save()
 {
   QSettings settings;
+  m_Updating = false;
 
   settings.beginGroup(GROUP_MAIN);
   settings.setValue(KEY_POLL, m_PollTime);
+  settings.setValue(KEY_TIMEOUT_MIN, m_TimeoutMin);
+  settings.setValue(KEY_TIMEOUT_MAX, m_TimeoutMax);
+  settings.setValue(KEY_MAX_CONNECTIONS, m_MaxConnections);
+  settings.setValue(KEY_MAX_HOST_CONNECTIONS, m_MaxHostConnections);
+  settings.setValue(KEY_BATTERY_POLICY, m_BatteryPolicy);
+  settings.setValue(KEY_BATTERY_FACTOR, m_BatteryFactor);
+  settings.setValue(KEY_IDLE_POLICY, m_IdlePolicy);
+  settings.setValue(KEY_IDLE_TIME, m_IdleTime);
+  settings.setValue(KEY_STALE_TIME, m_StaleTime);
   settings.setValue(KEY_DOCK, m_DockInPanel);
   settings.setValue(KEY_USE_SESSION, m_UseSessionManangement);
 
@@ -257,27 +621,57 @@ void CConfig::save()
 
   settings.endGroup();
 
+  /*
+   * Only the changed entries of the array are written, entries behind
+   * the end of a shrunk array are removed
+   */
+  QElapsedTimer timer;
+  timer.start();
+  MailboxSnapshot config = snapshot();
+  int size = config->m_MailboxConfig.size();
   settings.beginGroup(GROUP_MAILBOX);
-  settings.beginWriteArray(ARRAY_MAILBOX);
-  for (int i = 0; i < m_CurrentConfig.m_MailboxConfig.size(); ++i)
+  settings.beginWriteArray(ARRAY_MAILBOX, size);
+  for (int i : std::as_const(m_Dirty))
+  {
+    if (i < size)
+    {
+      settings.setArrayIndex(i);
+      writeMailbox(settings, config->m_MailboxConfig.at(i));
+    }
+  }
+  for (int i = size; i < m_SavedSize; ++i)
   {
-    const QString &mbName = m_CurrentConfig.m_MailboxConfig.at(i).m_MailboxName;
     settings.setArrayIndex(i);
-    settings.setValue(KEY_MAILBOX_NAME, mbName);
-    settings.setValue(KEY_PROTOCOL,
-                      m_CurrentConfig.m_MailboxConfig.at(i).m_Protocol);
-    settings.setValue(KEY_USER_NAME,
-                      m_CurrentConfig.m_MailboxConfig.at(i).m_User);
-    settings.setValue(KEY_SERVER,
-                      m_CurrentConfig.m_MailboxConfig.at(i).m_Server);
-    settings.setValue(KEY_PORT,
-                      m_CurrentConfig.m_MailboxConfig.at(i).m_Port);
-    settings.setValue(KEY_IMAP_MAILBOX,
-                      m_CurrentConfig.m_MailboxConfig.at(i).m_ImapMailBox);
-    m_KeyChain.writeKey(mbName, m_CurrentConfig.m_MailboxConfig.at(i).m_Password);
+    settings.remove("");
   }
   settings.endArray();
   settings.endGroup();
+  for (const MAILBOX_CONFIG_T &cfg : config->m_MailboxConfig)
+  {
+    storePassword(cfg.m_MailboxName, cfg.m_Password);
+    storePassword(secretKey(cfg.m_MailboxName), cfg.m_ClientSecret);
+  }
+  qDebug() << "Saved " << m_Dirty.size() << " of " << size << " mailboxes in "
+           << timer.elapsed() << " ms";
+  m_SavedSize = size;
+  m_Dirty.clear();
+}
+
+void CConfig::writeMailbox(QSettings &settings, const MAILBOX_CONFIG_T &cfg)
+{
+  settings.setValue(KEY_MAILBOX_NAME, cfg.m_MailboxName);
+  settings.setValue(KEY_PROTOCOL, cfg.m_Protocol);
+  settings.setValue(KEY_USER_NAME, cfg.m_User);
+  settings.setValue(KEY_SERVER, cfg.m_Server);
+  settings.setValue(KEY_PORT, cfg.m_Port);
+  settings.setValue(KEY_IMAP_MAILBOX, cfg.m_ImapMailBox);
+  settings.setValue(KEY_TRANSPORT, cfg.m_Transport);
+  settings.setValue(KEY_TUNNEL, cfg.m_Tunnel);
+  settings.setValue(KEY_AUTH, cfg.m_Auth);
+  settings.setValue(KEY_TOKEN_URL, cfg.m_TokenUrl);
+  settings.setValue(KEY_CLIENT_ID, cfg.m_ClientId);
+  settings.remove(KEY_CLIENT_SECRET); // In the keychain
+  settings.setValue(KEY_KEY_STAMP, cfg.m_KeyStamp);
 }
 
 void CConfig::saveIconDir(const QString &dir)
@@ -306,3 +700,413 @@ void CConfig::saveIcon(QIcon &icon, QString &savename, const QString &name)
     icon = QIcon(p);
   }
 }
+
+/*
+ * Split CSV data into records, fields may be quoted with "" for a
+ * quote inside (RFC 4180)
+ */
+static bool parseCsv(const QString &data, QList<QStringList> &records)
+{
+  QStringList record;
+  QString field;
+  bool quoted = false;
+  bool wasQuoted = false;
+  records.clear();
+  for (qsizetype i = 0; i < data.size(); ++i)
+  {
+    QChar c = data.at(i);
+    if (quoted)
+    {
+      if (c != '"')
+      {
+        field += c;
+      }
+      else if ((i + 1 < data.size()) && (data.at(i + 1) == '"'))
+      {
+        field += c;
+        ++i;
+      }
+      else
+      {
+        quoted = false;
+      }
+    }
+    else if (c == '"')
+    {
+      if (!field.isEmpty() || wasQuoted)
+      {
+        return false;
+      }
+      quoted = true;
+      wasQuoted = true;
+    }
+    else if (c == ',')
+    {
+      record.append(field);
+      field.clear();
+      wasQuoted = false;
+    }
+    else if ((c == '\n') || (c == '\r'))
+    {
+      if ((c == '\r') && (i + 1 < data.size()) && (data.at(i + 1) == '\n'))
+      {
+        ++i;
+      }
+      record.append(field);
+      field.clear();
+      wasQuoted = false;
+      if ((record.size() > 1) || !record.first().isEmpty())
+      {
+        records.append(record);
+      }
+      record.clear();
+    }
+    else
+    {
+      field += c;
+    }
+  }
+  if (quoted)
+  {
+    return false;
+  }
+  if (!field.isEmpty() || !record.isEmpty())
+  {
+    record.append(field);
+    records.append(record);
+  }
+  return true;
+}
+
+static QString quoteCsv(const QString &field)
+{
+  if (!field.contains(',') && !field.contains('"') && !field.contains('\n') &&
+      !field.contains('\r'))
+  {
+    return field;
+  }
+  QString quoted = field;
+  quoted.replace("\"", "\"\"");
+  return "\"" + quoted + "\"";
+}
+
+static int nameIndex(const QString *names, int count, const QString &name)
+{
+  for (int i = 0; i < count; ++i)
+  {
+    if (names[i].compare(name, Qt::CaseInsensitive) == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool CConfig::parseAccount(const QHash<QString, QString> &record,
+                           MAILBOX_CONFIG_T &cfg, QString &error) const
+{
+  cfg.m_MailboxName = record.value(KEY_MAILBOX_NAME).trimmed();
+  if (cfg.m_MailboxName.isEmpty())
+  {
+    error = "no " + KEY_MAILBOX_NAME;
+    return false;
+  }
+  const QString protocol = record.value(KEY_PROTOCOL).trimmed();
+  int proto = nameIndex(PROTOCOL_NAMES, PROTO_LAST, protocol);
+  if (proto < 0)
+  {
+    error = "unknown protocol \"" + protocol + "\"";
+    return false;
+  }
+  cfg.m_Protocol = (PROTOCOLS)proto;
+  const QString transport = record.value(KEY_TRANSPORT).trimmed();
+  int trans = transport.isEmpty() ? TRANSPORT_TCP
+                                  : nameIndex(TRANSPORT_NAMES, TRANSPORT_LAST, transport);
+  if (trans < 0)
+  {
+    error = "unknown transport \"" + transport + "\"";
+    return false;
+  }
+  cfg.m_Transport = (TRANSPORTS)trans;
+  const QString auth = record.value(KEY_AUTH).trimmed();
+  int au = auth.isEmpty() ? AUTH_PASSWORD : nameIndex(AUTH_NAMES, AUTH_LAST, auth);
+  if (au < 0)
+  {
+    error = "unknown authentication \"" + auth + "\"";
+    return false;
+  }
+  cfg.m_Auth = (AUTHS)au;
+  cfg.m_User = record.value(KEY_USER_NAME);
+  cfg.m_Password = record.value(KEY_PASSWORD);
+  cfg.m_Server = record.value(KEY_SERVER).trimmed();
+  cfg.m_ImapMailBox = record.value(KEY_IMAP_MAILBOX);
+  cfg.m_Tunnel = record.value(KEY_TUNNEL).trimmed();
+  cfg.m_TokenUrl = record.value(KEY_TOKEN_URL).trimmed();
+  cfg.m_ClientId = record.value(KEY_CLIENT_ID).trimmed();
+  cfg.m_ClientSecret = record.value(KEY_CLIENT_SECRET);
+
+  bool local = (proto == PROTO_MAILDIR) || (proto == PROTO_MBOX);
+  bool imap = (proto >= PROTO_IMAP4) && (proto <= PROTO_IMAPS);
+  bool tunnel = trans != TRANSPORT_TCP;
+  cfg.m_Port = 0;
+  if (tunnel)
+  {
+    // The tunnel is preauthenticated, IMAP only
+    if (!imap)
+    {
+      error = "tunnels are only supported for IMAP";
+      return false;
+    }
+    if (cfg.m_Tunnel.isEmpty())
+    {
+      error = "no " + KEY_TUNNEL;
+      return false;
+    }
+  }
+  else if (cfg.m_Server.isEmpty())
+  {
+    error = local ? "no path" : "no " + KEY_SERVER;
+    return false;
+  }
+  else if (!local)
+  {
+    bool ok;
+    int port = record.value(KEY_PORT).trimmed().toInt(&ok);
+    if (!ok || (port <= 0) || (port > 65535))
+    {
+      error = "invalid port \"" + record.value(KEY_PORT) + "\"";
+      return false;
+    }
+    cfg.m_Port = port;
+  }
+  if (au == AUTH_OAUTH2)
+  {
+    // OAuth2 is supported by IMAP and POP3 over TCP
+    if ((proto > PROTO_IMAPS) || tunnel)
+    {
+      error = "OAuth2 is only supported for IMAP and POP3 over TCP";
+      return false;
+    }
+    if (cfg.m_TokenUrl.isEmpty() || cfg.m_ClientId.isEmpty())
+    {
+      error = "OAuth2 needs " + KEY_TOKEN_URL + " and " + KEY_CLIENT_ID;
+      return false;
+    }
+  }
+  return true;
+}
+
+int CConfig::importAccounts(const QString &filename, QStringList &errors)
+{
+  QElapsedTimer timer;
+  timer.start();
+  errors.clear();
+  QFile file(filename);
+  if (!file.open(QIODevice::ReadOnly))
+  {
+    errors.append(filename + ": " + file.errorString());
+    return -1;
+  }
+  const QByteArray data = file.readAll();
+  file.close();
+
+  // Records with the line number or array index for the messages
+  QList<QHash<QString, QString>> records;
+  QList<int> lines;
+  if (filename.endsWith(".json", Qt::CaseInsensitive))
+  {
+    QJsonParseError perr;
+    const QJsonDocument doc = QJsonDocument::fromJson(data, &perr);
+    if (!doc.isArray())
+    {
+      errors.append(filename + ": " + (doc.isNull() ? perr.errorString() : QString("not an array")));
+      return -1;
+    }
+    const QJsonArray array = doc.array();
+    for (qsizetype i = 0; i < array.size(); ++i)
+    {
+      QHash<QString, QString> record;
+      const QJsonObject obj = array.at(i).toObject();
+      for (auto it = obj.constBegin(); it != obj.constEnd(); ++it)
+      {
+        record.insert(it.key(), it.value().toVariant().toString());
+      }
+      records.append(record);
+      lines.append(i);
+    }
+  }
+  else
+  {
+    QList<QStringList> csv;
+    if (!parseCsv(QString::fromUtf8(data), csv) || csv.isEmpty())
+    {
+      errors.append(filename + ": invalid CSV");
+      return -1;
+    }
+    const QStringList header = csv.first();
+    for (qsizetype i = 1; i < csv.size(); ++i)
+    {
+      if (csv.at(i).size() != header.size())
+      {
+        errors.append(QString("%1:%2: %3 fields, expected %4").arg(filename).arg(i + 1).arg(csv.at(i).size()).arg(header.size()));
+        continue;
+      }
+      QHash<QString, QString> record;
+      for (qsizetype j = 0; j < header.size(); ++j)
+      {
+        record.insert(header.at(j).trimmed(), csv.at(i).at(j));
+      }
+      records.append(record);
+      lines.append(i + 1);
+    }
+  }
+
+  QVector<MAILBOX_CONFIG_T> accounts;
+  QSet<QString> names;
+  accounts.reserve(records.size());
+  for (qsizetype i = 0; i < records.size(); ++i)
+  {
+    MAILBOX_CONFIG_T cfg;
+    QString error;
+    if (!parseAccount(records.at(i), cfg, error))
+    {
+      errors.append(QString("%1:%2: %3").arg(filename).arg(lines.at(i)).arg(error));
+    }
+    else if (names.contains(cfg.m_MailboxName))
+    {
+      errors.append(QString("%1:%2: duplicate mailbox %3").arg(filename).arg(lines.at(i)).arg(cfg.m_MailboxName));
+    }
+    else
+    {
+      names.insert(cfg.m_MailboxName);
+      accounts.append(cfg);
+    }
+  }
+  if (!errors.isEmpty())
+  {
+    return -1;
+  }
+
+  // All accounts in one snapshot
+  auto snapshot = edit();
+  QHash<QString, QString> changed;
+  const qint64 now = QDateTime::currentMSecsSinceEpoch();
+  for (MAILBOX_CONFIG_T &cfg : accounts)
+  {
+    int idx = snapshot->m_Index.value(cfg.m_MailboxName, -1);
+    if (idx != -1)
+    {
+      cfg.m_KeyStamp = snapshot->m_MailboxConfig.at(idx).m_KeyStamp;
+    }
+    const QString old = (idx != -1) ? snapshot->m_MailboxConfig.at(idx).m_Password : QString();
+    if (cfg.m_ClientSecret.isEmpty())
+    {
+      cfg.m_ClientSecret = (idx != -1) ? snapshot->m_MailboxConfig.at(idx).m_ClientSecret : QString();
+    }
+    else
+    {
+      m_RestoredPasswords.remove(secretKey(cfg.m_MailboxName));
+      if (storePassword(secretKey(cfg.m_MailboxName), cfg.m_ClientSecret))
+      {
+        cfg.m_KeyStamp = now;
+      }
+    }
+    if (cfg.m_Password.isEmpty())
+    {
+      cfg.m_Password = old;
+    }
+    else
+    {
+      m_RestoredPasswords.remove(cfg.m_MailboxName);
+      if (storePassword(cfg.m_MailboxName, cfg.m_Password))
+      {
+        cfg.m_KeyStamp = now;
+      }
+      if ((idx != -1) && (cfg.m_Password != old))
+      {
+        changed.insert(cfg.m_MailboxName, cfg.m_Password);
+      }
+    }
+    insertMailbox(*snapshot, cfg);
+  }
+  publish(snapshot);
+  for (auto it = changed.cbegin(); it != changed.cend(); ++it)
+  {
+    updatePassword(it.key(), it.value());
+  }
+  qInfo() << "Imported " << accounts.size() << " mailboxes from " << filename
+          << " in " << timer.elapsed() << " ms";
+  return accounts.size();
+}
+
+bool CConfig::exportAccounts(const QString &filename, QString &error) const
+{
+  const QStringList keys = {KEY_MAILBOX_NAME, KEY_PROTOCOL, KEY_USER_NAME,
+                            KEY_SERVER, KEY_PORT, KEY_IMAP_MAILBOX,
+                            KEY_TRANSPORT, KEY_TUNNEL, KEY_AUTH,
+                            KEY_TOKEN_URL, KEY_CLIENT_ID};
+  bool json = filename.endsWith(".json", Qt::CaseInsensitive);
+  QJsonArray array;
+  QString csv = keys.join(',') + "\n";
+  MailboxSnapshot config = snapshot();
+  for (const MAILBOX_CONFIG_T &cfg : config->m_MailboxConfig)
+  {
+    const QStringList values = {cfg.m_MailboxName,
+                                PROTOCOL_NAMES[cfg.m_Protocol],
+                                cfg.m_User,
+                                cfg.m_Server,
+                                QString::number(cfg.m_Port),
+                                cfg.m_ImapMailBox,
+                                TRANSPORT_NAMES[cfg.m_Transport],
+                                cfg.m_Tunnel,
+                                AUTH_NAMES[cfg.m_Auth],
+                                cfg.m_TokenUrl,
+                                cfg.m_ClientId};
+    if (json)
+    {
+      QJsonObject obj;
+      for (qsizetype i = 0; i < keys.size(); ++i)
+      {
+        obj.insert(keys.at(i), values.at(i));
+      }
+      obj.insert(KEY_PORT, cfg.m_Port);
+      array.append(obj);
+    }
+    else
+    {
+      QStringList fields;
+      for (const QString &value : values)
+      {
+        fields.append(quoteCsv(value));
+      }
+      csv += fields.join(',') + "\n";
+    }
+  }
+
+  QSaveFile file(filename);
+  if (!file.open(QIODevice::WriteOnly))
+  {
+    error = file.errorString();
+    return false;
+  }
+  file.write(json ? QJsonDocument(array).toJson() : csv.toUtf8());
+  if (!file.commit())
+  {
+    error = file.errorString();
+    return false;
+  }
+  return true;
+}
+
+bool CConfig::waitForKeyChain(int timeout)
+{
+  if (m_KeyChain.pendingJobs() == 0)
+  {
+    return true;
+  }
+  QEventLoop loop;
+  connect(&m_KeyChain, &CKeyChain::idle, &loop, &QEventLoop::quit);
+  QTimer::singleShot(timeout, &loop, &QEventLoop::quit);
+  loop.exec();
+  return m_KeyChain.pendingJobs() == 0;
+}
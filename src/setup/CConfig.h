@@ -12,12 +12,17 @@
 #ifndef SRC_SETUP_CCONFIG_H_
 #define SRC_SETUP_CCONFIG_H_
 
-#include "../traybiff.h"
+#include "../protocols/mailtypes.h"
 #include <QDir>
+#include <QHash>
 #include <QIcon>
+#include <QSet>
 #include <QSettings>
 #include <QString>
+#include <QStringList>
+#include <QTimer>
 #include <QVector>
+#include <memory>
 #include "CKeyChain.h"
 
 enum class IconType
@@ -40,13 +45,34 @@ typedef struct
   QString m_User;
   QString m_Password;
   QString m_ImapMailBox;
+  TRANSPORTS m_Transport;
+  QString m_Tunnel; // Command or socket path for tunnel transports
+  AUTHS m_Auth;
+  QString m_TokenUrl; // OAuth2 token endpoint
+  QString m_ClientId;
+  QString m_ClientSecret;
+  // Time of the last keychain write, another instance reads the
+  // password and secret again when it changed
+  qint64 m_KeyStamp = 0;
 } MAILBOX_CONFIG_T;
 
+/*
+ * Immutable set of mailbox definitions. A change publishes a new
+ * snapshot, a reader keeps the snapshot it took as long as it needs it.
+ */
 typedef struct
 {
   QVector<MAILBOX_CONFIG_T> m_MailboxConfig;
+  QHash<QString, int> m_Index; // Mailbox name to index in m_MailboxConfig
+} MAILBOX_SNAPSHOT_T;
+
+typedef std::shared_ptr<const MAILBOX_SNAPSHOT_T> MailboxSnapshot;
+
+typedef struct
+{
   QString m_IcTypeFileName[static_cast<int>(IconType::icLast) + 1];
   QIcon m_IcType[static_cast<int>(IconType::icLast) + 1];
+  bool m_IcLoaded[static_cast<int>(IconType::icLast) + 1]; // Icons are loaded on first use
 } CONFIG_DATA_T;
 
 class CConfig : public QObject
@@ -63,17 +89,24 @@ public:
   {
     return m_isConfigured;
   }
+  /*
+   * Current mailbox definitions, may be called from any thread without
+   * locking. The mailboxes are only changed by the GUI thread.
+   */
+  MailboxSnapshot snapshot() const
+  {
+    return std::atomic_load(&m_Snapshot);
+  }
   /*
    * Get a list of all passwords
    */
   void getMailboxes(QVector<QString> &mailboxes) const;
   /*
-   * Add/update a new config
+   * Add/update a config with its OAuth2 client and password in one
+   * snapshot. The password is only written to the keychain if it
+   * changed.
    */
-  void addConfig(const QString &mailboxname, PROTOCOLS protocol,
-                 const QString &user,
-                 const QString &server, uint16_t port,
-                 const QString &imap_mailbox);
+  void addConfig(const MAILBOX_CONFIG_T &config);
 
   /*
    * Request to get password
@@ -83,13 +116,9 @@ public:
     m_KeyChain.readKey(mailboxname);
   }
   /*
-   * Set new password
+   * Set new password, it is only written to the keychain if it changed
    */
-  void setPassword(const QString &mailboxname, const QString &passwd)
-  {
-    m_KeyChain.writeKey(mailboxname, passwd);
-    keyRestored(mailboxname, passwd);
-  }
+  void setPassword(const QString &mailboxname, const QString &passwd);
   /*
    * Delete a configuration
    */
@@ -97,21 +126,58 @@ public:
   void getConfig(const QString &mailboxname, PROTOCOLS &protocol,
                  QString &user, QString &password, QString &server,
                  uint16_t &port, QString &imap_mailbox) const;
+  void getTransport(const QString &mailboxname, TRANSPORTS &transport,
+                    QString &tunnel) const;
+  void getOAuth(const QString &mailboxname, AUTHS &auth, QString &tokenurl,
+                QString &clientid, QString &secret) const;
   void save();
+
+  /*
+   * Read the settings file again, e.g. after it was changed by another
+   * program. A new snapshot is published.
+   */
+  void reload()
+  {
+    load();
+  }
+  QString fileName() const;
+
+  /*
+   * Bulk provisioning of mailbox definitions. The format is taken from
+   * the file extension, .json is a JSON array of objects, everything
+   * else CSV with a header line. The keys are the settings keys of a
+   * mailbox and "password". All records are validated first, nothing
+   * is imported if one of them is invalid. Passwords and client
+   * secrets are not exported.
+   */
+  int importAccounts(const QString &filename, QStringList &errors);
+  bool exportAccounts(const QString &filename, QString &error) const;
+
+  /*
+   * Run the event loop until the keychain jobs are done, e.g. before
+   * a command line import exits
+   */
+  bool waitForKeyChain(int timeout);
+
   void beginUpdate();
   void abortUpdate();
+  /*
+   * The setup dialog is open, between beginUpdate and save or abortUpdate
+   */
+  bool isUpdating() const
+  {
+    return m_Updating;
+  }
 
   void saveIconDir(const QString &dir);
   QString getIconDir() const;
 
-  QIcon getIcon(const IconType &type) const
-  {
-    return (m_CurrentConfig.m_IcType[static_cast<int>(type)]);
-  }
+  QIcon getIcon(const IconType &type);
 
   void setIcon(const IconType &type, const QIcon &newIcon)
   {
     m_CurrentConfig.m_IcType[static_cast<int>(type)] = newIcon;
+    m_CurrentConfig.m_IcLoaded[static_cast<int>(type)] = true;
   }
   QString getIconName(const IconType &type) const
   {
@@ -124,34 +190,85 @@ public:
   QIcon ResetIcon(const IconType &type);
 
   int m_PollTime = 0;
+  int m_TimeoutMin = 0; // Bounds for the adaptive timeouts in s
+  int m_TimeoutMax = 0;
+  int m_MaxConnections = 0; // Concurrent connections, <= 0 no limit
+  int m_MaxHostConnections = 0;
+  bool m_BatteryPolicy = false; // Stretch the poll time on battery
+  int m_BatteryFactor = 0;
+  bool m_IdlePolicy = false;    // Stretch the poll time when the user is idle
+  int m_IdleTime = 0;           // min
+  int m_StaleTime = 0;          // s, refresh on activation, 0 never
   bool m_DockInPanel = false;
   bool m_UseSessionManangement = false;
 
 signals:
   void updatePassword(const QString &mailbox, const QString &password);
+  /*
+   * OAuth2 client secrets were read from the keychain, the servers
+   * using them have to be created again
+   */
+  void secretsRestored();
 
 private slots:
   void keyRestored(const QString &key, const QString &value);
-  void keyError(const QString &errorText);
+  void applyRestoredPasswords();
+  void keyError(const QString &key, const QString &errorText);
   void keyStored(const QString &key);
 
 private:
   CConfig();
   CConfig(const CConfig &);
   CConfig &operator=(const CConfig &);
-  int findMailbox(const QString &mailboxname) const;
+  void load();
+  std::shared_ptr<MAILBOX_SNAPSHOT_T> edit() const;
+  void publish(MailboxSnapshot snapshot);
+  int insertMailbox(MAILBOX_SNAPSHOT_T &snapshot, const MAILBOX_CONFIG_T &cfg);
   void saveIconName(QSettings &settings, const IconType &type,
                     const QString &key);
   void saveIcon(QIcon &icon, QString &savename, const QString &name);
-  QIcon getIconInfo(QSettings &settings, const QString &key,
-                    const QString &name, const QIcon &fallback,
-                    QString &iconname);
+  QIcon getIconInfo(const QString &file, const QString &name,
+                    const QIcon &fallback, QString &iconname);
   void LoadIcon(QSettings &settings, const IconType &type);
+  bool storePassword(const QString &mailboxname, const QString &passwd);
+  void applyPassword(const QString &mailboxname, const QString &passwd);
+  /*
+   * Keychain key of the OAuth2 client secret of a mailbox, the password
+   * is stored under the mailbox name
+   */
+  static QString secretKey(const QString &mailboxname)
+  {
+    return mailboxname + SECRET_SUFFIX;
+  }
+  void reindex(MAILBOX_SNAPSHOT_T &snapshot, int from);
+  void writeMailbox(QSettings &settings, const MAILBOX_CONFIG_T &cfg);
+  bool parseAccount(const QHash<QString, QString> &record,
+                    MAILBOX_CONFIG_T &cfg, QString &error) const;
   bool m_isConfigured = false;
+  bool m_Updating = false;
 
   CONFIG_DATA_T m_CurrentConfig;
-  CONFIG_DATA_T m_OldConfig;
+
+  // Published by the GUI thread with std::atomic_store
+  MailboxSnapshot m_Snapshot = std::make_shared<MAILBOX_SNAPSHOT_T>();
+  // State of beginUpdate, restored by abortUpdate
+  MailboxSnapshot m_OldSnapshot;
+  // Passwords read from or written to the keychain since beginUpdate,
+  // kept by abortUpdate
+  QHash<QString, QString> m_UpdatePasswords;
+  QString m_OldIconNames[static_cast<int>(IconType::icLast) + 1];
+
+  // Passwords and secrets read from the keychain, applied together in
+  // one snapshot
+  QHash<QString, QString> m_RestoredPasswords;
+  QTimer m_RestoreTimer;
+
+  // Changed entries of the settings array, only they are written on save
+  QSet<int> m_Dirty;
+  QSet<int> m_OldDirty;
+  int m_SavedSize = 0; // Size of the array in the settings file
   CKeyChain m_KeyChain;
+  QHash<QString, QString> m_KeyChainValues; // Passwords known to be in the keychain
 
   static inline const QString KEY_ICNEWMAIL = "icon_newmail";
   static inline const QString KEY_ICNOMAIL = "icon_nomail";
@@ -180,9 +297,34 @@ private:
   static inline const QString KEY_SERVER = "server";
   static inline const QString KEY_PORT = "port";
   static inline const QString KEY_IMAP_MAILBOX = "imap_mailbox";
+  static inline const QString KEY_TRANSPORT = "transport";
+  static inline const QString KEY_TUNNEL = "tunnel";
+  static inline const QString KEY_AUTH = "auth";
+  static inline const QString KEY_TOKEN_URL = "token_url";
+  static inline const QString KEY_KEY_STAMP = "keychain_stamp";
+  static inline const QString KEY_CLIENT_ID = "client_id";
+  static inline const QString KEY_CLIENT_SECRET = "client_secret"; // Older settings and import only
+  static inline const QString SECRET_SUFFIX = "/" + KEY_CLIENT_SECRET;
+
+  static inline const QString KEY_PASSWORD = "password"; // Import only
+
+  // Names in the import and export files
+  static inline const QString PROTOCOL_NAMES[PROTO_LAST] = {"pop3", "pop3s", "imap4", "imap3", "imaps",
+                                                            "maildir", "mbox", "jmap", "nntp", "nntps"};
+  static inline const QString TRANSPORT_NAMES[TRANSPORT_LAST] = {"tcp", "command", "unix"};
+  static inline const QString AUTH_NAMES[AUTH_LAST] = {"password", "oauth2"};
 
   // Global config keys
   static inline const QString KEY_POLL = "poll";
+  static inline const QString KEY_TIMEOUT_MIN = "timeout_min";
+  static inline const QString KEY_TIMEOUT_MAX = "timeout_max";
+  static inline const QString KEY_MAX_CONNECTIONS = "max_connections";
+  static inline const QString KEY_MAX_HOST_CONNECTIONS = "max_host_connections";
+  static inline const QString KEY_BATTERY_POLICY = "battery_policy";
+  static inline const QString KEY_BATTERY_FACTOR = "battery_factor";
+  static inline const QString KEY_IDLE_POLICY = "idle_policy";
+  static inline const QString KEY_IDLE_TIME = "idle_time";
+  static inline const QString KEY_STALE_TIME = "stale_time";
   static inline const QString KEY_DOCK = "dock";
   static inline const QString KEY_USE_SESSION = "sessionmanagement";
 
@@ -2,59 +2,150 @@
 
 #include "CKeyChain.h"
 
-CKeyChain::CKeyChain(QObject *parent) : QObject(parent),
-                                        m_readCredentialJob(QLatin1String("TrayBiff")),
-                                        m_writeCredentialJob(QLatin1String("TrayBiff")),
-                                        m_deleteCredentialJob(QLatin1String("TrayBiff"))
+CKeyChain::CKeyChain(QObject *parent) : QObject(parent)
 {
-    m_readCredentialJob.setAutoDelete(false);
-    m_writeCredentialJob.setAutoDelete(false);
-    m_deleteCredentialJob.setAutoDelete(false);
+    m_FlushTimer.setSingleShot(true);
+    m_FlushTimer.setInterval(0);
+    connect(&m_FlushTimer, &QTimer::timeout, this, &CKeyChain::flushWrites);
 }
 
 void CKeyChain::readKey(const QString &key)
 {
-    m_readCredentialJob.setKey(key);
-
-    QObject::connect(&m_readCredentialJob, &QKeychain::ReadPasswordJob::finished, [=]()
-                     {
-        if (m_readCredentialJob.error()) {
-            emit error(tr("Read key failed: %1").arg(qPrintable(m_readCredentialJob.errorString())));
-            return;
-        }
-        emit keyRestored(key, m_readCredentialJob.textData()); });
-
-    m_readCredentialJob.start();
+    auto pending = m_PendingWrites.constFind(key);
+    if (pending != m_PendingWrites.constEnd())
+    {
+        // Not yet written, answer with the new value
+        const QString value = pending.value();
+        QMetaObject::invokeMethod(this, [this, key, value]()
+                                  { emit keyRestored(key, value); }, Qt::QueuedConnection);
+        return;
+    }
+    m_Queue.append(SJob{JobType::jtRead, key, QString(), m_Generation.value(key)});
+    startJobs();
 }
 
 void CKeyChain::writeKey(const QString &key, const QString &value)
 {
-    m_writeCredentialJob.setKey(key);
+    if (!m_PendingWrites.contains(key))
+    {
+        m_WriteOrder.append(key);
+    }
+    m_PendingWrites.insert(key, value);
+    m_Generation[key]++;
+    m_FlushTimer.start();
+}
 
-    QObject::connect(&m_writeCredentialJob, &QKeychain::WritePasswordJob::finished, [=]()
-                     {
-        if (m_writeCredentialJob.error()) {
-            emit error(tr("Write key failed: %1").arg(qPrintable(m_writeCredentialJob.errorString())));
-            return;
-        }
+void CKeyChain::deleteKey(const QString &key)
+{
+    if (m_PendingWrites.remove(key) > 0)
+    {
+        m_WriteOrder.removeAll(key);
+    }
+    m_Generation[key]++;
+    m_Queue.append(SJob{JobType::jtDelete, key, QString()});
+    startJobs();
+}
 
-        emit keyStored(key); });
+void CKeyChain::flushWrites()
+{
+    for (const QString &key : std::as_const(m_WriteOrder))
+    {
+        m_Queue.append(SJob{JobType::jtWrite, key, m_PendingWrites.value(key)});
+    }
+    m_WriteOrder.clear();
+    m_PendingWrites.clear();
+    startJobs();
+}
 
-    m_writeCredentialJob.setTextData(value);
-    m_writeCredentialJob.start();
+/*
+ * Start the oldest queued jobs whose key has no running job
+ */
+void CKeyChain::startJobs()
+{
+    for (qsizetype i = 0; (i < m_Queue.size()) && (m_Running < MAX_JOBS);)
+    {
+        if (m_RunningKeys.contains(m_Queue.at(i).m_Key))
+        {
+            i++;
+            continue;
+        }
+        startJob(m_Queue.takeAt(i));
+    }
 }
 
-void CKeyChain::deleteKey(const QString &key)
+void CKeyChain::startJob(const SJob &request)
 {
-    m_deleteCredentialJob.setKey(key);
+    QKeychain::Job *job = nullptr;
+    switch (request.m_Type)
+    {
+    case JobType::jtRead:
+        job = new QKeychain::ReadPasswordJob(SERVICE, this);
+        break;
+    case JobType::jtWrite:
+    {
+        auto *write = new QKeychain::WritePasswordJob(SERVICE, this);
+        write->setTextData(request.m_Value);
+        job = write;
+        break;
+    }
+    case JobType::jtDelete:
+        job = new QKeychain::DeletePasswordJob(SERVICE, this);
+        break;
+    }
+    job->setAutoDelete(true);
+    job->setKey(request.m_Key);
+    connect(job, &QKeychain::Job::finished, this, [this, request](QKeychain::Job *finished)
+            { jobFinished(finished, request); });
+    m_Running++;
+    m_RunningKeys.insert(request.m_Key);
+    job->start();
+}
 
-    QObject::connect(&m_deleteCredentialJob, &QKeychain::DeletePasswordJob::finished, [=]()
-                     {
-        if (m_deleteCredentialJob.error()) {
-            emit error(tr("Delete key failed: %1").arg(qPrintable(m_deleteCredentialJob.errorString())));
-            return;
+void CKeyChain::jobFinished(QKeychain::Job *job, const SJob &request)
+{
+    m_Running--;
+    m_RunningKeys.remove(request.m_Key);
+    if (job->error())
+    {
+        QString text;
+        switch (request.m_Type)
+        {
+        case JobType::jtRead:
+            text = tr("Read key failed: %1");
+            break;
+        case JobType::jtWrite:
+            text = tr("Write key failed: %1");
+            break;
+        case JobType::jtDelete:
+            text = tr("Delete key failed: %1");
+            break;
         }
-        emit keyDeleted(key); });
-
-    m_deleteCredentialJob.start();
+        emit error(request.m_Key, text.arg(job->errorString()));
+    }
+    else
+    {
+        switch (request.m_Type)
+        {
+        case JobType::jtRead:
+            if (request.m_Generation != m_Generation.value(request.m_Key))
+            {
+                qDebug() << "Stale read of key " << request.m_Key << " dropped";
+                break;
+            }
+            emit keyRestored(request.m_Key,
+                             static_cast<QKeychain::ReadPasswordJob *>(job)->textData());
+            break;
+        case JobType::jtWrite:
+            emit keyStored(request.m_Key);
+            break;
+        case JobType::jtDelete:
+            emit keyDeleted(request.m_Key);
+            break;
+        }
+    }
+    startJobs();
+    if (pendingJobs() == 0)
+    {
+        emit idle();
+    }
 }
@@ -1,10 +1,24 @@
 #ifndef KEYCHAINCLASS_H
 #define KEYCHAINCLASS_H
 
+#include <QHash>
+#include <QList>
+#include <QSet>
 #include <QObject>
+#include <QTimer>
 
 #include <keychain.h>
 
+/*
+ * Queue of keychain jobs. Every request gets its own job, so
+ * overlapping requests for different keys do not overwrite each
+ * other. Writes are collected and deduplicated until the queue is
+ * flushed at the next return to the event loop.
+ *
+ * Jobs for the same key run one after the other in the order of the
+ * requests. A read answered after a later write or delete of its key
+ * is stale and dropped.
+ */
 class CKeyChain : public QObject
 {
     Q_OBJECT
@@ -15,16 +29,52 @@ public:
     void writeKey(const QString &key, const QString &value);
     void deleteKey(const QString &key);
 
+    /*
+     * Number of queued and running jobs
+     */
+    int pendingJobs() const
+    {
+        return m_Queue.size() + m_PendingWrites.size() + m_Running;
+    }
+
 signals:
     void keyStored(const QString &key);
     void keyRestored(const QString &key, const QString &value);
     void keyDeleted(const QString &key);
-    void error(const QString &errorText);
+    void error(const QString &key, const QString &errorText);
+    void idle();
 
 private:
-    QKeychain::ReadPasswordJob m_readCredentialJob;
-    QKeychain::WritePasswordJob m_writeCredentialJob;
-    QKeychain::DeletePasswordJob m_deleteCredentialJob;
+    enum class JobType
+    {
+        jtRead,
+        jtWrite,
+        jtDelete
+    };
+
+    struct SJob
+    {
+        JobType m_Type;
+        QString m_Key;
+        QString m_Value;
+        quint64 m_Generation = 0; // Of the key when a read was requested
+    };
+
+    void flushWrites();
+    void startJobs();
+    void startJob(const SJob &job);
+    void jobFinished(QKeychain::Job *job, const SJob &request);
+
+    QList<SJob> m_Queue;
+    QHash<QString, QString> m_PendingWrites;
+    QList<QString> m_WriteOrder;
+    QTimer m_FlushTimer;
+    int m_Running = 0;
+    QSet<QString> m_RunningKeys;
+    QHash<QString, quint64> m_Generation; // Writes and deletes per key
+
+    inline const static QString SERVICE = "TrayBiff";
+    inline const static int MAX_JOBS = 8;
 };
 
 #endif // KEYCHAINCLASS_H
@@ -15,6 +15,11 @@ static uint32_t default_ports[PROTO_LAST] = {
     143, // PROTO_IMAP
     220, // PROTO_IMAP3
     993, // PROTO_IMAPS
+    0,   // PROTO_MAILDIR
+    0,   // PROTO_MBOX
+    443, // PROTO_JMAP
+    119, // PROTO_NNTP
+    563, // PROTO_NNTPS
 };
 
 CSetupDialog::CSetupDialog(QWidget *parent) : QDialog(parent)
@@ -37,7 +42,22 @@ CSetupDialog::CSetupDialog(QWidget *parent) : QDialog(parent)
   comboBoxProtocol->addItem("imap4", QVariant(PROTO_IMAP4));
   comboBoxProtocol->addItem("imap3", QVariant(PROTO_IMAP3));
   comboBoxProtocol->addItem("imaps", QVariant(PROTO_IMAPS));
+  comboBoxProtocol->addItem("maildir", QVariant(PROTO_MAILDIR));
+  comboBoxProtocol->addItem("mbox", QVariant(PROTO_MBOX));
+  comboBoxProtocol->addItem("jmap", QVariant(PROTO_JMAP));
+  comboBoxProtocol->addItem("nntp", QVariant(PROTO_NNTP));
+  comboBoxProtocol->addItem("nntps", QVariant(PROTO_NNTPS));
+  comboBoxTransport->addItem(tr("TCP"), QVariant(TRANSPORT_TCP));
+  comboBoxTransport->addItem(tr("Command"), QVariant(TRANSPORT_COMMAND));
+  comboBoxTransport->addItem(tr("Unix socket"), QVariant(TRANSPORT_UNIX));
+  comboBoxAuth->addItem(tr("Password"), QVariant(AUTH_PASSWORD));
+  comboBoxAuth->addItem(tr("OAuth2"), QVariant(AUTH_OAUTH2));
   spinBoxPoll->setValue(cfg.m_PollTime);
+  checkBoxBatteryPolicy->setChecked(cfg.m_BatteryPolicy);
+  spinBoxBatteryFactor->setValue(cfg.m_BatteryFactor);
+  checkBoxIdlePolicy->setChecked(cfg.m_IdlePolicy);
+  spinBoxIdleTime->setValue(cfg.m_IdleTime);
+  spinBoxStaleTime->setValue(cfg.m_StaleTime);
   checkBoxDockInPanel->setChecked(cfg.m_DockInPanel);
   checkBoxUseSessionManagement->setChecked(cfg.m_UseSessionManangement);
 
@@ -52,6 +72,10 @@ CSetupDialog::CSetupDialog(QWidget *parent) : QDialog(parent)
   con_line_edit(lineEditServer);
   con_line_edit(lineEditPort);
   con_line_edit(lineEditIMAPMailbox);
+  con_line_edit(lineEditTunnel);
+  con_line_edit(lineEditTokenUrl);
+  con_line_edit(lineEditClientId);
+  con_line_edit(lineEditClientSecret);
 
   QVector<QString> mailboxes;
   cfg.getMailboxes(mailboxes);
@@ -77,6 +101,12 @@ void CSetupDialog::displayMailBox(const QString mailboxname)
   QSignalBlocker b5(lineEditPort);
   QSignalBlocker b6(lineEditIMAPMailbox);
   QSignalBlocker b7(comboBoxProtocol);
+  QSignalBlocker b8(comboBoxTransport);
+  QSignalBlocker b9(lineEditTunnel);
+  QSignalBlocker b10(comboBoxAuth);
+  QSignalBlocker b11(lineEditTokenUrl);
+  QSignalBlocker b12(lineEditClientId);
+  QSignalBlocker b13(lineEditClientSecret);
   CConfig &cfg = CConfig::instance();
   PROTOCOLS protocol;
   QString user;
@@ -84,9 +114,17 @@ void CSetupDialog::displayMailBox(const QString mailboxname)
   QString server;
   QString imap_mailbox;
   uint16_t port;
+  TRANSPORTS transport;
+  QString tunnel;
+  AUTHS auth;
+  QString tokenurl;
+  QString clientid;
+  QString secret;
 
   cfg.getConfig(mailboxname, protocol, user, password, server, port,
                 imap_mailbox);
+  cfg.getTransport(mailboxname, transport, tunnel);
+  cfg.getOAuth(mailboxname, auth, tokenurl, clientid, secret);
 
   qInfo("Mailbox %s %d %s", qUtf8Printable(mailboxname), protocol,
         qUtf8Printable(user));
@@ -101,6 +139,14 @@ void CSetupDialog::displayMailBox(const QString mailboxname)
   lineEditServer->setText(server);
   lineEditPort->setText(QString::number(port));
   lineEditIMAPMailbox->setText(imap_mailbox);
+  idx = comboBoxTransport->findData(QVariant(transport));
+  comboBoxTransport->setCurrentIndex(qMax(idx, 0));
+  lineEditTunnel->setText(tunnel);
+  idx = comboBoxAuth->findData(QVariant(auth));
+  comboBoxAuth->setCurrentIndex(qMax(idx, 0));
+  lineEditTokenUrl->setText(tokenurl);
+  lineEditClientId->setText(clientid);
+  lineEditClientSecret->setText(secret);
 }
 
 void CSetupDialog::done(int result)
@@ -111,6 +157,11 @@ void CSetupDialog::done(int result)
     qInfo("CSetupDialog::OK");
     save();
     cfg.m_PollTime = spinBoxPoll->value();
+    cfg.m_BatteryPolicy = checkBoxBatteryPolicy->isChecked();
+    cfg.m_BatteryFactor = spinBoxBatteryFactor->value();
+    cfg.m_IdlePolicy = checkBoxIdlePolicy->isChecked();
+    cfg.m_IdleTime = spinBoxIdleTime->value();
+    cfg.m_StaleTime = spinBoxStaleTime->value();
     cfg.m_DockInPanel = checkBoxDockInPanel->isChecked();
     cfg.m_UseSessionManangement = checkBoxUseSessionManagement->isChecked();
     cfg.save();
@@ -124,14 +175,47 @@ void CSetupDialog::done(int result)
   QDialog::done(result);
 }
 
+/*
+ * Local mail stores are read from the path in the server field
+ */
+bool CSetupDialog::isLocal(int proto)
+{
+  return (proto == PROTO_MAILDIR) || (proto == PROTO_MBOX);
+}
+
 bool CSetupDialog::inputOk()
 {
   bool ok = true;
+  int proto = comboBoxProtocol->currentData().toInt();
+  if (isLocal(proto))
+  {
+    // Only the path is needed
+    return !lineEditName->text().isEmpty() && !lineEditServer->text().isEmpty();
+  }
+  if (comboBoxTransport->currentData().toInt() != TRANSPORT_TCP)
+  {
+    // The tunnel is preauthenticated, IMAP only
+    return !lineEditName->text().isEmpty() && !lineEditTunnel->text().isEmpty() &&
+           (proto >= PROTO_IMAP4) && (proto <= PROTO_IMAPS) &&
+           !lineEditIMAPMailbox->text().isEmpty();
+  }
+  if ((proto == PROTO_NNTP) || (proto == PROTO_NNTPS))
+  {
+    // News servers are often read without login
+    lineEditPort->text().toInt(&ok);
+    return ok && !lineEditName->text().isEmpty() && !lineEditServer->text().isEmpty() &&
+           !lineEditIMAPMailbox->text().isEmpty();
+  }
   if (lineEditName->text().isEmpty() || lineEditUser->text().isEmpty() || lineEditPassword->text().isEmpty() || lineEditServer->text().isEmpty() || lineEditPort->text().isEmpty())
   {
     return false;
   }
-  int proto = comboBoxProtocol->currentData().toInt();
+  if ((comboBoxAuth->currentData().toInt() == AUTH_OAUTH2) &&
+      (lineEditTokenUrl->text().isEmpty() || lineEditClientId->text().isEmpty()))
+  {
+    // The password is the refresh token
+    return false;
+  }
   if (proto < 0)
   {
     return false;
@@ -156,6 +240,12 @@ void CSetupDialog::clear()
   QSignalBlocker b5(lineEditPort);
   QSignalBlocker b6(lineEditIMAPMailbox);
   QSignalBlocker b7(comboBoxProtocol);
+  QSignalBlocker b8(comboBoxTransport);
+  QSignalBlocker b9(lineEditTunnel);
+  QSignalBlocker b10(comboBoxAuth);
+  QSignalBlocker b11(lineEditTokenUrl);
+  QSignalBlocker b12(lineEditClientId);
+  QSignalBlocker b13(lineEditClientSecret);
 
   lineEditName->setText("");
   lineEditUser->setText("");
@@ -164,7 +254,14 @@ void CSetupDialog::clear()
   lineEditPort->setText("");
   lineEditIMAPMailbox->setText("");
 
+  lineEditTunnel->setText("");
+  lineEditTokenUrl->setText("");
+  lineEditClientId->setText("");
+  lineEditClientSecret->setText("");
+
   comboBoxProtocol->setCurrentIndex(-1);
+  comboBoxTransport->setCurrentIndex(0);
+  comboBoxAuth->setCurrentIndex(0);
 }
 
 void CSetupDialog::save()
@@ -174,17 +271,24 @@ void CSetupDialog::save()
   CConfig &cfg = CConfig::instance();
   int proto = comboBoxProtocol->currentData().toInt();
   const QString &mailboxname = lineEditName->text();
-  const QString &user = lineEditUser->text();
-  const QString &password = lineEditPassword->text();
-  const QString &server = lineEditServer->text();
-  const QString &imap_mailbox = lineEditIMAPMailbox->text();
-  uint16_t port = lineEditPort->text().toInt(&ok);
+  MAILBOX_CONFIG_T config;
+  config.m_MailboxName = mailboxname;
+  config.m_Protocol = (PROTOCOLS)proto;
+  config.m_User = lineEditUser->text();
+  config.m_Password = lineEditPassword->text();
+  config.m_Server = lineEditServer->text();
+  config.m_Port = lineEditPort->text().toInt(&ok);
+  config.m_ImapMailBox = lineEditIMAPMailbox->text();
+  config.m_Transport = (TRANSPORTS)comboBoxTransport->currentData().toInt();
+  config.m_Tunnel = lineEditTunnel->text();
+  config.m_Auth = (AUTHS)comboBoxAuth->currentData().toInt();
+  config.m_TokenUrl = lineEditTokenUrl->text();
+  config.m_ClientId = lineEditClientId->text();
+  config.m_ClientSecret = lineEditClientSecret->text();
 
   if (inputOk())
   {
-    cfg.addConfig(mailboxname, (PROTOCOLS)proto, user, server,
-                  port, imap_mailbox);
-    cfg.setPassword(mailboxname, password);
+    cfg.addConfig(config);
     QList<QListWidgetItem *> items = listWidgetServers->findItems(mailboxname, Qt::MatchExactly);
     if (items.size() == 0)
     {
@@ -234,11 +338,32 @@ void CSetupDialog::on_comboBoxProtocol_currentIndexChanged(int idx)
   }
 }
 
+void CSetupDialog::on_comboBoxTransport_currentIndexChanged(int idx)
+{
+  Q_UNUSED(idx);
+  on_InputChanged("");
+}
+
+void CSetupDialog::on_comboBoxAuth_currentIndexChanged(int idx)
+{
+  Q_UNUSED(idx);
+  on_InputChanged("");
+}
+
 void CSetupDialog::on_InputChanged(const QString &text)
 {
   Q_UNUSED(text);
   int proto = comboBoxProtocol->currentData().toInt();
-  if ((proto >= PROTO_IMAP4) && (proto <= PROTO_IMAPS))
+  bool imap = (proto >= PROTO_IMAP4) && (proto <= PROTO_IMAPS);
+  bool news = (proto == PROTO_NNTP) || (proto == PROTO_NNTPS);
+  labelIMAPMailbox->setText(news ? tr("Groups") : tr("Mailbox"));
+  lineEditIMAPMailbox->setToolTip(
+      news ? tr("Comma separated news groups. The read articles are taken from "
+                "~/.newsrc. In groups not found there, all articles arrived since "
+                "the first check are counted as unread.")
+           : QString());
+  // The mailbox is optional for JMAP, all mailboxes are counted then
+  if (imap || (proto == PROTO_JMAP) || news)
   {
     lineEditIMAPMailbox->setEnabled(true);
   }
@@ -247,6 +372,34 @@ void CSetupDialog::on_InputChanged(const QString &text)
     lineEditIMAPMailbox->setText("");
     lineEditIMAPMailbox->setEnabled(false);
   }
+  bool local = isLocal(proto);
+  if (!imap)
+  {
+    // Tunnels are only supported for IMAP
+    QSignalBlocker b(comboBoxTransport);
+    comboBoxTransport->setCurrentIndex(0);
+  }
+  bool tunnel = comboBoxTransport->currentData().toInt() != TRANSPORT_TCP;
+  // OAuth2 is supported by IMAP and POP3 over TCP
+  bool oauthable = (proto >= PROTO_POP3) && (proto <= PROTO_IMAPS) && !tunnel;
+  if (!oauthable)
+  {
+    QSignalBlocker b(comboBoxAuth);
+    comboBoxAuth->setCurrentIndex(0);
+  }
+  bool oauth = comboBoxAuth->currentData().toInt() == AUTH_OAUTH2;
+  comboBoxAuth->setEnabled(oauthable);
+  lineEditTokenUrl->setEnabled(oauth);
+  lineEditClientId->setEnabled(oauth);
+  lineEditClientSecret->setEnabled(oauth);
+  labelPassword->setText(oauth ? tr("Refresh token") : tr("Password"));
+  labelServer->setText(local ? tr("Path") : tr("Server"));
+  comboBoxTransport->setEnabled(imap);
+  lineEditTunnel->setEnabled(tunnel);
+  lineEditServer->setEnabled(!tunnel);
+  lineEditPort->setEnabled(!tunnel && !local);
+  lineEditUser->setEnabled(!tunnel && !local);
+  lineEditPassword->setEnabled(!tunnel && !local);
   bool ok = inputOk();
   toolButtonServerAdd->setEnabled(ok);
   toolButtonServerDelete->setEnabled(ok);
@@ -35,6 +35,7 @@ private:
   void clear();
   void displayMailBox(const QString mailboxname);
   bool inputOk();
+  static bool isLocal(int proto);
   bool getIcon(QIcon &icon, const IconType &icontype);
   void updateIcon(QToolButton *button, const IconType &icontype);
   void AddResetMenu(QToolButton *toolButton, const IconType &type);
@@ -49,6 +50,8 @@ private slots:
   void on_toolButtonServerDelete_released();
   void on_listWidgetServers_itemSelectionChanged();
   void on_comboBoxProtocol_currentIndexChanged(int idx);
+  void on_comboBoxTransport_currentIndexChanged(int idx);
+  void on_comboBoxAuth_currentIndexChanged(int idx);
   void on_InputChanged(const QString &text);
   void on_Reset(QAction *action);
 };
@@ -0,0 +1,100 @@
+/*
+ * CPowerPolicy.cpp
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Stretch the poll time on battery and when the user is idle.
+ */
+
+#include "CPowerPolicy.h"
+
+#include <QDBusConnection>
+#include <QDBusInterface>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+
+static QString readAttribute(const QString &dir, const QString &name)
+{
+  QFile file(dir + "/" + name);
+  if (!file.open(QIODevice::ReadOnly))
+  {
+    return QString();
+  }
+  return QString::fromLatin1(file.readAll()).trimmed();
+}
+
+bool CPowerPolicy::readOnBattery()
+{
+  QDir dir(POWER_SUPPLY_DIR);
+  bool discharging = false;
+  const QStringList supplies = dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot);
+  for (const QString &supply : supplies)
+  {
+    const QString path = dir.filePath(supply);
+    const QString type = readAttribute(path, "type");
+    if ((type == "Mains") && (readAttribute(path, "online") == "1"))
+    {
+      return false;
+    }
+    if ((type == "Battery") && (readAttribute(path, "status") == "Discharging"))
+    {
+      discharging = true;
+    }
+  }
+  return discharging;
+}
+
+/*
+ * The interface introspects the session when it is created, so it is
+ * created once and only again if logind was not reachable. The policy
+ * is evaluated by the monitor thread only.
+ */
+qint64 CPowerPolicy::readIdleTime()
+{
+  static QDBusInterface *session = nullptr;
+  if ((session == nullptr) || !session->isValid())
+  {
+    delete session;
+    session = new QDBusInterface("org.freedesktop.login1",
+                                 "/org/freedesktop/login1/session/auto",
+                                 "org.freedesktop.login1.Session",
+                                 QDBusConnection::systemBus());
+    session->setTimeout(DBUS_TIMEOUT);
+  }
+  if (!session->isValid() || !session->property("IdleHint").toBool())
+  {
+    return 0;
+  }
+  // IdleSinceHint is in us of CLOCK_REALTIME
+  qint64 since = session->property("IdleSinceHint").toLongLong() / 1000;
+  if (since <= 0)
+  {
+    return 0;
+  }
+  return qMax<qint64>(0, QDateTime::currentMSecsSinceEpoch() - since);
+}
+
+int CPowerPolicy::evaluate(int polltime)
+{
+  int result = polltime;
+  m_OnBattery = readOnBattery();
+  if (m_BatteryPolicy && m_OnBattery)
+  {
+    result *= qMax(1, m_BatteryFactor);
+  }
+  if (m_IdlePolicy && (m_IdleTime > 0) && (readIdleTime() >= m_IdleTime))
+  {
+    result *= IDLE_FACTOR;
+  }
+  if (result != polltime)
+  {
+    qDebug() << "Power policy: poll time " << result << "s battery "
+             << m_OnBattery;
+  }
+  return result;
+}
@@ -0,0 +1,73 @@
+/*
+ * CPowerPolicy.h
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Stretch the poll time on battery and when the user is idle.
+ */
+
+#ifndef SRC_SYSTEM_CPOWERPOLICY_H_
+#define SRC_SYSTEM_CPOWERPOLICY_H_
+
+#include <QString>
+
+class CPowerPolicy
+{
+public:
+  CPowerPolicy() {}
+
+  void setBatteryPolicy(bool enable, int factor)
+  {
+    m_BatteryPolicy = enable;
+    m_BatteryFactor = factor;
+  }
+
+  void setIdlePolicy(bool enable, int minutes)
+  {
+    m_IdlePolicy = enable;
+    m_IdleTime = minutes * 60 * 1000LL;
+  }
+
+  /*
+   * Read the power and idle state and return the poll time in s to use
+   * instead of polltime.
+   */
+  int evaluate(int polltime);
+
+  /*
+   * Result of the last evaluate(). On battery, retries of failed servers
+   * are batched with the regular polls.
+   */
+  bool onBattery() const
+  {
+    return m_OnBattery;
+  }
+
+  /*
+   * True if the system runs on a discharging battery, read from
+   * /sys/class/power_supply
+   */
+  static bool readOnBattery();
+
+  /*
+   * Time in ms since the user is idle as reported by logind, 0 if the
+   * user is active or the idle state is unknown.
+   */
+  static qint64 readIdleTime();
+
+private:
+  bool m_BatteryPolicy = false;
+  int m_BatteryFactor = 1;
+  bool m_IdlePolicy = false;
+  qint64 m_IdleTime = 0;
+  bool m_OnBattery = false;
+
+  inline const static int IDLE_FACTOR = 4;
+  inline const static int DBUS_TIMEOUT = 1000; // ms
+  inline const static QString POWER_SUPPLY_DIR = "/sys/class/power_supply";
+};
+
+#endif /* SRC_SYSTEM_CPOWERPOLICY_H_ */
@@ -0,0 +1,99 @@
+/*
+ * CResumeDetector.cpp
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Detect the resume of the system after suspend.
+ *
+ * The kernel cancels realtime timerfds with TFD_TIMER_CANCEL_ON_SET when
+ * the clock is set and on resume. A resume is told apart from a clock
+ * change by the jump between the boot time clock, which includes the
+ * time of the suspend, and the monotonic clock. No periodic wakeups are
+ * needed.
+ */
+
+#include "CResumeDetector.h"
+
+#include <QDebug>
+#include <errno.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+CResumeDetector::CResumeDetector(QObject *parent) : QObject(parent)
+{
+  m_Offset = bootOffset();
+  m_Fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (m_Fd < 0)
+  {
+    qWarning("Can not create timerfd, resume is not detected");
+    return;
+  }
+  if (!arm())
+  {
+    close(m_Fd);
+    m_Fd = -1;
+    return;
+  }
+  m_Notifier = new QSocketNotifier(m_Fd, QSocketNotifier::Read, this);
+  connect(m_Notifier, &QSocketNotifier::activated, this,
+          &CResumeDetector::clockChanged);
+}
+
+CResumeDetector::~CResumeDetector()
+{
+  delete m_Notifier;
+  if (m_Fd >= 0)
+  {
+    close(m_Fd);
+  }
+}
+
+/*
+ * Arm the timer far in the future, it only fires when it is cancelled
+ */
+bool CResumeDetector::arm()
+{
+  struct itimerspec spec = {};
+  spec.it_value.tv_sec = time(nullptr) + 10L * 365 * 24 * 60 * 60;
+  if (timerfd_settime(m_Fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                      &spec, nullptr) < 0)
+  {
+    qWarning("Can not arm timerfd, resume is not detected");
+    return false;
+  }
+  return true;
+}
+
+qint64 CResumeDetector::bootOffset()
+{
+  struct timespec boot;
+  struct timespec mono;
+  clock_gettime(CLOCK_BOOTTIME, &boot);
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  return (boot.tv_sec - mono.tv_sec) * 1000LL +
+         (boot.tv_nsec - mono.tv_nsec) / 1000000;
+}
+
+void CResumeDetector::clockChanged()
+{
+  uint64_t expirations;
+  if ((read(m_Fd, &expirations, sizeof(expirations)) < 0) &&
+      (errno != ECANCELED) && (errno != EAGAIN))
+  {
+    qWarning("Read from timerfd failed");
+  }
+  arm();
+
+  qint64 offset = bootOffset();
+  qint64 slept = offset - m_Offset;
+  m_Offset = offset;
+  if (slept >= RESUME_THRESHOLD)
+  {
+    qInfo() << "Resume after " << slept / 1000 << "s suspend";
+    emit resumed(slept);
+  }
+}
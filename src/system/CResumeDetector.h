@@ -0,0 +1,46 @@
+/*
+ * CResumeDetector.h
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Detect the resume of the system after suspend.
+ */
+
+#ifndef SRC_SYSTEM_CRESUMEDETECTOR_H_
+#define SRC_SYSTEM_CRESUMEDETECTOR_H_
+
+#include <QObject>
+#include <QSocketNotifier>
+
+class CResumeDetector : public QObject
+{
+  Q_OBJECT
+public:
+  CResumeDetector(QObject *parent = nullptr);
+  virtual ~CResumeDetector();
+
+signals:
+  /*
+   * The system was suspended for slept ms
+   */
+  void resumed(qint64 slept);
+
+private:
+  int m_Fd = -1;
+  QSocketNotifier *m_Notifier = nullptr;
+  qint64 m_Offset = 0;
+
+  bool arm();
+  static qint64 bootOffset();
+
+  // Minimum difference of the boot time and monotonic clock in ms
+  inline const static int RESUME_THRESHOLD = 5 * 1000;
+
+private slots:
+  void clockChanged();
+};
+
+#endif /* SRC_SYSTEM_CRESUMEDETECTOR_H_ */
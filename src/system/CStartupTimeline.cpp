@@ -0,0 +1,24 @@
+/*
+ * CStartupTimeline.cpp
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Log the time of the startup milestones since the process started.
+ */
+
+#include "CStartupTimeline.h"
+
+#include <QDebug>
+
+void CStartupTimeline::mark(const QString &milestone)
+{
+  if (!m_Timer.isValid() || m_Reached.contains(milestone))
+  {
+    return;
+  }
+  m_Reached.insert(milestone);
+  qInfo() << "Startup +" << m_Timer.elapsed() << " ms: " << milestone;
+}
@@ -0,0 +1,45 @@
+/*
+ * CStartupTimeline.h
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Log the time of the startup milestones since the process started.
+ */
+
+#ifndef SRC_SYSTEM_CSTARTUPTIMELINE_H_
+#define SRC_SYSTEM_CSTARTUPTIMELINE_H_
+
+#include <QElapsedTimer>
+#include <QSet>
+#include <QString>
+
+class CStartupTimeline
+{
+public:
+  static void start(void)
+  {
+    m_Timer.start();
+  }
+
+  /*
+   * Log the first time a milestone is reached, later calls are
+   * ignored. Must be called from the main thread.
+   */
+  static void mark(const QString &milestone);
+
+  static qint64 elapsed(void)
+  {
+    return m_Timer.isValid() ? m_Timer.elapsed() : 0;
+  }
+
+private:
+  CStartupTimeline() {}
+
+  inline static QElapsedTimer m_Timer;
+  inline static QSet<QString> m_Reached;
+};
+
+#endif /* SRC_SYSTEM_CSTARTUPTIMELINE_H_ */
@@ -0,0 +1,94 @@
+/*
+ * CStateSnapshot.cpp
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Last known state of the mailboxes, shown at start until the first
+ * polls are finished.
+ *
+ * The snapshot is a small binary file in the cache directory: magic,
+ * version, number of mailboxes and per mailbox name, counts, time of
+ * the last result and last error.
+ */
+
+#include "CStateSnapshot.h"
+
+#include <QDataStream>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include "protocols/CMailMonitor.h"
+
+QString CStateSnapshot::fileName(void)
+{
+  return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/state.bin";
+}
+
+bool CStateSnapshot::load(void)
+{
+  m_Entries.clear();
+  QFile file(fileName());
+  if (!file.open(QIODevice::ReadOnly))
+  {
+    return false;
+  }
+  const QByteArray buffer = file.readAll();
+  QDataStream in(buffer);
+  in.setVersion(QDataStream::Qt_6_0);
+  quint32 magic = 0;
+  quint16 version = 0;
+  quint32 count = 0;
+  in >> magic >> version >> count;
+  if ((magic != MAGIC) || (version != VERSION))
+  {
+    qWarning() << "Invalid state snapshot " << file.fileName();
+    return false;
+  }
+  m_Entries.reserve(count);
+  for (quint32 i = 0; (i < count) && (in.status() == QDataStream::Ok); i++)
+  {
+    QString name;
+    SEntry entry;
+    in >> name >> entry.m_Unread >> entry.m_Read >> entry.m_Updated >> entry.m_Error;
+    m_Entries.insert(name, entry);
+  }
+  if (in.status() != QDataStream::Ok)
+  {
+    qWarning() << "Truncated state snapshot " << file.fileName();
+    m_Entries.clear();
+    return false;
+  }
+  return true;
+}
+
+bool CStateSnapshot::save(const QVector<SMailState> &data)
+{
+  QByteArray buffer;
+  QDataStream out(&buffer, QIODevice::WriteOnly);
+  out.setVersion(QDataStream::Qt_6_0);
+  out << MAGIC << VERSION << static_cast<quint32>(data.size());
+  for (const SMailState &mailbox : data)
+  {
+    out << mailbox.m_MailboxName << static_cast<qint32>(mailbox.m_Unread)
+        << static_cast<qint32>(mailbox.m_Read) << mailbox.m_Updated
+        << mailbox.m_LastError;
+  }
+
+  const QString name = fileName();
+  QDir().mkpath(QFileInfo(name).path());
+  QSaveFile file(name);
+  if (!file.open(QIODevice::WriteOnly) || (file.write(buffer) != buffer.size()) ||
+      !file.commit())
+  {
+    qWarning() << "Can not write state snapshot " << name << ": " << file.errorString();
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,60 @@
+/*
+ * CStateSnapshot.h
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Last known state of the mailboxes, shown at start until the first
+ * polls are finished.
+ */
+
+#ifndef SRC_SYSTEM_CSTATESNAPSHOT_H_
+#define SRC_SYSTEM_CSTATESNAPSHOT_H_
+
+#include <QDateTime>
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+struct SMailState;
+
+class CStateSnapshot
+{
+public:
+  struct SEntry
+  {
+    qint32 m_Unread = -1;
+    qint32 m_Read = -1;
+    QDateTime m_Updated;
+    QString m_Error; // Last error, empty if the last poll succeeded
+  };
+
+  /*
+   * Read the snapshot file in one pass. Returns false if there is no
+   * valid snapshot.
+   */
+  bool load(void);
+
+  /*
+   * Write the state of all mailboxes. The file is replaced atomically,
+   * a crash leaves the previous snapshot.
+   */
+  static bool save(const QVector<SMailState> &data);
+
+  const QHash<QString, SEntry> &getEntries(void) const
+  {
+    return m_Entries;
+  }
+
+private:
+  static QString fileName(void);
+
+  QHash<QString, SEntry> m_Entries;
+
+  inline const static quint32 MAGIC = 0x54425353; // "TBSS"
+  inline const static quint16 VERSION = 1;
+};
+
+#endif /* SRC_SYSTEM_CSTATESNAPSHOT_H_ */
@@ -0,0 +1,474 @@
+/*
+ * CSyncStore.cpp
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Synchronization state of the mailboxes, kept across restarts.
+ *
+ * The store is one binary file in the cache directory, which is memory
+ * mapped and never changed in place:
+ *
+ *   header   magic, version, number of slots, file size
+ *   slots    hash of the key, offset and size of the record, sorted
+ *            by the hash
+ *   records  key, then tag, length and value of each field
+ *
+ * Opening the file only maps it, a lookup is a binary search in the
+ * slots. Numbers are little endian in the header and slots and
+ * variable length integers in the records. Unknown tags are skipped.
+ * Changed states are collected and written to a new file, which
+ * replaces the old one by a rename.
+ */
+
+#include "CSyncStore.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QtEndian>
+#include <algorithm>
+#include <string.h>
+
+/*
+ * FNV-1a, stable across processes unlike qHash
+ */
+static quint64 fnv1a(const QByteArray &data)
+{
+  quint64 hash = 0xcbf29ce484222325ULL;
+  for (char c : data)
+  {
+    hash ^= static_cast<uchar>(c);
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static void writeVarint(QByteArray &out, quint64 value)
+{
+  while (value >= 0x80)
+  {
+    out.append(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out.append(static_cast<char>(value));
+}
+
+static bool readVarint(const QByteArray &in, qsizetype &pos, quint64 &value)
+{
+  value = 0;
+  for (int shift = 0; (shift < 64) && (pos < in.size()); shift += 7)
+  {
+    uchar c = static_cast<uchar>(in.at(pos++));
+    value |= static_cast<quint64>(c & 0x7f) << shift;
+    if ((c & 0x80) == 0)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void writeField(QByteArray &out, int tag, const QByteArray &value)
+{
+  out.append(static_cast<char>(tag));
+  writeVarint(out, value.size());
+  out.append(value);
+}
+
+static void writeField(QByteArray &out, int tag, quint64 value)
+{
+  QByteArray data;
+  writeVarint(data, value);
+  writeField(out, tag, data);
+}
+
+CSyncStore::CSyncStore()
+{
+  open();
+}
+
+CSyncStore::~CSyncStore()
+{
+  close();
+}
+
+QString CSyncStore::fileName(void)
+{
+  return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/syncstate.bin";
+}
+
+quint64 CSyncStore::keyHash(const QByteArray &key)
+{
+  return fnv1a(key);
+}
+
+/*
+ * Map the file and check the header. m_Mutex must be locked or the
+ * store not yet shared.
+ */
+bool CSyncStore::open(void)
+{
+  QElapsedTimer timer;
+  timer.start();
+  m_File.setFileName(fileName());
+  if (!m_File.open(QIODevice::ReadOnly))
+  {
+    return false;
+  }
+  qint64 size = m_File.size();
+  uchar *map = (size >= HEADER_SIZE) ? m_File.map(0, size) : nullptr;
+  if (map == nullptr)
+  {
+    m_File.close();
+    return false;
+  }
+  quint32 magic = qFromLittleEndian<quint32>(map);
+  quint16 version = qFromLittleEndian<quint16>(map + 4);
+  quint32 count = qFromLittleEndian<quint32>(map + 8);
+  quint32 filesize = qFromLittleEndian<quint32>(map + 12);
+  if ((magic != MAGIC) || (version != VERSION) || (filesize != size) ||
+      (HEADER_SIZE + static_cast<qint64>(count) * SLOT_SIZE > size))
+  {
+    qWarning() << "Invalid sync state " << m_File.fileName();
+    m_File.unmap(map);
+    m_File.close();
+    return false;
+  }
+  m_Map = map;
+  m_MapSize = size;
+  m_Count = count;
+  qDebug() << "Sync state of " << count << " mailboxes mapped in "
+           << timer.nsecsElapsed() / 1000 << " us";
+  return true;
+}
+
+void CSyncStore::close(void)
+{
+  if (m_Map != nullptr)
+  {
+    m_File.unmap(const_cast<uchar *>(m_Map));
+  }
+  m_File.close();
+  m_Map = nullptr;
+  m_MapSize = 0;
+  m_Count = 0;
+}
+
+/*
+ * Binary search of the key in the mapped file. m_Mutex must be locked.
+ */
+bool CSyncStore::findRecord(const QString &key, QByteArray &record) const
+{
+  const QByteArray name = key.toUtf8();
+  const quint64 hash = keyHash(name);
+  const uchar *slots = m_Map + HEADER_SIZE;
+  quint32 low = 0;
+  quint32 high = m_Count;
+  while (low < high)
+  {
+    quint32 mid = low + (high - low) / 2;
+    if (qFromLittleEndian<quint64>(slots + mid * SLOT_SIZE) < hash)
+    {
+      low = mid + 1;
+    }
+    else
+    {
+      high = mid;
+    }
+  }
+  // Equal hashes are adjacent
+  for (quint32 i = low; (i < m_Count) && (qFromLittleEndian<quint64>(slots + i * SLOT_SIZE) == hash); i++)
+  {
+    quint32 offset = qFromLittleEndian<quint32>(slots + i * SLOT_SIZE + 8);
+    quint32 size = qFromLittleEndian<quint32>(slots + i * SLOT_SIZE + 12);
+    if (static_cast<qint64>(offset) + size > m_MapSize)
+    {
+      qWarning() << "Sync state record out of range";
+      return false;
+    }
+    // fromRawData would keep a pointer into the map, which is unmapped
+    // by the next commit
+    QByteArray data(reinterpret_cast<const char *>(m_Map + offset), size);
+    QByteArray stored;
+    SState state;
+    if (decodeRecord(data, stored, state) && (stored == name))
+    {
+      record = data;
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Number of groups, then per group the length of the name, the name
+ * and the mark. Sorted by name, so an unchanged state gives the same
+ * record.
+ */
+QByteArray CSyncStore::encodeMarks(const QHash<QString, qint64> &marks)
+{
+  QStringList names = marks.keys();
+  names.sort();
+  QByteArray out;
+  writeVarint(out, names.size());
+  for (const QString &name : std::as_const(names))
+  {
+    const QByteArray utf8 = name.toUtf8();
+    writeVarint(out, utf8.size());
+    out.append(utf8);
+    writeVarint(out, static_cast<quint64>(qMax<qint64>(0, marks.value(name))));
+  }
+  return out;
+}
+
+bool CSyncStore::decodeMarks(const QByteArray &data, QHash<QString, qint64> &marks)
+{
+  qsizetype pos = 0;
+  quint64 count;
+  if (!readVarint(data, pos, count))
+  {
+    return false;
+  }
+  marks.clear();
+  for (quint64 i = 0; i < count; i++)
+  {
+    quint64 length;
+    quint64 mark;
+    if (!readVarint(data, pos, length) || (length > static_cast<quint64>(data.size() - pos)))
+    {
+      return false;
+    }
+    const QString name = QString::fromUtf8(data.mid(pos, length));
+    pos += length;
+    if (!readVarint(data, pos, mark))
+    {
+      return false;
+    }
+    marks.insert(name, static_cast<qint64>(mark));
+  }
+  return true;
+}
+
+QByteArray CSyncStore::encodeRecord(const QByteArray &key, const SState &state)
+{
+  QByteArray out;
+  writeVarint(out, key.size());
+  out.append(key);
+  if (state.m_UidValidity != 0)
+  {
+    writeField(out, tgUidValidity, state.m_UidValidity);
+    writeField(out, tgUidNext, state.m_UidNext);
+  }
+  if (state.m_ModSeq != 0)
+  {
+    writeField(out, tgModSeq, state.m_ModSeq);
+  }
+  // -1 for unknown is stored as 0
+  writeField(out, tgUnread, static_cast<quint64>(qMax(-1, state.m_Unread) + 1));
+  writeField(out, tgRead, static_cast<quint64>(qMax(-1, state.m_Read) + 1));
+  if (!state.m_Checkpoint.isEmpty())
+  {
+    writeField(out, tgCheckpoint, state.m_Checkpoint);
+  }
+  if (!state.m_Capabilities.isEmpty())
+  {
+    writeField(out, tgCapabilities, state.m_Capabilities.join(' ').toUtf8());
+  }
+  if (!state.m_Marks.isEmpty())
+  {
+    writeField(out, tgMarks, encodeMarks(state.m_Marks));
+  }
+  return out;
+}
+
+bool CSyncStore::decodeRecord(const QByteArray &record, QByteArray &key, SState &state)
+{
+  qsizetype pos = 0;
+  quint64 length;
+  if (!readVarint(record, pos, length) || (length > static_cast<quint64>(record.size() - pos)))
+  {
+    return false;
+  }
+  key = record.mid(pos, length);
+  pos += length;
+  state = SState();
+  while (pos < record.size())
+  {
+    int tag = static_cast<uchar>(record.at(pos++));
+    if (!readVarint(record, pos, length) || (length > static_cast<quint64>(record.size() - pos)))
+    {
+      return false;
+    }
+    const QByteArray value = record.mid(pos, length);
+    pos += length;
+    qsizetype vpos = 0;
+    quint64 number = 0;
+    switch (tag)
+    {
+    case tgUidValidity:
+      readVarint(value, vpos, number);
+      state.m_UidValidity = number;
+      break;
+    case tgUidNext:
+      readVarint(value, vpos, number);
+      state.m_UidNext = number;
+      break;
+    case tgModSeq:
+      readVarint(value, vpos, number);
+      state.m_ModSeq = number;
+      break;
+    case tgUnread:
+      readVarint(value, vpos, number);
+      state.m_Unread = static_cast<qint32>(number) - 1;
+      break;
+    case tgRead:
+      readVarint(value, vpos, number);
+      state.m_Read = static_cast<qint32>(number) - 1;
+      break;
+    case tgCheckpoint:
+      state.m_Checkpoint = value;
+      break;
+    case tgCapabilities:
+      state.m_Capabilities = QString::fromUtf8(value).split(' ', Qt::SkipEmptyParts);
+      break;
+    case tgMarks:
+      if (!decodeMarks(value, state.m_Marks))
+      {
+        return false;
+      }
+      break;
+    default:
+      break; // Written by a newer version
+    }
+  }
+  return true;
+}
+
+bool CSyncStore::get(const QString &key, SState &state)
+{
+  QByteArray record;
+  {
+    QMutexLocker lock(&m_Mutex);
+    if (m_Removed.contains(key))
+    {
+      return false;
+    }
+    auto pending = m_Pending.constFind(key);
+    if (pending != m_Pending.constEnd())
+    {
+      record = pending.value();
+    }
+    else if ((m_Map == nullptr) || !findRecord(key, record))
+    {
+      return false;
+    }
+  }
+  QByteArray stored;
+  return decodeRecord(record, stored, state);
+}
+
+void CSyncStore::put(const QString &key, const SState &state)
+{
+  const QByteArray record = encodeRecord(key.toUtf8(), state);
+  QMutexLocker lock(&m_Mutex);
+  m_Removed.remove(key);
+  m_Pending.insert(key, record);
+}
+
+void CSyncStore::remove(const QString &key)
+{
+  QMutexLocker lock(&m_Mutex);
+  m_Pending.remove(key);
+  m_Removed.insert(key);
+}
+
+bool CSyncStore::commit(void)
+{
+  QMutexLocker lock(&m_Mutex);
+  if (m_Pending.isEmpty() && m_Removed.isEmpty())
+  {
+    return true;
+  }
+  QElapsedTimer timer;
+  timer.start();
+
+  // Unchanged records are copied from the map without decoding
+  QVector<QPair<quint64, QByteArray>> records;
+  records.reserve(m_Count + m_Pending.size());
+  const uchar *slots = (m_Map != nullptr) ? m_Map + HEADER_SIZE : nullptr;
+  for (quint32 i = 0; i < m_Count; i++)
+  {
+    quint64 hash = qFromLittleEndian<quint64>(slots + i * SLOT_SIZE);
+    quint32 offset = qFromLittleEndian<quint32>(slots + i * SLOT_SIZE + 8);
+    quint32 size = qFromLittleEndian<quint32>(slots + i * SLOT_SIZE + 12);
+    if (static_cast<qint64>(offset) + size > m_MapSize)
+    {
+      continue;
+    }
+    QByteArray record(reinterpret_cast<const char *>(m_Map + offset), size);
+    qsizetype pos = 0;
+    quint64 length;
+    if (!readVarint(record, pos, length) || (length > static_cast<quint64>(record.size() - pos)))
+    {
+      continue;
+    }
+    const QString key = QString::fromUtf8(record.mid(pos, length));
+    if (!m_Pending.contains(key) && !m_Removed.contains(key))
+    {
+      records.append(qMakePair(hash, record));
+    }
+  }
+  for (auto it = m_Pending.cbegin(); it != m_Pending.cend(); ++it)
+  {
+    records.append(qMakePair(keyHash(it.key().toUtf8()), it.value()));
+  }
+  std::sort(records.begin(), records.end(),
+            [](const QPair<quint64, QByteArray> &a, const QPair<quint64, QByteArray> &b)
+            { return a.first < b.first; });
+
+  qint64 offset = HEADER_SIZE + static_cast<qint64>(records.size()) * SLOT_SIZE;
+  QByteArray buffer(offset, '\0');
+  uchar *out = reinterpret_cast<uchar *>(buffer.data());
+  qToLittleEndian<quint32>(MAGIC, out);
+  qToLittleEndian<quint16>(VERSION, out + 4);
+  qToLittleEndian<quint16>(0, out + 6);
+  qToLittleEndian<quint32>(records.size(), out + 8);
+  for (qsizetype i = 0; i < records.size(); i++)
+  {
+    uchar *slot = out + HEADER_SIZE + i * SLOT_SIZE;
+    qToLittleEndian<quint64>(records[i].first, slot);
+    qToLittleEndian<quint32>(offset, slot + 8);
+    qToLittleEndian<quint32>(records[i].second.size(), slot + 12);
+    offset += records[i].second.size();
+  }
+  qToLittleEndian<quint32>(offset, out + 12);
+  buffer.reserve(offset);
+  for (const auto &record : std::as_const(records))
+  {
+    buffer.append(record.second);
+  }
+
+  const QString name = fileName();
+  QDir().mkpath(QFileInfo(name).path());
+  QSaveFile file(name);
+  if (!file.open(QIODevice::WriteOnly) || (file.write(buffer) != buffer.size()) ||
+      !file.commit())
+  {
+    qWarning() << "Can not write sync state " << name << ": " << file.errorString();
+    return false;
+  }
+  m_Pending.clear();
+  m_Removed.clear();
+  close();
+  open();
+  qDebug() << "Sync state of " << records.size() << " mailboxes written in "
+           << timer.elapsed() << " ms";
+  return true;
+}
@@ -0,0 +1,107 @@
+/*
+ * CSyncStore.h
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Synchronization state of the mailboxes, kept across restarts.
+ */
+
+#ifndef SRC_SYSTEM_CSYNCSTORE_H_
+#define SRC_SYSTEM_CSYNCSTORE_H_
+
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QPair>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+class CSyncStore
+{
+public:
+  struct SState
+  {
+    // IMAP, RFC 3501 and CONDSTORE (RFC 7162)
+    quint32 m_UidValidity = 0;
+    quint32 m_UidNext = 0;
+    quint64 m_ModSeq = 0;
+    // Counts belonging to the state above
+    qint32 m_Unread = -1;
+    qint32 m_Read = -1;
+    QByteArray m_Checkpoint; // Scan position of Maildir and mbox
+    QStringList m_Capabilities;
+    QHash<QString, qint64> m_Marks; // NNTP, last read article per group
+  };
+
+  static CSyncStore &instance()
+  {
+    static CSyncStore instance;
+    return instance;
+  }
+
+  /*
+   * State of a mailbox, the key is built by the protocol from the
+   * server, user and folder. May be called from any thread.
+   */
+  bool get(const QString &key, SState &state);
+  void put(const QString &key, const SState &state);
+  void remove(const QString &key);
+
+  /*
+   * Write the changed states. The file is written to a temporary file
+   * and renamed, readers which mapped the old file keep reading it.
+   */
+  bool commit(void);
+
+private:
+  CSyncStore();
+  ~CSyncStore();
+  CSyncStore(const CSyncStore &);
+  CSyncStore &operator=(const CSyncStore &);
+
+  bool open(void);
+  void close(void);
+  bool findRecord(const QString &key, QByteArray &record) const;
+  static QString fileName(void);
+  static quint64 keyHash(const QByteArray &key);
+  static QByteArray encodeRecord(const QByteArray &key, const SState &state);
+  static bool decodeRecord(const QByteArray &record, QByteArray &key, SState &state);
+  static QByteArray encodeMarks(const QHash<QString, qint64> &marks);
+  static bool decodeMarks(const QByteArray &data, QHash<QString, qint64> &marks);
+
+  QMutex m_Mutex;
+  QFile m_File;
+  const uchar *m_Map = nullptr;
+  qint64 m_MapSize = 0;
+  quint32 m_Count = 0;
+  QHash<QString, QByteArray> m_Pending; // Records to write
+  QSet<QString> m_Removed;
+
+  enum Tag
+  {
+    tgUidValidity = 1,
+    tgUidNext,
+    tgModSeq,
+    tgUnread,
+    tgRead,
+    tgCheckpoint = 7, // 6 was a set of POP3 UIDLs, which was never written
+    tgCapabilities,
+    tgMarks
+  };
+
+  inline const static quint32 MAGIC = 0x59534254; // "TBSY"
+  inline const static quint16 VERSION = 1;
+  // Header: magic, version, reserved (16 bit), number of slots, file size
+  inline const static int HEADER_SIZE = 16;
+  // Slot: hash of the key (64 bit), offset and size of the record,
+  // sorted by the hash
+  inline const static int SLOT_SIZE = 16;
+};
+
+#endif /* SRC_SYSTEM_CSYNCSTORE_H_ */
@@ -30,11 +30,23 @@ CTrayMenu::CTrayMenu(QApplication &app)
   m_TrayMenu.addAction(&setupAct);
   m_TrayMenu.addSeparator();
 
+  checkAct.setText(tr("Check now"));
+  checkAct.setStatusTip(tr("Check all mailboxes now"));
+  connect(&checkAct, &QAction::triggered, this, &CTrayMenu::check);
+  m_TrayMenu.addAction(&checkAct);
+
+  m_MailboxMenu.setTitle(tr("Mailboxes"));
+  m_TrayMenu.addMenu(&m_MailboxMenu);
+  m_TrayMenu.addSeparator();
+
   quitAct.setText(tr("Quit"));
   quitAct.setShortcuts(QKeySequence::Quit);
   quitAct.setStatusTip(tr("Quit"));
   connect(&quitAct, &QAction::triggered, this, &CTrayMenu::quit);
   m_TrayMenu.addAction(&quitAct);
+
+  connect(&m_TrayMenu, &QMenu::aboutToShow, this, [this]()
+          { m_CMailApp->refreshStale(); });
 }
 
 // mail-unread mail-read network-offline
@@ -45,6 +57,8 @@ void CTrayMenu::show(QIcon icon, const QString &msg)
   {
     m_TrayIcon = new QSystemTrayIcon(icon);
     m_TrayIcon->setContextMenu(&m_TrayMenu);
+    connect(m_TrayIcon, &QSystemTrayIcon::activated, this,
+            &CTrayMenu::activated);
   }
   else
   {
@@ -55,6 +69,31 @@ void CTrayMenu::show(QIcon icon, const QString &msg)
   m_TrayIcon->show();
 }
 
+void CTrayMenu::setMailboxes(const QVector<QString> &mailboxes)
+{
+  m_MailboxMenu.clear();
+  qDeleteAll(m_MailboxSubMenus);
+  m_MailboxSubMenus.clear();
+
+  for (const QString &name : mailboxes)
+  {
+    QMenu *sub = new QMenu(name, &m_MailboxMenu);
+    m_MailboxSubMenus.append(sub);
+    m_MailboxMenu.addMenu(sub);
+
+    QAction *checkone = sub->addAction(tr("Check now"));
+    connect(checkone, &QAction::triggered, this, [this, name]()
+            { m_CMailApp->checkMailbox(name); });
+
+    QAction *pause = sub->addAction(tr("Pause"));
+    pause->setCheckable(true);
+    pause->setChecked(m_CMailApp != nullptr && m_CMailApp->isPaused(name));
+    connect(pause, &QAction::toggled, this, [this, name](bool checked)
+            { m_CMailApp->pauseMailbox(name, checked); });
+  }
+  m_MailboxMenu.setEnabled(!mailboxes.isEmpty());
+}
+
 void CTrayMenu::about()
 {
   CAbout dlg(nullptr);
@@ -68,6 +107,21 @@ void CTrayMenu::setup()
   emit m_CMailApp->reloadConfig();
 }
 
+void CTrayMenu::check()
+{
+  m_CMailApp->checkNow();
+}
+
+/*
+ * Refresh stale counts before the user reads them, the tooltip is
+ * updated when the results arrive.
+ */
+void CTrayMenu::activated(QSystemTrayIcon::ActivationReason reason)
+{
+  qDebug() << "Tray activated " << reason;
+  m_CMailApp->refreshStale();
+}
+
 void CTrayMenu::quit()
 {
   qDebug() << "Quit";
@@ -16,6 +16,7 @@
 #include <QMenu>
 #include <QSystemTrayIcon>
 #include <QDebug>
+#include <QVector>
 
 class CMailApp;
 
@@ -32,6 +33,11 @@ public:
     m_CMailApp = ca;
   }
 
+  /*
+   * Rebuild the per mailbox submenu
+   */
+  void setMailboxes(const QVector<QString> &mailboxes);
+
 private:
   QMenu m_TrayMenu;
   QSystemTrayIcon *m_TrayIcon;
@@ -40,11 +46,16 @@ private:
 
   QAction aboutAct;
   QAction setupAct;
+  QAction checkAct;
   QAction quitAct;
+  QMenu m_MailboxMenu;
+  QList<QMenu *> m_MailboxSubMenus;
 
 private slots:
   void about();
   void setup();
+  void check();
+  void activated(QSystemTrayIcon::ActivationReason reason);
   void quit();
 };
 
@@ -14,11 +14,65 @@
 #include "CMailApp.h"
 #include "traybiff.h"
 #include "setup/CSetupDialog.h"
+#include "system/CStartupTimeline.h"
 #include <stdlib.h>
 #include <fcntl.h>
 
 using namespace std;
 
+static const qint64 FIRST_ICON_BUDGET = 100; // ms
+static const int KEYCHAIN_TIMEOUT = 60 * 1000; // ms
+
+void setApplicationNames(QCoreApplication &app, const QString &altConfig)
+{
+  app.setApplicationName("TrayBiff");
+  app.setApplicationVersion(VER_STR);
+  app.setOrganizationName("uli-eckhardt");
+  app.setOrganizationDomain("uli-eckhardt.de");
+  if (!altConfig.isEmpty())
+  {
+    app.setApplicationName(altConfig);
+  }
+}
+
+/*
+ * Import and export of the mailbox definitions without the GUI
+ */
+int provisionAccounts(const QString &importFile, const QString &exportFile)
+{
+  CConfig &cfg = CConfig::instance();
+  if (!importFile.isEmpty())
+  {
+    QStringList errors;
+    int count = cfg.importAccounts(importFile, errors);
+    for (const QString &error : errors)
+    {
+      cerr << qPrintable(error) << endl;
+    }
+    if (count < 0)
+    {
+      return 1;
+    }
+    cfg.save();
+    if (!cfg.waitForKeyChain(KEYCHAIN_TIMEOUT))
+    {
+      cerr << "Not all passwords were stored in the keychain" << endl;
+      return 1;
+    }
+    cout << count << " mailboxes imported" << endl;
+  }
+  if (!exportFile.isEmpty())
+  {
+    QString error;
+    if (!cfg.exportAccounts(exportFile, error))
+    {
+      cerr << qPrintable(exportFile) << ": " << qPrintable(error) << endl;
+      return 1;
+    }
+  }
+  return 0;
+}
+
 void logMsg(QtMsgType type, const QMessageLogContext &context, const QString &msg)
 {
   QByteArray localMsg = msg.toLocal8Bit();
@@ -71,9 +125,32 @@ int main(int argc, char **argv)
       QStringList() << "d" << "debug",
       QCoreApplication::translate("main", "Debug protocol."));
   parser.addOption(dbg);
+  const QCommandLineOption importOpt(
+      QStringList() << "import",
+      QCoreApplication::translate("main", "Import mailboxes from a CSV or JSON file and exit."),
+      QCoreApplication::translate("main", "file"));
+  parser.addOption(importOpt);
+  const QCommandLineOption exportOpt(
+      QStringList() << "export",
+      QCoreApplication::translate("main", "Export the mailboxes to a CSV or JSON file and exit."),
+      QCoreApplication::translate("main", "file"));
+  parser.addOption(exportOpt);
   parser.addVersionOption();
   parser.setApplicationDescription(QObject::tr("TrayBiff mail monitor"));
 
+  QStringList arguments;
+  for (int i = 0; i < argc; i++)
+  {
+    arguments << QString::fromLocal8Bit(argv[i]);
+  }
+  parser.parse(arguments);
+  if (parser.isSet(importOpt) || parser.isSet(exportOpt))
+  {
+    QCoreApplication app(argc, argv);
+    setApplicationNames(app, parser.value(altconfig));
+    return provisionAccounts(parser.value(importOpt), parser.value(exportOpt));
+  }
+
   if (!parser.isSet(dbg))
   {
     pid_t pid;
@@ -96,20 +173,17 @@ int main(int argc, char **argv)
     }
   }
   qInfo("Start tray menu");
+  CStartupTimeline::start();
 
   QApplication qAppli(argc, argv);
   qAppli.setQuitOnLastWindowClosed(false);
-  qAppli.setApplicationName("TrayBiff");
-  qAppli.setApplicationVersion(VER_STR);
-  qAppli.setOrganizationName("uli-eckhardt");
-  qAppli.setOrganizationDomain("uli-eckhardt.de");
+  setApplicationNames(qAppli, QString());
   parser.process(qAppli);
-  QString altConfigStr = parser.value(altconfig);
-  if (!altConfigStr.isEmpty())
-  {
-    qAppli.setApplicationName(altConfigStr);
-  }
-  if (!CConfig::instance().isConfigured())
+  setApplicationNames(qAppli, parser.value(altconfig));
+  CStartupTimeline::mark("Application");
+  bool configured = CConfig::instance().isConfigured();
+  CStartupTimeline::mark("Configuration");
+  if (!configured)
   {
     CSetupDialog setup(nullptr);
     setup.exec();
@@ -122,6 +196,12 @@ int main(int argc, char **argv)
 
   CMailApp mailappl(menu, parser.isSet(dbg));
   menu.setApp(&mailappl);
+  // The icon shows the restored snapshot now
+  CStartupTimeline::mark("First icon");
+  if (CStartupTimeline::elapsed() > FIRST_ICON_BUDGET)
+  {
+    qWarning() << "Startup exceeded " << FIRST_ICON_BUDGET << " ms";
+  }
   int ret = qAppli.exec();
 
   qDebug() << "quit traybiff " << ret;
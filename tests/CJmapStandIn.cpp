@@ -0,0 +1,268 @@
+/*
+ * CJmapStandIn.cpp
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Minimal JMAP server on the loopback interface to test the JMAP
+ * backend offline.
+ *
+ * HTTP/1.1 with Content-Length only, persistent connections, no
+ * authentication. The mailbox state is a counter, Mailbox/changes
+ * returns the mailboxes changed after the given state. Result
+ * references ("#ids") are resolved for the paths /created and
+ * /updated.
+ */
+
+#include "CJmapStandIn.h"
+
+#include <QHostAddress>
+#include <QJsonDocument>
+
+static const QString CAP_CORE = "urn:ietf:params:jmap:core";
+static const QString CAP_MAIL = "urn:ietf:params:jmap:mail";
+
+CJmapStandIn::CJmapStandIn(QObject *parent) : QObject(parent)
+{
+  connect(&m_Server, &QTcpServer::newConnection, this, &CJmapStandIn::newConnection);
+}
+
+bool CJmapStandIn::listen(void)
+{
+  return m_Server.listen(QHostAddress::LocalHost, 0);
+}
+
+QString CJmapStandIn::url(void) const
+{
+  return QString("http://127.0.0.1:%1").arg(m_Server.serverPort());
+}
+
+void CJmapStandIn::addMailbox(const QString &id, const QString &name,
+                              const QString &role, int total, int unread)
+{
+  m_Mailboxes.insert(id, SMailbox{name, role, total, unread, m_State});
+}
+
+void CJmapStandIn::setCounts(const QString &id, int total, int unread)
+{
+  SMailbox &mb = m_Mailboxes[id];
+  mb.m_Total = total;
+  mb.m_Unread = unread;
+  mb.m_Changed = ++m_State;
+
+  QJsonObject change{{"@type", "StateChange"},
+                     {"changed", QJsonObject{{ACCOUNT, QJsonObject{{"Mailbox", QString::number(m_State)}}}}}};
+  QByteArray event = "event: state\r\ndata: " +
+                     QJsonDocument(change).toJson(QJsonDocument::Compact) + "\r\n\r\n";
+  for (QTcpSocket *socket : std::as_const(m_Events))
+  {
+    socket->write(event);
+  }
+}
+
+void CJmapStandIn::newConnection(void)
+{
+  while (QTcpSocket *socket = m_Server.nextPendingConnection())
+  {
+    m_Buffers.insert(socket, QByteArray());
+    connect(socket, &QTcpSocket::readyRead, this, &CJmapStandIn::readClient);
+    connect(socket, &QTcpSocket::disconnected, this, &CJmapStandIn::clientDisconnected);
+  }
+}
+
+void CJmapStandIn::clientDisconnected(void)
+{
+  auto *socket = qobject_cast<QTcpSocket *>(sender());
+  m_Buffers.remove(socket);
+  m_Events.removeAll(socket);
+  socket->deleteLater();
+}
+
+void CJmapStandIn::readClient(void)
+{
+  auto *socket = qobject_cast<QTcpSocket *>(sender());
+  QByteArray &buffer = m_Buffers[socket];
+  buffer += socket->readAll();
+  qsizetype end;
+  while ((end = buffer.indexOf("\r\n\r\n")) >= 0)
+  {
+    const QList<QByteArray> lines = buffer.left(end).split('\n');
+    const QList<QByteArray> request = lines.at(0).trimmed().split(' ');
+    qsizetype length = 0;
+    for (const QByteArray &line : lines)
+    {
+      if (line.toLower().startsWith("content-length:"))
+      {
+        length = line.mid(15).trimmed().toLongLong();
+      }
+    }
+    if (buffer.size() < end + 4 + length)
+    {
+      return; // Body not complete
+    }
+    const QByteArray body = buffer.mid(end + 4, length);
+    buffer.remove(0, end + 4 + length);
+    if (request.size() < 2)
+    {
+      reply(socket, 400, QByteArray());
+      continue;
+    }
+    handleRequest(socket, request.at(0), request.at(1), body);
+  }
+}
+
+void CJmapStandIn::reply(QTcpSocket *socket, int status, const QByteArray &body)
+{
+  QByteArray response = "HTTP/1.1 " + QByteArray::number(status) +
+                        ((status == 200) ? " OK" : " Error") + "\r\n" +
+                        "Content-Type: application/json\r\n" +
+                        "Content-Length: " + QByteArray::number(body.size()) +
+                        "\r\n\r\n" + body;
+  socket->write(response);
+}
+
+void CJmapStandIn::handleRequest(QTcpSocket *socket, const QByteArray &method,
+                                 const QByteArray &path, const QByteArray &body)
+{
+  if ((method == "GET") && (path == "/.well-known/jmap"))
+  {
+    reply(socket, 200, QJsonDocument(session()).toJson(QJsonDocument::Compact));
+  }
+  else if ((method == "GET") && path.startsWith("/events"))
+  {
+    // The channel stays open, the body ends with the connection
+    socket->write("HTTP/1.1 200 OK\r\n"
+                  "Content-Type: text/event-stream\r\n"
+                  "Cache-Control: no-cache\r\n"
+                  "Connection: close\r\n\r\n");
+    m_Buffers.remove(socket);
+    m_Events.append(socket);
+  }
+  else if ((method == "POST") && (path == "/api"))
+  {
+    const QJsonArray calls = QJsonDocument::fromJson(body).object()["methodCalls"].toArray();
+    QJsonArray responses;
+    for (const auto &call : calls)
+    {
+      responses.append(methodCall(call.toArray(), responses));
+    }
+    QJsonObject result{{"methodResponses", responses}, {"sessionState", "0"}};
+    reply(socket, 200, QJsonDocument(result).toJson(QJsonDocument::Compact));
+  }
+  else
+  {
+    reply(socket, 404, QByteArray());
+  }
+}
+
+QJsonObject CJmapStandIn::session(void) const
+{
+  return QJsonObject{
+      {"capabilities", QJsonObject{{CAP_CORE, QJsonObject()}, {CAP_MAIL, QJsonObject()}}},
+      {"accounts", QJsonObject{{ACCOUNT, QJsonObject{{"name", "test"}}}}},
+      {"primaryAccounts", QJsonObject{{CAP_MAIL, ACCOUNT}}},
+      {"apiUrl", url() + "/api"},
+      {"eventSourceUrl", url() + "/events?types={types}&closeafter={closeafter}&ping={ping}"},
+      {"state", "0"}};
+}
+
+/*
+ * One method call, responses holds the responses of the calls before
+ * it for result references
+ */
+QJsonArray CJmapStandIn::methodCall(const QJsonArray &call, const QJsonArray &responses)
+{
+  const QString name = call.at(0).toString();
+  QJsonObject args = call.at(1).toObject();
+  const QString id = call.at(2).toString();
+  m_Calls[name]++;
+
+  if (args.contains("#ids"))
+  {
+    const QJsonObject ref = args.take("#ids").toObject();
+    for (const auto &value : responses)
+    {
+      const QJsonArray response = value.toArray();
+      if ((response.at(2).toString() == ref["resultOf"].toString()) &&
+          (response.at(0).toString() == ref["name"].toString()))
+      {
+        args["ids"] = response.at(1).toObject()[ref["path"].toString().mid(1)];
+      }
+    }
+  }
+  if (name == "Mailbox/get")
+  {
+    return QJsonArray{name, mailboxGet(args), id};
+  }
+  if (name == "Mailbox/changes")
+  {
+    bool ok;
+    QJsonObject result = mailboxChanges(args, ok);
+    if (ok)
+    {
+      return QJsonArray{name, result, id};
+    }
+    return QJsonArray{"error", QJsonObject{{"type", "cannotCalculateChanges"}}, id};
+  }
+  return QJsonArray{"error", QJsonObject{{"type", "unknownMethod"}}, id};
+}
+
+QJsonObject CJmapStandIn::mailboxGet(const QJsonObject &args)
+{
+  QStringList ids;
+  if (args["ids"].isNull())
+  {
+    m_Calls["Mailbox/get all"]++;
+    ids = m_Mailboxes.keys();
+  }
+  else
+  {
+    for (const auto &value : args["ids"].toArray())
+    {
+      ids.append(value.toString());
+    }
+  }
+  QJsonArray list;
+  QJsonArray notFound;
+  for (const QString &id : std::as_const(ids))
+  {
+    auto it = m_Mailboxes.constFind(id);
+    if (it == m_Mailboxes.constEnd())
+    {
+      notFound.append(id);
+      continue;
+    }
+    list.append(QJsonObject{{"id", id},
+                            {"name", it->m_Name},
+                            {"role", it->m_Role},
+                            {"totalEmails", it->m_Total},
+                            {"unreadEmails", it->m_Unread}});
+  }
+  return QJsonObject{{"accountId", ACCOUNT},
+                     {"state", QString::number(m_State)},
+                     {"list", list},
+                     {"notFound", notFound}};
+}
+
+QJsonObject CJmapStandIn::mailboxChanges(const QJsonObject &args, bool &ok)
+{
+  int since = args["sinceState"].toString().toInt(&ok);
+  ok = ok && (since <= m_State);
+  QJsonArray updated;
+  for (auto it = m_Mailboxes.cbegin(); it != m_Mailboxes.cend(); ++it)
+  {
+    if (it->m_Changed > since)
+    {
+      updated.append(it.key());
+    }
+  }
+  return QJsonObject{{"accountId", ACCOUNT},
+                     {"oldState", QString::number(since)},
+                     {"newState", QString::number(m_State)},
+                     {"hasMoreChanges", false},
+                     {"created", QJsonArray()},
+                     {"updated", updated},
+                     {"destroyed", QJsonArray()}};
+}
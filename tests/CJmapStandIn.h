@@ -0,0 +1,103 @@
+/*
+ * CJmapStandIn.h
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Minimal JMAP server on the loopback interface to test the JMAP
+ * backend offline: session resource, Mailbox/get, Mailbox/changes and
+ * the EventSource push channel.
+ */
+
+#ifndef CJMAPSTANDIN_H_
+#define CJMAPSTANDIN_H_
+
+#include <QByteArray>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QList>
+#include <QMap>
+#include <QString>
+#include <QTcpServer>
+#include <QTcpSocket>
+
+class CJmapStandIn : public QObject
+{
+  Q_OBJECT
+public:
+  CJmapStandIn(QObject *parent = nullptr);
+
+  /*
+   * Listen on a free port of 127.0.0.1
+   */
+  bool listen(void);
+
+  /*
+   * Base URL of the server, e.g. http://127.0.0.1:4711
+   */
+  QString url(void) const;
+
+  void addMailbox(const QString &id, const QString &name, const QString &role,
+                  int total, int unread);
+
+  /*
+   * Change the counts of a mailbox. The mailbox state advances and the
+   * change is pushed to the open EventSource channels.
+   */
+  void setCounts(const QString &id, int total, int unread);
+
+  /*
+   * Number of method calls by name since start. Mailbox/get calls
+   * without ids, i.e. fetching all mailboxes, are also counted as
+   * "Mailbox/get all".
+   */
+  int calls(const QString &method) const
+  {
+    return m_Calls.value(method);
+  }
+
+  /*
+   * Number of open EventSource channels
+   */
+  int eventStreams(void) const
+  {
+    return m_Events.size();
+  }
+
+private slots:
+  void newConnection(void);
+  void readClient(void);
+  void clientDisconnected(void);
+
+private:
+  struct SMailbox
+  {
+    QString m_Name;
+    QString m_Role;
+    int m_Total = 0;
+    int m_Unread = 0;
+    int m_Changed = 0; // State of the last change
+  };
+
+  void handleRequest(QTcpSocket *socket, const QByteArray &method,
+                     const QByteArray &path, const QByteArray &body);
+  void reply(QTcpSocket *socket, int status, const QByteArray &body);
+  QJsonObject session(void) const;
+  QJsonArray methodCall(const QJsonArray &call, const QJsonArray &responses);
+  QJsonObject mailboxGet(const QJsonObject &args);
+  QJsonObject mailboxChanges(const QJsonObject &args, bool &ok);
+
+  QTcpServer m_Server;
+  QHash<QTcpSocket *, QByteArray> m_Buffers;
+  QList<QTcpSocket *> m_Events;
+  QMap<QString, SMailbox> m_Mailboxes;
+  int m_State = 1;
+  QHash<QString, int> m_Calls;
+
+  inline const static QString ACCOUNT = "a1";
+};
+
+#endif /* CJMAPSTANDIN_H_ */
@@ -0,0 +1,143 @@
+/*
+ * CTokenStandIn.cpp
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Minimal OAuth 2.0 token endpoint on the loopback interface to test
+ * the token refresh offline.
+ *
+ * HTTP/1.1 with Content-Length only, persistent connections. Only the
+ * refresh_token grant of RFC 6749 section 6 is answered, the client is
+ * not authenticated.
+ */
+
+#include "CTokenStandIn.h"
+
+#include <QHostAddress>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QUrlQuery>
+
+CTokenStandIn::CTokenStandIn(QObject *parent) : QObject(parent)
+{
+  connect(&m_Server, &QTcpServer::newConnection, this, &CTokenStandIn::newConnection);
+}
+
+bool CTokenStandIn::listen(void)
+{
+  return m_Server.listen(QHostAddress::LocalHost, 0);
+}
+
+QString CTokenStandIn::url(void) const
+{
+  return QString("http://127.0.0.1:%1/token").arg(m_Server.serverPort());
+}
+
+void CTokenStandIn::setToken(const QString &access, int expires, const QString &refresh)
+{
+  m_Access = access;
+  m_Expires = expires;
+  m_Refresh = refresh;
+  m_Error.clear();
+}
+
+void CTokenStandIn::setError(const QString &error)
+{
+  m_Error = error;
+}
+
+void CTokenStandIn::newConnection(void)
+{
+  while (QTcpSocket *socket = m_Server.nextPendingConnection())
+  {
+    m_Buffers.insert(socket, QByteArray());
+    connect(socket, &QTcpSocket::readyRead, this, &CTokenStandIn::readClient);
+    connect(socket, &QTcpSocket::disconnected, this, &CTokenStandIn::clientDisconnected);
+  }
+}
+
+void CTokenStandIn::clientDisconnected(void)
+{
+  auto *socket = qobject_cast<QTcpSocket *>(sender());
+  m_Buffers.remove(socket);
+  socket->deleteLater();
+}
+
+void CTokenStandIn::readClient(void)
+{
+  auto *socket = qobject_cast<QTcpSocket *>(sender());
+  QByteArray &buffer = m_Buffers[socket];
+  buffer += socket->readAll();
+  qsizetype end;
+  while ((end = buffer.indexOf("\r\n\r\n")) >= 0)
+  {
+    const QList<QByteArray> lines = buffer.left(end).split('\n');
+    const QList<QByteArray> request = lines.at(0).trimmed().split(' ');
+    qsizetype length = 0;
+    for (const QByteArray &line : lines)
+    {
+      if (line.toLower().startsWith("content-length:"))
+      {
+        length = line.mid(15).trimmed().toLongLong();
+      }
+    }
+    if (buffer.size() < end + 4 + length)
+    {
+      return; // Body not complete
+    }
+    const QByteArray body = buffer.mid(end + 4, length);
+    buffer.remove(0, end + 4 + length);
+    if (request.size() < 2)
+    {
+      reply(socket, 400, QByteArray());
+      continue;
+    }
+    handleRequest(socket, request.at(0), request.at(1), body);
+  }
+}
+
+void CTokenStandIn::reply(QTcpSocket *socket, int status, const QByteArray &body)
+{
+  QByteArray response = "HTTP/1.1 " + QByteArray::number(status) +
+                        ((status == 200) ? " OK" : " Error") + "\r\n" +
+                        "Content-Type: application/json\r\n" +
+                        "Cache-Control: no-store\r\n" +
+                        "Content-Length: " + QByteArray::number(body.size()) +
+                        "\r\n\r\n" + body;
+  socket->write(response);
+}
+
+void CTokenStandIn::handleRequest(QTcpSocket *socket, const QByteArray &method,
+                                  const QByteArray &path, const QByteArray &body)
+{
+  if ((method != "POST") || (path != "/token"))
+  {
+    reply(socket, 404, QByteArray());
+    return;
+  }
+  QUrlQuery form(QString::fromUtf8(body));
+  if (form.queryItemValue("grant_type") != "refresh_token")
+  {
+    QJsonObject error{{"error", "unsupported_grant_type"}};
+    reply(socket, 400, QJsonDocument(error).toJson(QJsonDocument::Compact));
+    return;
+  }
+  m_RefreshTokens.append(form.queryItemValue("refresh_token", QUrl::FullyDecoded));
+  if (!m_Error.isEmpty())
+  {
+    QJsonObject error{{"error", m_Error}};
+    reply(socket, 400, QJsonDocument(error).toJson(QJsonDocument::Compact));
+    return;
+  }
+  QJsonObject token{{"access_token", m_Access},
+                    {"token_type", "Bearer"},
+                    {"expires_in", m_Expires}};
+  if (!m_Refresh.isEmpty())
+  {
+    token["refresh_token"] = m_Refresh;
+  }
+  reply(socket, 200, QJsonDocument(token).toJson(QJsonDocument::Compact));
+}
@@ -0,0 +1,79 @@
+/*
+ * CTokenStandIn.h
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Minimal OAuth 2.0 token endpoint on the loopback interface to test
+ * the token refresh offline: refresh_token grants, rotated refresh
+ * tokens and error responses.
+ */
+
+#ifndef CTOKENSTANDIN_H_
+#define CTOKENSTANDIN_H_
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <QStringList>
+#include <QTcpServer>
+#include <QTcpSocket>
+
+class CTokenStandIn : public QObject
+{
+  Q_OBJECT
+public:
+  CTokenStandIn(QObject *parent = nullptr);
+
+  /*
+   * Listen on a free port of 127.0.0.1
+   */
+  bool listen(void);
+
+  /*
+   * URL of the token endpoint, e.g. http://127.0.0.1:4711/token
+   */
+  QString url(void) const;
+
+  /*
+   * Answer the next grants with this access token. A non empty refresh
+   * token is issued as rotated refresh token.
+   */
+  void setToken(const QString &access, int expires,
+                const QString &refresh = QString());
+
+  /*
+   * Answer the next grants with an error, e.g. invalid_grant
+   */
+  void setError(const QString &error);
+
+  /*
+   * Refresh tokens of the grants received since start
+   */
+  const QStringList &refreshTokens(void) const
+  {
+    return m_RefreshTokens;
+  }
+
+private slots:
+  void newConnection(void);
+  void readClient(void);
+  void clientDisconnected(void);
+
+private:
+  void handleRequest(QTcpSocket *socket, const QByteArray &method,
+                     const QByteArray &path, const QByteArray &body);
+  void reply(QTcpSocket *socket, int status, const QByteArray &body);
+
+  QTcpServer m_Server;
+  QHash<QTcpSocket *, QByteArray> m_Buffers;
+  QStringList m_RefreshTokens;
+  QString m_Access;
+  QString m_Refresh;
+  QString m_Error;
+  int m_Expires = 3600;
+};
+
+#endif /* CTOKENSTANDIN_H_ */
@@ -0,0 +1,129 @@
+/*
+ * tst_jmap.cpp
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * JMAP backend against the loopback stand-in server: counts of the
+ * first poll, pushed state changes fetched with Mailbox/changes and
+ * the closed push channel of a paused mailbox.
+ */
+
+#include <QNetworkProxy>
+#include <QSignalSpy>
+#include <QStandardPaths>
+#include <QTest>
+
+#include "CJmapStandIn.h"
+#include "protocols/CJmap.h"
+
+class TestJmap : public QObject
+{
+  Q_OBJECT
+
+private slots:
+  void initTestCase(void);
+  void pollCounts(void);
+  void pushChanges(void);
+  void stopPush(void);
+
+private:
+  inline const static int PUSH_TIMEOUT = 5 * 1000;
+};
+
+void TestJmap::initTestCase(void)
+{
+  QStandardPaths::setTestModeEnabled(true);
+  QCoreApplication::setApplicationName("TrayBiffTest");
+  QCoreApplication::setOrganizationName("uli-eckhardt");
+  // The stand-in is on the loopback interface
+  QNetworkProxy::setApplicationProxy(QNetworkProxy::NoProxy);
+}
+
+/*
+ * The first poll reads the session and all mailboxes, only the inbox
+ * is counted
+ */
+void TestJmap::pollCounts(void)
+{
+  CJmapStandIn server;
+  QVERIFY(server.listen());
+  server.addMailbox("m1", "Inbox", "inbox", 5, 2);
+  server.addMailbox("m2", "Archive", "archive", 10, 4);
+
+  CJmap jmap(server.url(), "user", "secret", 0, "inbox", false);
+  QSignalSpy results(&jmap, &IMailProtocol::resultReady);
+  QSignalSpy errors(&jmap, &IMailProtocol::mailError);
+  jmap.poll();
+  QCOMPARE(errors.count(), 0);
+  QCOMPARE(results.count(), 1);
+  QCOMPARE(results.at(0).at(1).toInt(), 2); // Unread
+  QCOMPARE(results.at(0).at(2).toInt(), 3); // Read
+  QCOMPARE(server.calls("Mailbox/get all"), 1);
+
+  // The next poll only asks for the changes
+  server.setCounts("m2", 11, 5);
+  jmap.poll();
+  QCOMPARE(errors.count(), 0);
+  QCOMPARE(results.count(), 2);
+  QCOMPARE(results.at(1).at(1).toInt(), 2);
+  QCOMPARE(server.calls("Mailbox/changes"), 1);
+  QCOMPARE(server.calls("Mailbox/get all"), 1);
+}
+
+/*
+ * A state change pushed over the EventSource is fetched without a poll
+ */
+void TestJmap::pushChanges(void)
+{
+  CJmapStandIn server;
+  QVERIFY(server.listen());
+  server.addMailbox("m1", "Inbox", "inbox", 5, 2);
+
+  CJmap jmap(server.url(), "user", "secret", 0, "inbox", false);
+  QSignalSpy results(&jmap, &IMailProtocol::resultReady);
+  jmap.poll();
+  QCOMPARE(results.count(), 1);
+  QTRY_COMPARE_WITH_TIMEOUT(server.eventStreams(), 1, PUSH_TIMEOUT);
+
+  server.setCounts("m1", 7, 3);
+  QTRY_COMPARE_WITH_TIMEOUT(results.count(), 2, PUSH_TIMEOUT);
+  QCOMPARE(results.at(1).at(1).toInt(), 3);
+  QCOMPARE(results.at(1).at(2).toInt(), 4);
+  QCOMPARE(server.calls("Mailbox/changes"), 1);
+  QCOMPARE(server.calls("Mailbox/get all"), 1);
+}
+
+/*
+ * A paused mailbox closes its push channel and reports nothing until
+ * the next poll
+ */
+void TestJmap::stopPush(void)
+{
+  CJmapStandIn server;
+  QVERIFY(server.listen());
+  server.addMailbox("m1", "Inbox", "inbox", 5, 2);
+
+  CJmap jmap(server.url(), "user", "secret", 0, "inbox", false);
+  QSignalSpy results(&jmap, &IMailProtocol::resultReady);
+  jmap.poll();
+  QTRY_COMPARE_WITH_TIMEOUT(server.eventStreams(), 1, PUSH_TIMEOUT);
+
+  jmap.stopPush();
+  QTRY_COMPARE_WITH_TIMEOUT(server.eventStreams(), 0, PUSH_TIMEOUT);
+  server.setCounts("m1", 7, 3);
+  QTest::qWait(500);
+  QCOMPARE(results.count(), 1);
+  QCOMPARE(server.calls("Mailbox/changes"), 0);
+
+  // Resumed by the next poll
+  jmap.poll();
+  QCOMPARE(results.count(), 2);
+  QCOMPARE(results.at(1).at(1).toInt(), 3);
+  QTRY_COMPARE_WITH_TIMEOUT(server.eventStreams(), 1, PUSH_TIMEOUT);
+}
+
+QTEST_MAIN(TestJmap)
+#include "tst_jmap.moc"
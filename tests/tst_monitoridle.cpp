@@ -0,0 +1,81 @@
+/*
+ * tst_monitoridle.cpp
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * Wakeups of the idle mail monitor. The monitor must sleep until the
+ * next poll is due and stop at once when it is halted.
+ */
+
+#include <QElapsedTimer>
+#include <QStandardPaths>
+#include <QTest>
+
+#include "protocols/CMailMonitor.h"
+
+class TestMonitorIdle : public QObject
+{
+  Q_OBJECT
+
+private slots:
+  void initTestCase(void);
+  void idleWakeups(void);
+  void haltLatency(void);
+
+private:
+  inline const static int POLL_TIME = 2; // s
+  inline const static int IDLE_TIME = 5 * 1000;
+  inline const static int HALT_LATENCY = 200; // ms
+};
+
+void TestMonitorIdle::initTestCase(void)
+{
+  QStandardPaths::setTestModeEnabled(true);
+  QCoreApplication::setApplicationName("TrayBiffTest");
+  QCoreApplication::setOrganizationName("uli-eckhardt");
+}
+
+/*
+ * Without mailboxes the monitor wakes up once per poll time. Waiting
+ * in steps of one second would wake it up IDLE_TIME / 1000 times.
+ */
+void TestMonitorIdle::idleWakeups(void)
+{
+  CMailMonitor monitor;
+  monitor.updatePollTime(POLL_TIME);
+  monitor.updatePowerPolicy(false, 1, false, 0);
+  monitor.start();
+  QTest::qWait(IDLE_TIME);
+  qint64 wakeups = monitor.wakeups();
+  double perHour = monitor.wakeupsPerHour();
+  monitor.halt();
+  QVERIFY(monitor.wait(HALT_LATENCY * 10));
+
+  const qint64 expected = IDLE_TIME / (POLL_TIME * 1000);
+  qInfo() << "Idle wakeups " << wakeups << ", per hour " << perHour;
+  QVERIFY2(wakeups <= expected + 1,
+           qPrintable(QString("%1 wakeups in %2 ms").arg(wakeups).arg(IDLE_TIME)));
+  QVERIFY(perHour <= (expected + 1) * 3600.0 * 1000 / IDLE_TIME);
+}
+
+void TestMonitorIdle::haltLatency(void)
+{
+  CMailMonitor monitor;
+  monitor.updatePollTime(60 * 60);
+  monitor.updatePowerPolicy(false, 1, false, 0);
+  monitor.start();
+  QTest::qWait(100);
+  QElapsedTimer timer;
+  timer.start();
+  monitor.halt();
+  QVERIFY(monitor.wait(HALT_LATENCY * 10));
+  QVERIFY2(timer.elapsed() < HALT_LATENCY,
+           qPrintable(QString("halt took %1 ms").arg(timer.elapsed())));
+  QCOMPARE(monitor.wakeups(), qint64(1)); // The halt itself
+}
+
+QTEST_MAIN(TestMonitorIdle)
+#include "tst_monitoridle.moc"
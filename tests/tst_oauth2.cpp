@@ -0,0 +1,114 @@
+/*
+ * tst_oauth2.cpp
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * OAuth 2.0 token refresh against the loopback stand-in endpoint:
+ * refresh ahead of the expiry, rotated refresh tokens and a revoked
+ * refresh token.
+ */
+
+#include <QNetworkProxy>
+#include <QSignalSpy>
+#include <QTest>
+
+#include "CTokenStandIn.h"
+#include "protocols/COAuth2.h"
+
+class TestOAuth2 : public QObject
+{
+  Q_OBJECT
+
+private slots:
+  void initTestCase(void);
+  void refreshAhead(void);
+  void rotation(void);
+  void invalidGrant(void);
+
+private:
+  inline const static int REPLY_TIMEOUT = 5 * 1000;
+};
+
+void TestOAuth2::initTestCase(void)
+{
+  // The stand-in is on the loopback interface
+  QNetworkProxy::setApplicationProxy(QNetworkProxy::NoProxy);
+}
+
+/*
+ * A token valid for 20 s is refreshed after three quarters of its
+ * lifetime, but not before RETRY_MIN (15 s).
+ */
+void TestOAuth2::refreshAhead(void)
+{
+  CTokenStandIn server;
+  QVERIFY(server.listen());
+  server.setToken("a1", 20);
+
+  COAuth2 oauth(server.url(), "client", QString());
+  QSignalSpy changed(&oauth, &COAuth2::tokenChanged);
+  oauth.setRefreshToken("r1");
+  QVERIFY(changed.wait(REPLY_TIMEOUT));
+  QCOMPARE(server.refreshTokens(), QStringList{"r1"});
+
+  QTest::qWait(10 * 1000);
+  QCOMPARE(server.refreshTokens().size(), 1);
+  QTRY_COMPARE_WITH_TIMEOUT(server.refreshTokens().size(), 2, 10 * 1000);
+  QCOMPARE(server.refreshTokens().at(1), QString("r1"));
+}
+
+/*
+ * A rotated refresh token is reported once and used for the next
+ * refresh
+ */
+void TestOAuth2::rotation(void)
+{
+  CTokenStandIn server;
+  QVERIFY(server.listen());
+  server.setToken("a1", 3600, "r2");
+
+  COAuth2 oauth(server.url(), "client", "secret");
+  QSignalSpy changed(&oauth, &COAuth2::tokenChanged);
+  QSignalSpy rotated(&oauth, &COAuth2::refreshTokenChanged);
+  oauth.setRefreshToken("r1");
+  QVERIFY(changed.wait(REPLY_TIMEOUT));
+  QCOMPARE(oauth.accessToken(), QString("a1"));
+  QCOMPARE(rotated.count(), 1);
+  QCOMPARE(rotated.at(0).at(0).toString(), QString("r2"));
+
+  // The server rejected the access token
+  oauth.invalidate();
+  QVERIFY(changed.wait(REPLY_TIMEOUT));
+  QCOMPARE(server.refreshTokens(), (QStringList{"r1", "r2"}));
+  QCOMPARE(rotated.count(), 1); // Same refresh token issued again
+}
+
+/*
+ * A revoked refresh token is not retried until a new one is set
+ */
+void TestOAuth2::invalidGrant(void)
+{
+  CTokenStandIn server;
+  QVERIFY(server.listen());
+  server.setError("invalid_grant");
+
+  COAuth2 oauth(server.url(), "client", QString());
+  QSignalSpy changed(&oauth, &COAuth2::tokenChanged);
+  oauth.setRefreshToken("r1");
+  QVERIFY(changed.wait(REPLY_TIMEOUT));
+  QVERIFY(oauth.accessToken().isEmpty());
+  QTest::qWait(500);
+  QCOMPARE(server.refreshTokens().size(), 1);
+
+  server.setToken("a2", 3600);
+  oauth.setRefreshToken("r3");
+  QVERIFY(changed.wait(REPLY_TIMEOUT));
+  QCOMPARE(oauth.accessToken(), QString("a2"));
+  QCOMPARE(server.refreshTokens(), (QStringList{"r1", "r3"}));
+}
+
+QTEST_GUILESS_MAIN(TestOAuth2)
+#include "tst_oauth2.moc"
@@ -0,0 +1,136 @@
+/*
+ * tst_scram.cpp
+ *
+ * Copyright (C) 2021-2024 Ulrich Eckhardt <uli@uli-eckhardt.de>
+ *
+ * This code is distributed under the terms and conditions of the
+ * GNU GENERAL PUBLIC LICENSE. See the file COPYING for details.
+ *
+ * SCRAM-SHA-256 against the test vector of RFC 7677 and the cost of a
+ * login with and without the key cache.
+ */
+
+#include <QCryptographicHash>
+#include <QRandomGenerator>
+#include <QTest>
+
+#include "protocols/CCrypt.h"
+
+class TestScram : public QObject
+{
+  Q_OBJECT
+
+private slots:
+  void rfc7677(void);
+  void cacheKey(void);
+  void loginUncached(void);
+  void loginCached(void);
+
+private:
+  bool authenticate(void);
+
+  inline const static QString USER = "user";
+  inline const static QString PASSWORD = "pencil";
+  inline const static int ITERATIONS = 4096;
+};
+
+/*
+ * Example exchange of RFC 7677 section 3. The client nonce is random,
+ * so the proof and the server signature are computed from the keys.
+ */
+void TestScram::rfc7677(void)
+{
+  const QByteArray salt = QByteArray::fromBase64("W22ZaJ0SNY7soEsUEjb6gQ==");
+  const QByteArray authMessage =
+      "n=user,r=rOprNGfwEbeRWgbNEkqO,"
+      "r=rOprNGfwEbeRWgbNEkqO%hvYDpWUa2RaTCAfuxFIlj)hNlF$k0,"
+      "s=W22ZaJ0SNY7soEsUEjb6gQ==,i=4096,"
+      "c=biws,r=rOprNGfwEbeRWgbNEkqO%hvYDpWUa2RaTCAfuxFIlj)hNlF$k0";
+  QByteArray clientKey;
+  QByteArray serverKey;
+  CCrypt::clearScramCache();
+  CCrypt::scramKeys(PASSWORD, salt, ITERATIONS, clientKey, serverKey);
+
+  const QByteArray storedKey =
+      QCryptographicHash::hash(clientKey, QCryptographicHash::Sha256);
+  const QByteArray signature = CCrypt::hmac_sha256(storedKey, authMessage);
+  QByteArray proof = clientKey;
+  for (int i = 0; i < proof.size(); i++)
+  {
+    proof[i] = static_cast<char>(proof[i] ^ signature[i]);
+  }
+  QCOMPARE(proof.toBase64(), QByteArray("dHzbZapWIk4jUhN+Ute9ytag9zjfMHgsqmmiz7AndVQ="));
+  QCOMPARE(CCrypt::hmac_sha256(serverKey, authMessage).toBase64(),
+           QByteArray("6rriTRBi23WpRR/wtup+mMhUZUn/dB5nLTJRsjl95G4="));
+}
+
+/*
+ * Salt "ab" with 12 iterations and salt "ab1" with 2 iterations have
+ * the same bytes, the cache must not mix them up.
+ */
+void TestScram::cacheKey(void)
+{
+  QByteArray client1;
+  QByteArray server1;
+  QByteArray client2;
+  QByteArray server2;
+  CCrypt::clearScramCache();
+  CCrypt::scramKeys(PASSWORD, "ab", 12, client1, server1);
+  CCrypt::scramKeys(PASSWORD, "ab1", 2, client2, server2);
+  QVERIFY(client1 != client2);
+  QVERIFY(server1 != server2);
+}
+
+/*
+ * Full exchange against a simulated server, which derives its keys
+ * only once like a real server stores them.
+ */
+bool TestScram::authenticate(void)
+{
+  static QByteArray salt;
+  static QByteArray serverKey;
+  if (salt.isEmpty())
+  {
+    salt = QByteArray::number(QRandomGenerator::global()->generate64());
+    QByteArray clientKey;
+    CCrypt::scramKeys(PASSWORD, salt, ITERATIONS, clientKey, serverKey);
+  }
+  const QByteArray serverNonce = QByteArray::number(QRandomGenerator::global()->generate64());
+
+  CScram scram(USER, PASSWORD);
+  const QByteArray first = scram.clientFirst();
+  const QByteArray nonce = first.mid(first.indexOf(",r=") + 3);
+  const QByteArray serverFirst = "r=" + nonce + serverNonce + ",s=" +
+                                 salt.toBase64() + ",i=" +
+                                 QByteArray::number(ITERATIONS);
+  QByteArray final;
+  if (!scram.clientFinal(serverFirst, final))
+  {
+    return false;
+  }
+  const QByteArray authMessage = first.mid(3) + "," + serverFirst + "," +
+                                 final.left(final.indexOf(",p="));
+  return scram.verifyServer("v=" + CCrypt::hmac_sha256(serverKey, authMessage).toBase64());
+}
+
+void TestScram::loginUncached(void)
+{
+  QVERIFY(authenticate());
+  QBENCHMARK
+  {
+    CCrypt::clearScramCache();
+    QVERIFY(authenticate());
+  }
+}
+
+void TestScram::loginCached(void)
+{
+  QVERIFY(authenticate());
+  QBENCHMARK
+  {
+    QVERIFY(authenticate());
+  }
+}
+
+QTEST_GUILESS_MAIN(TestScram)
+#include "tst_scram.moc"